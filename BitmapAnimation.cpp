@@ -0,0 +1,403 @@
+#include "pch.h"
+#include "BitmapAnimation.h"
+
+const uint32_t c_repeatFlag = 0x80000000;
+const uint32_t c_maxRunLength = 0x7FFFFFFF;
+
+// Prefetching is done this many frames at a time, as soon as playback gets within as many
+// frames of the end of what was prefetched last.
+const uint32_t c_readAheadFrames = 16;
+
+// Shared frames can still be waiting in FramePipeline's triple buffer this many frames later.
+const uint32_t c_framesKeptBehind = 3;
+
+// Frames behind playback are evicted once there is at least this much of them.
+const uint64_t c_evictionBatchSize = 1024 * 1024;
+const uint64_t c_pageSize = 4096;
+
+static void AppendToken(std::vector<uint8_t>& encoded, uint32_t token)
+{
+    const uint8_t bytes[]{
+        static_cast<uint8_t>(token),
+        static_cast<uint8_t>(token >> 8),
+        static_cast<uint8_t>(token >> 16),
+        static_cast<uint8_t>(token >> 24) };
+    encoded.insert(encoded.end(), std::begin(bytes), std::end(bytes));
+}
+
+static void EncodeRunLength(const std::vector<uint8_t>& frame, size_t pixelSize, std::vector<uint8_t>& encoded)
+{
+    const uint8_t* pixels = frame.data();
+    const size_t pixelCount = frame.size() / pixelSize;
+
+    // Below this a repeat run takes more bytes than leaving its pixels in the literal run around it,
+    // which would have to be split in two
+    const size_t minRepeatLength = 2 + 2 * sizeof(uint32_t) / pixelSize;
+
+    encoded.clear();
+
+    size_t literalStart = 0;
+    auto appendLiterals = [&](size_t end)
+    {
+        while (literalStart < end)
+        {
+            const size_t count = std::min<size_t>(end - literalStart, c_maxRunLength);
+            AppendToken(encoded, static_cast<uint32_t>(count));
+            encoded.insert(encoded.end(), pixels + literalStart * pixelSize, pixels + (literalStart + count) * pixelSize);
+            literalStart += count;
+        }
+    };
+
+    size_t i = 0;
+    while (i < pixelCount)
+    {
+        size_t length = 1;
+        while ((i + length < pixelCount) &&
+            (length < c_maxRunLength) &&
+            (memcmp(pixels + i * pixelSize, pixels + (i + length) * pixelSize, pixelSize) == 0))
+        {
+            length++;
+        }
+
+        if (length >= minRepeatLength)
+        {
+            appendLiterals(i);
+            AppendToken(encoded, c_repeatFlag | static_cast<uint32_t>(length));
+            encoded.insert(encoded.end(), pixels + i * pixelSize, pixels + (i + 1) * pixelSize);
+            literalStart = i + length;
+        }
+
+        i += length;
+    }
+
+    appendLiterals(pixelCount);
+}
+
+BitmapAnimationWriter::BitmapAnimationWriter(const std::filesystem::path& path, uint32_t width, uint32_t height, BitmapFormat format) :
+    m_file(path, std::ios::binary | std::ios::trunc)
+{
+    THROW_HR_IF(E_INVALIDARG, (width == 0) || (height == 0) || (GetBytesPerPixel(format) == 0));
+
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(width, height, format, rowSize, chromaOffset, totalSize);
+    THROW_HR_IF(E_INVALIDARG, totalSize > std::numeric_limits<uint32_t>::max());
+
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_OPEN_FAILED), !m_file.is_open());
+
+    m_header.width = width;
+    m_header.height = height;
+    m_header.format = format;
+
+    // Left without a magic until Finish, so an unfinished file is never played
+    Write(&m_header, sizeof(m_header));
+}
+
+void BitmapAnimationWriter::Write(const void* data, size_t size)
+{
+    m_file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), !m_file);
+    m_offset += size;
+}
+
+void BitmapAnimationWriter::WriteFrame(const BitmapView& bitmap, std::chrono::microseconds time)
+{
+    THROW_HR_IF(E_INVALIDARG, bitmap.Data == nullptr);
+    THROW_HR_IF(E_INVALIDARG,
+        (bitmap.Width != m_header.width) ||
+        (bitmap.Height != m_header.height) ||
+        (bitmap.Format != m_header.format));
+    THROW_HR_IF(E_INVALIDARG, (bitmap.Format == BitmapFormat::NV12) && (bitmap.ChromaData == nullptr));
+    THROW_HR_IF(E_INVALIDARG, time.count() < 0);
+    THROW_HR_IF(E_INVALIDARG, !m_index.empty() && (static_cast<uint64_t>(time.count()) < m_index.back().timeInMicroseconds));
+
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(bitmap.Width, bitmap.Height, bitmap.Format, rowSize, chromaOffset, totalSize);
+    const size_t chromaRowSize = (static_cast<size_t>(bitmap.Width) + 1) & ~static_cast<size_t>(1);
+    const uint32_t chromaRowCount = (bitmap.Format == BitmapFormat::NV12) ? (bitmap.Height + 1) / 2 : 0;
+
+    m_packedFrame.resize(totalSize);
+    for (uint32_t y = 0; y < bitmap.Height; y++)
+    {
+        memcpy(m_packedFrame.data() + y * rowSize, bitmap.Data + static_cast<size_t>(y) * bitmap.StrideInBytes, rowSize);
+    }
+    for (uint32_t y = 0; y < chromaRowCount; y++)
+    {
+        memcpy(
+            m_packedFrame.data() + chromaOffset + y * chromaRowSize,
+            bitmap.ChromaData + static_cast<size_t>(y) * bitmap.ChromaStrideInBytes,
+            chromaRowSize);
+    }
+
+    BitmapAnimationFrameEntry entry{};
+    entry.timeInMicroseconds = static_cast<uint64_t>(time.count());
+
+    // A frame held for a while shares the data of the previous one
+    if (!m_index.empty() && (m_packedFrame == m_previousFrame))
+    {
+        entry.offset = m_index.back().offset;
+        entry.size = m_index.back().size;
+        entry.compression = m_index.back().compression;
+        m_index.push_back(entry);
+        return;
+    }
+
+    EncodeRunLength(m_packedFrame, GetBytesPerPixel(bitmap.Format), m_encodedFrame);
+    const bool isEncoded = m_encodedFrame.size() < totalSize;
+
+    if (!isEncoded)
+    {
+        const uint8_t padding[BitmapAnimationFileHeader::c_frameAlignment]{};
+        Write(padding, static_cast<size_t>((BitmapAnimationFileHeader::c_frameAlignment - m_offset % BitmapAnimationFileHeader::c_frameAlignment) % BitmapAnimationFileHeader::c_frameAlignment));
+    }
+
+    entry.offset = m_offset;
+    entry.size = static_cast<uint32_t>(isEncoded ? m_encodedFrame.size() : totalSize);
+    entry.compression = isEncoded ? BitmapAnimationCompression::RunLength : BitmapAnimationCompression::None;
+    Write(isEncoded ? m_encodedFrame.data() : m_packedFrame.data(), entry.size);
+    m_index.push_back(entry);
+
+    m_previousFrame.swap(m_packedFrame);
+}
+
+void BitmapAnimationWriter::Finish(std::chrono::microseconds duration)
+{
+    THROW_HR_IF(E_INVALIDARG, m_index.empty());
+    THROW_HR_IF(E_INVALIDARG, static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0)) < m_index.back().timeInMicroseconds);
+    THROW_HR_IF(E_INVALIDARG, m_index.size() > std::numeric_limits<uint32_t>::max());
+
+    const uint8_t padding[alignof(BitmapAnimationFrameEntry)]{};
+    Write(padding, static_cast<size_t>((alignof(BitmapAnimationFrameEntry) - m_offset % alignof(BitmapAnimationFrameEntry)) % alignof(BitmapAnimationFrameEntry)));
+
+    m_header.magic = BitmapAnimationFileHeader::c_magic;
+    m_header.version = BitmapAnimationFileHeader::c_version;
+    m_header.frameCount = static_cast<uint32_t>(m_index.size());
+    m_header.durationInMicroseconds = static_cast<uint64_t>(duration.count());
+    m_header.indexOffset = m_offset;
+    Write(m_index.data(), m_index.size() * sizeof(BitmapAnimationFrameEntry));
+
+    m_file.seekp(0);
+    Write(&m_header, sizeof(m_header));
+    m_file.flush();
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), !m_file);
+}
+
+BitmapAnimationSource::BitmapAnimationSource(const std::filesystem::path& path) :
+    m_file(std::make_shared<const MappedFile>(path))
+{
+    const uint64_t fileSize = m_file->GetSize();
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), fileSize < sizeof(BitmapAnimationFileHeader));
+
+    const uint8_t* data = m_file->GetData();
+    m_header = *reinterpret_cast<const BitmapAnimationFileHeader*>(data);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), m_header.magic != BitmapAnimationFileHeader::c_magic);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), m_header.version != BitmapAnimationFileHeader::c_version);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+        (m_header.width == 0) ||
+        (m_header.height == 0) ||
+        (GetBytesPerPixel(m_header.format) == 0) ||
+        (m_header.frameCount == 0));
+
+    // Frame sizes are stored in 32 bits, this keeps computing them from overflowing
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), static_cast<uint64_t>(m_header.width) * m_header.height > std::numeric_limits<uint32_t>::max());
+
+    size_t rowSize, chromaOffset;
+    GetPackedBitmapLayout(m_header.width, m_header.height, m_header.format, rowSize, chromaOffset, m_frameSize);
+
+    // Checked before computing where the index ends, so it can't overflow
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+        (m_header.indexOffset > fileSize) ||
+        (m_header.indexOffset % alignof(BitmapAnimationFrameEntry) != 0) ||
+        (m_header.frameCount > (fileSize - m_header.indexOffset) / sizeof(BitmapAnimationFrameEntry)));
+    m_index = reinterpret_cast<const BitmapAnimationFrameEntry*>(data + m_header.indexOffset);
+
+    // Frames are in the order they were written, which is also what prefetching relies on
+    uint64_t previousTime = 0;
+    uint64_t previousOffset = sizeof(BitmapAnimationFileHeader);
+    for (uint32_t i = 0; i < m_header.frameCount; i++)
+    {
+        const BitmapAnimationFrameEntry& entry = m_index[i];
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+            (entry.timeInMicroseconds < previousTime) ||
+            (entry.offset < previousOffset) ||
+            (entry.offset > m_header.indexOffset) ||
+            (entry.size > m_header.indexOffset - entry.offset));
+
+        switch (entry.compression)
+        {
+        case BitmapAnimationCompression::None:
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+                (entry.size != m_frameSize) ||
+                (entry.offset % BitmapAnimationFileHeader::c_frameAlignment != 0));
+            break;
+        case BitmapAnimationCompression::RunLength:
+            break;
+        default:
+            THROW_HR(HRESULT_FROM_WIN32(ERROR_INVALID_DATA));
+        }
+
+        previousTime = entry.timeInMicroseconds;
+        previousOffset = entry.offset;
+    }
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), m_header.durationInMicroseconds < previousTime);
+
+    // Lookups only touch a few pages of the index from now on
+    m_file->Evict(m_header.indexOffset, static_cast<uint64_t>(m_header.frameCount) * sizeof(BitmapAnimationFrameEntry));
+}
+
+uint32_t BitmapAnimationSource::GetFrameIndex(std::chrono::microseconds time) const
+{
+    const uint64_t timeInMicroseconds = static_cast<uint64_t>(std::max<int64_t>(time.count(), 0));
+
+    // The last frame starting at or before time
+    const BitmapAnimationFrameEntry* next = std::upper_bound(
+        m_index,
+        m_index + m_header.frameCount,
+        timeInMicroseconds,
+        [](uint64_t value, const BitmapAnimationFrameEntry& entry) { return value < entry.timeInMicroseconds; });
+
+    return (next == m_index) ? 0 : static_cast<uint32_t>(next - m_index - 1);
+}
+
+const BitmapAnimationFrameEntry& BitmapAnimationSource::GetEntry(uint32_t frameIndex) const
+{
+    THROW_HR_IF(E_BOUNDS, frameIndex >= m_header.frameCount);
+    return m_index[frameIndex];
+}
+
+BitmapView BitmapAnimationSource::GetPackedView(const uint8_t* pixels) const noexcept
+{
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(m_header.width, m_header.height, m_header.format, rowSize, chromaOffset, totalSize);
+
+    return BitmapView{
+        pixels,
+        m_header.width,
+        m_header.height,
+        static_cast<uint32_t>(rowSize),
+        m_header.format,
+        (m_header.format == BitmapFormat::NV12) ? pixels + chromaOffset : nullptr,
+        (m_header.format == BitmapFormat::NV12) ? ((m_header.width + 1) & ~1u) : 0 };
+}
+
+void BitmapAnimationSource::Decode(const BitmapAnimationFrameEntry& entry, uint8_t* destination) const
+{
+    const size_t pixelSize = GetBytesPerPixel(m_header.format);
+    const uint8_t* source = m_file->GetData() + entry.offset;
+    const uint8_t* sourceEnd = source + entry.size;
+    uint8_t* destinationEnd = destination + m_frameSize;
+
+    while (source != sourceEnd)
+    {
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), static_cast<size_t>(sourceEnd - source) < sizeof(uint32_t));
+        const uint32_t token =
+            static_cast<uint32_t>(source[0]) |
+            (static_cast<uint32_t>(source[1]) << 8) |
+            (static_cast<uint32_t>(source[2]) << 16) |
+            (static_cast<uint32_t>(source[3]) << 24);
+        source += sizeof(uint32_t);
+
+        const size_t length = token & c_maxRunLength;
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), length > static_cast<size_t>(destinationEnd - destination) / pixelSize);
+
+        const size_t sourceSize = ((token & c_repeatFlag) != 0) ? pixelSize : length * pixelSize;
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), sourceSize > static_cast<size_t>(sourceEnd - source));
+
+        if ((token & c_repeatFlag) != 0)
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                memcpy(destination + i * pixelSize, source, pixelSize);
+            }
+        }
+        else
+        {
+            memcpy(destination, source, sourceSize);
+        }
+
+        source += sourceSize;
+        destination += length * pixelSize;
+    }
+
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), destination != destinationEnd);
+}
+
+void BitmapAnimationSource::UpdateResidentFrames(uint32_t frameIndex) noexcept
+{
+    const uint64_t frameOffset = m_index[frameIndex].offset;
+
+    // Seeked, start over from here
+    if ((frameOffset < m_residentBegin) || (frameOffset > m_prefetchedEnd))
+    {
+        m_file->Evict(m_residentBegin, m_prefetchedEnd - m_residentBegin);
+        m_residentBegin = frameOffset;
+        m_prefetchedEnd = frameOffset;
+    }
+
+    const uint32_t lastFrame = m_header.frameCount - 1;
+    const BitmapAnimationFrameEntry& soonNeeded = m_index[std::min(frameIndex + c_readAheadFrames, lastFrame)];
+    if (soonNeeded.offset + soonNeeded.size > m_prefetchedEnd)
+    {
+        const BitmapAnimationFrameEntry& prefetchEnd = m_index[std::min(frameIndex + 2 * c_readAheadFrames, lastFrame)];
+        const uint64_t end = prefetchEnd.offset + prefetchEnd.size;
+        m_file->Prefetch(m_prefetchedEnd, end - m_prefetchedEnd);
+        m_prefetchedEnd = end;
+    }
+
+    if (frameIndex >= c_framesKeptBehind)
+    {
+        // Whole pages only, the page a kept frame starts in stays
+        const uint64_t evictionEnd = m_index[frameIndex - c_framesKeptBehind].offset & ~(c_pageSize - 1);
+        if ((evictionEnd > m_residentBegin) && (evictionEnd - m_residentBegin >= c_evictionBatchSize))
+        {
+            m_file->Evict(m_residentBegin, evictionEnd - m_residentBegin);
+            m_residentBegin = evictionEnd;
+        }
+    }
+}
+
+BitmapView BitmapAnimationSource::GetFrame(uint32_t frameIndex)
+{
+    const BitmapAnimationFrameEntry& entry = GetEntry(frameIndex);
+    UpdateResidentFrames(frameIndex);
+
+    if (entry.compression == BitmapAnimationCompression::None)
+    {
+        return GetPackedView(m_file->GetData() + entry.offset);
+    }
+
+    m_decodedFrame.resize(m_frameSize);
+    Decode(entry, m_decodedFrame.data());
+    return GetPackedView(m_decodedFrame.data());
+}
+
+void BitmapAnimationSource::PublishFrame(
+    uint32_t frameIndex,
+    FramePipeline& framePipeline,
+    bool isUrgent,
+    const FrameObserver& frameObserver)
+{
+    const BitmapAnimationFrameEntry& entry = GetEntry(frameIndex);
+    UpdateResidentFrames(frameIndex);
+
+    if (entry.compression == BitmapAnimationCompression::None)
+    {
+        const BitmapView bitmap = GetPackedView(m_file->GetData() + entry.offset);
+        if (frameObserver)
+        {
+            frameObserver(bitmap);
+        }
+
+        framePipeline.PublishSharedFrame(bitmap, m_file, isUrgent);
+        return;
+    }
+
+    // BeginFrame gives the same tightly packed layout the frames are stored in
+    uint8_t* pixels = framePipeline.BeginFrame(m_header.width, m_header.height, m_header.format);
+    Decode(entry, pixels);
+    if (frameObserver)
+    {
+        frameObserver(GetPackedView(pixels));
+    }
+
+    framePipeline.EndFrame(isUrgent);
+}
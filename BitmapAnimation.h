@@ -0,0 +1,141 @@
+#pragma once
+
+#include "FramePipeline.h"
+#include "MappedFile.h"
+
+// Pre-rendered animation file, e.g. a lighting show, played straight from a mapping. Little endian:
+//
+//   BitmapAnimationFileHeader
+//   Frames, each starting on a multiple of c_frameAlignment
+//   BitmapAnimationFrameEntry[frameCount] at indexOffset, in presentation order
+//
+// Every frame has the size and format of the header. Frames are stored tightly packed (with the
+// UV plane after the luma plane for NV12), or run-length encoded when that is smaller.
+struct BitmapAnimationFileHeader
+{
+    static const uint32_t c_magic = 0x4E41414C; // "LAAN" read as a little endian uint32
+    static const uint32_t c_version = 1;
+
+    // Packed frames are aligned for SIMD loads when sampled in place
+    static const uint32_t c_frameAlignment = 64;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    BitmapFormat format;
+    uint32_t frameCount;
+    uint64_t durationInMicroseconds;
+    uint64_t indexOffset;
+};
+
+enum class BitmapAnimationCompression : uint32_t
+{
+    None,
+
+    // Runs of whole pixels (bytes for NV12). Each run starts with a little endian uint32: with the
+    // top bit set the next pixel is repeated (token & 0x7FFFFFFF) times, otherwise that many
+    // pixels follow as they are.
+    RunLength,
+};
+
+struct BitmapAnimationFrameEntry
+{
+    uint64_t timeInMicroseconds; // When the frame starts showing, since the start of the animation
+    uint64_t offset;
+    uint32_t size;
+    BitmapAnimationCompression compression;
+};
+
+struct BitmapAnimationWriter
+{
+public:
+    // Creates or overwrites the file at path, throws if it can't.
+    BitmapAnimationWriter(const std::filesystem::path& path, uint32_t width, uint32_t height, BitmapFormat format);
+
+    BitmapAnimationWriter(const BitmapAnimationWriter&) = delete;
+    BitmapAnimationWriter& operator=(const BitmapAnimationWriter&) = delete;
+
+    // Appends a frame shown from time on, which can't be before the previous frame's.
+    // bitmap must have the size and format the writer was created with.
+    void WriteFrame(const BitmapView& bitmap, std::chrono::microseconds time);
+
+    // Writes the index and the header, the file can't be played before. duration can't be before
+    // the last frame's time.
+    void Finish(std::chrono::microseconds duration);
+
+private:
+    void Write(const void* data, size_t size);
+
+    std::ofstream m_file;
+    BitmapAnimationFileHeader m_header{};
+    std::vector<BitmapAnimationFrameEntry> m_index;
+    uint64_t m_offset{};
+
+    // Reused for every frame
+    std::vector<uint8_t> m_packedFrame;
+    std::vector<uint8_t> m_previousFrame;
+    std::vector<uint8_t> m_encodedFrame;
+};
+
+// Hands out the frames of an animation file at whatever time they are asked for, without reading the
+// file into memory: packed frames are used in place from the mapping, and only encoded frames are
+// decoded, into one buffer reused for all of them. Frames ahead of the last one asked for are
+// prefetched and those behind it evicted, so memory use stays the same however long the animation is.
+//
+// Frames can be asked for in any order (e.g. to seek or loop), but playing forward is what the
+// prefetching is tuned for. Not thread safe, use from the producer thread.
+struct BitmapAnimationSource
+{
+public:
+    // Throws if path can't be mapped or isn't a valid animation file of a known version.
+    explicit BitmapAnimationSource(const std::filesystem::path& path);
+
+    BitmapAnimationSource(const BitmapAnimationSource&) = delete;
+    BitmapAnimationSource& operator=(const BitmapAnimationSource&) = delete;
+
+    uint32_t GetWidth() const { return m_header.width; }
+    uint32_t GetHeight() const { return m_header.height; }
+    BitmapFormat GetFormat() const { return m_header.format; }
+    uint32_t GetFrameCount() const { return m_header.frameCount; }
+    std::chrono::microseconds GetDuration() const { return std::chrono::microseconds(m_header.durationInMicroseconds); }
+
+    // Index of the frame showing at time since the start of the animation. Before the first
+    // frame that is the first one, past the end the last one.
+    uint32_t GetFrameIndex(std::chrono::microseconds time) const;
+
+    // Packed frames point into the mapping and stay valid as long as the source, encoded ones are
+    // decoded into a buffer that the next call reuses.
+    BitmapView GetFrame(uint32_t frameIndex);
+
+    // Publishes a frame without copying it: packed frames are shared with the pipeline, which keeps
+    // the mapping alive while it uses them, and encoded ones are decoded straight into BeginFrame.
+    // frameObserver, if set, is shown the frame just before it is published (e.g. to record it),
+    // so an encoded frame isn't decoded a second time through GetFrame.
+    using FrameObserver = std::function<void(const BitmapView& bitmap)>;
+    void PublishFrame(
+        uint32_t frameIndex,
+        FramePipeline& framePipeline,
+        bool isUrgent = false,
+        const FrameObserver& frameObserver = nullptr);
+
+private:
+    const BitmapAnimationFrameEntry& GetEntry(uint32_t frameIndex) const;
+    BitmapView GetPackedView(const uint8_t* pixels) const noexcept;
+    void Decode(const BitmapAnimationFrameEntry& entry, _Out_writes_(m_frameSize) uint8_t* destination) const;
+
+    // Prefetches the frames after frameIndex and evicts those well behind it.
+    void UpdateResidentFrames(uint32_t frameIndex) noexcept;
+
+    std::shared_ptr<const MappedFile> m_file;
+    BitmapAnimationFileHeader m_header{};
+    const BitmapAnimationFrameEntry* m_index{};
+    size_t m_frameSize{};
+
+    std::vector<uint8_t> m_decodedFrame;
+
+    // File range that may be in the working set, from frames played since the last eviction up
+    // to what was prefetched
+    uint64_t m_residentBegin{};
+    uint64_t m_prefetchedEnd{};
+};
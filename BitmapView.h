@@ -0,0 +1,107 @@
+#pragma once
+
+// Memory layout of the pixels referenced by a BitmapView.
+enum class BitmapFormat : uint32_t
+{
+    BGRA8,
+    RGBA8,
+    RGB565,
+    RGBA16F, // Half precision floats, values outside [0, 1] are clamped
+    NV12, // 8-bit luma plane followed by a half resolution interleaved UV plane, BT.709 limited range
+};
+
+// Sub-rectangle of a bitmap formed between the pixels (Left, Top) and (Left + Width, Top + Height)
+struct BitmapRegion
+{
+    uint32_t Left;
+    uint32_t Top;
+    uint32_t Width;
+    uint32_t Height;
+};
+
+// Non-owning, strided view over a frame owned by the caller. Nothing is copied when a view is
+// created or cropped, so the frame must stay alive and unchanged for as long as the view is used.
+struct BitmapView
+{
+    const uint8_t* Data; // First byte of the top-left pixel
+    uint32_t Width;
+    uint32_t Height;
+    uint32_t StrideInBytes; // Distance between the start of two consecutive rows, may include padding
+    BitmapFormat Format;
+
+    // Only used by NV12, where Data points at the luma plane
+    const uint8_t* ChromaData;
+    uint32_t ChromaStrideInBytes;
+};
+
+inline uint32_t GetBytesPerPixel(BitmapFormat format) noexcept
+{
+    switch (format)
+    {
+    case BitmapFormat::BGRA8:
+    case BitmapFormat::RGBA8:
+        return 4;
+    case BitmapFormat::RGB565:
+        return 2;
+    case BitmapFormat::RGBA16F:
+        return 8;
+    case BitmapFormat::NV12:
+        return 1; // Of the luma plane
+    }
+    return 0;
+}
+
+// Bytes of a tightly packed bitmap (stride == row size), including the UV plane for NV12.
+inline void GetPackedBitmapLayout(
+    uint32_t width,
+    uint32_t height,
+    BitmapFormat format,
+    size_t& rowSize,
+    size_t& chromaOffset,
+    size_t& totalSize) noexcept
+{
+    rowSize = static_cast<size_t>(width) * GetBytesPerPixel(format);
+    chromaOffset = rowSize * height;
+    totalSize = chromaOffset;
+
+    if (format == BitmapFormat::NV12)
+    {
+        // One UV pair per 2x2 pixels, rounded up for odd sizes
+        const size_t chromaRowSize = (static_cast<size_t>(width) + 1) & ~static_cast<size_t>(1);
+        totalSize += chromaRowSize * ((static_cast<size_t>(height) + 1) / 2);
+    }
+}
+
+inline bool IsRegionInsideBitmap(const BitmapView& bitmap, const BitmapRegion& region) noexcept
+{
+    // Compare in 64-bit so Left + Width can't wrap around
+    return (static_cast<uint64_t>(region.Left) + region.Width <= bitmap.Width) &&
+        (static_cast<uint64_t>(region.Top) + region.Height <= bitmap.Height);
+}
+
+// Chroma is shared between 2x2 pixels, so NV12 can only be cropped on even coordinates.
+inline bool IsRegionAlignedForFormat(BitmapFormat format, const BitmapRegion& region) noexcept
+{
+    return (format != BitmapFormat::NV12) || (((region.Left | region.Top) & 1) == 0);
+}
+
+// Returns a view over just the pixels in region, sharing the memory of bitmap.
+inline BitmapView CropBitmapView(const BitmapView& bitmap, const BitmapRegion& region) noexcept
+{
+    BitmapView cropped = bitmap;
+    cropped.Data = bitmap.Data +
+        static_cast<size_t>(region.Top) * bitmap.StrideInBytes +
+        static_cast<size_t>(region.Left) * GetBytesPerPixel(bitmap.Format);
+    cropped.Width = region.Width;
+    cropped.Height = region.Height;
+
+    if (bitmap.Format == BitmapFormat::NV12)
+    {
+        // One UV pair (2 bytes) per 2 pixels, one chroma row per 2 luma rows
+        cropped.ChromaData = bitmap.ChromaData +
+            static_cast<size_t>(region.Top / 2) * bitmap.ChromaStrideInBytes +
+            static_cast<size_t>(region.Left);
+    }
+
+    return cropped;
+}
@@ -0,0 +1,240 @@
+#include "pch.h"
+#include "CompactBoundingBoxes.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define COMPACTBOUNDINGBOXES_SSE2
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define COMPACTBOUNDINGBOXES_NEON
+#endif
+
+const int64_t c_maxOffset = 0xFFFF;
+
+void CompactBoundingBoxes::Assign(const std::vector<BoundingBox>& sourceBoxes)
+{
+    m_offsets.clear();
+    m_blocks.clear();
+    m_shift = 0;
+
+    // Lamps placed outside of the LampArray's bounding box can end up with inverted boxes once
+    // clamped, collapse those onto their Left/Top edge so offsets stay positive.
+    std::vector<BoundingBox> boxes(sourceBoxes);
+    for (BoundingBox& box : boxes)
+    {
+        box.Right = std::max(box.Right, box.Left);
+        box.Bottom = std::max(box.Bottom, box.Top);
+    }
+
+    // Pick the finest unit in which every box fits in a block of its own
+    for (const BoundingBox& box : boxes)
+    {
+        const int64_t extent = std::max(
+            static_cast<int64_t>(box.Right) - box.Left,
+            static_cast<int64_t>(box.Bottom) - box.Top);
+        while (((extent + (int64_t{ 1 } << m_shift) - 1) >> m_shift) > c_maxOffset)
+        {
+            m_shift++;
+        }
+    }
+
+    m_offsets.resize(boxes.size());
+
+    size_t blockBegin = 0;
+    while (blockBegin < boxes.size())
+    {
+        // Grow the block while the union of its boxes still fits in 16 bits
+        int64_t left = boxes[blockBegin].Left;
+        int64_t top = boxes[blockBegin].Top;
+        int64_t right = boxes[blockBegin].Right;
+        int64_t bottom = boxes[blockBegin].Bottom;
+
+        size_t blockEnd = blockBegin + 1;
+        while ((blockEnd < boxes.size()) && (blockEnd - blockBegin < c_boxesPerBlock))
+        {
+            const BoundingBox& box = boxes[blockEnd];
+            const int64_t newLeft = std::min<int64_t>(left, box.Left);
+            const int64_t newTop = std::min<int64_t>(top, box.Top);
+            const int64_t newRight = std::max<int64_t>(right, box.Right);
+            const int64_t newBottom = std::max<int64_t>(bottom, box.Bottom);
+
+            const int64_t unit = int64_t{ 1 } << m_shift;
+            if ((((newRight - newLeft + unit - 1) >> m_shift) > c_maxOffset) ||
+                (((newBottom - newTop + unit - 1) >> m_shift) > c_maxOffset))
+            {
+                break;
+            }
+
+            left = newLeft;
+            top = newTop;
+            right = newRight;
+            bottom = newBottom;
+            blockEnd++;
+        }
+
+        m_blocks.push_back(Block{ static_cast<int32_t>(left), static_cast<int32_t>(top), blockBegin });
+
+        // Round Left/Top down and Right/Bottom up, so quantizing never shrinks a box
+        const int64_t unit = int64_t{ 1 } << m_shift;
+        for (size_t i = blockBegin; i < blockEnd; i++)
+        {
+            const BoundingBox& box = boxes[i];
+            m_offsets[i] = BoxOffsets{
+                static_cast<uint16_t>((box.Left - left) >> m_shift),
+                static_cast<uint16_t>((box.Top - top) >> m_shift),
+                static_cast<uint16_t>((box.Right - left + unit - 1) >> m_shift),
+                static_cast<uint16_t>((box.Bottom - top + unit - 1) >> m_shift) };
+        }
+
+        blockBegin = blockEnd;
+    }
+
+    m_offsets.shrink_to_fit();
+    m_blocks.shrink_to_fit();
+}
+
+size_t CompactBoundingBoxes::FindBlock(size_t index) const noexcept
+{
+    // First block starting after index, the one before it holds index
+    const auto next = std::upper_bound(m_blocks.begin(), m_blocks.end(), index,
+        [](size_t value, const Block& block)
+        {
+            return value < block.FirstBox;
+        });
+    return static_cast<size_t>(next - m_blocks.begin()) - 1;
+}
+
+BoundingBox CompactBoundingBoxes::Get(size_t index) const noexcept
+{
+    BoundingBox box;
+    Decode(index, 1, &box);
+    return box;
+}
+
+void CompactBoundingBoxes::DecodeBox(
+    const BoxOffsets& offsets,
+    const Block& block,
+    uint32_t shift,
+    BoundingBox& destination) noexcept
+{
+#if defined(COMPACTBOUNDINGBOXES_SSE2)
+    // Zero extend the 4 offsets to 32 bits, scale them and add the origin
+    const __m128i origin = _mm_setr_epi32(block.Left, block.Top, block.Left, block.Top);
+    const __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&offsets));
+    const __m128i widened = _mm_sll_epi32(_mm_unpacklo_epi16(packed, _mm_setzero_si128()), _mm_cvtsi32_si128(static_cast<int>(shift)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&destination), _mm_add_epi32(widened, origin));
+#elif defined(COMPACTBOUNDINGBOXES_NEON)
+    const int32_t originValues[4] = { block.Left, block.Top, block.Left, block.Top };
+    const uint16x4_t packed = vld1_u16(reinterpret_cast<const uint16_t*>(&offsets));
+    const int32x4_t widened = vshlq_s32(vreinterpretq_s32_u32(vmovl_u16(packed)), vdupq_n_s32(static_cast<int32_t>(shift)));
+    vst1q_s32(reinterpret_cast<int32_t*>(&destination), vaddq_s32(widened, vld1q_s32(originValues)));
+#else
+    destination.Left = block.Left + (static_cast<int32_t>(offsets.Left) << shift);
+    destination.Top = block.Top + (static_cast<int32_t>(offsets.Top) << shift);
+    destination.Right = block.Left + (static_cast<int32_t>(offsets.Right) << shift);
+    destination.Bottom = block.Top + (static_cast<int32_t>(offsets.Bottom) << shift);
+#endif
+}
+
+void CompactBoundingBoxes::Decode(size_t begin, size_t count, BoundingBox* destination) const noexcept
+{
+    if (count == 0) { return; }
+
+    size_t blockIndex = FindBlock(begin);
+    const size_t end = begin + count;
+
+    size_t i = begin;
+    while (i < end)
+    {
+        const Block& block = m_blocks[blockIndex];
+        const size_t blockEnd = (blockIndex + 1 < m_blocks.size()) ? m_blocks[blockIndex + 1].FirstBox : m_offsets.size();
+        const size_t runEnd = std::min(end, blockEnd);
+
+        for (; i < runEnd; i++)
+        {
+            DecodeBox(m_offsets[i], block, m_shift, *destination);
+            destination++;
+        }
+
+        blockIndex++;
+    }
+}
+
+void CompactBoundingBoxes::Gather(const uint32_t* indices, size_t count, BoundingBox* destination) const noexcept
+{
+    if (count == 0) { return; }
+
+    size_t blockIndex = FindBlock(indices[0]);
+    for (size_t i = 0; i < count; i++)
+    {
+        const size_t index = indices[i];
+        if (index < m_blocks[blockIndex].FirstBox)
+        {
+            // Went backwards, search again
+            blockIndex = FindBlock(index);
+        }
+
+        while ((blockIndex + 1 < m_blocks.size()) && (m_blocks[blockIndex + 1].FirstBox <= index))
+        {
+            blockIndex++;
+        }
+
+        DecodeBox(m_offsets[index], m_blocks[blockIndex], m_shift, destination[i]);
+    }
+}
+
+BoundingBox CompactBoundingBoxes::GetEncompassingBox(const uint32_t* indices, size_t count) const noexcept
+{
+    // Decoded a chunk at a time, then reduced with a min on Left/Top and a max on Right/Bottom
+    BoundingBox boxes[c_boxesPerBlock];
+    BoundingBox result = Get((indices != nullptr) ? indices[0] : 0);
+
+#if defined(COMPACTBOUNDINGBOXES_SSE2)
+    // No 32-bit min/max before SSE4.1, so pick with a compare instead. takeValue is set in
+    // the lanes where value wins: below result for Left/Top, above it for Right/Bottom.
+    const __m128i minLanes = _mm_setr_epi32(-1, -1, 0, 0);
+    __m128i encompassing = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&result));
+#elif defined(COMPACTBOUNDINGBOXES_NEON)
+    const uint32_t minLaneValues[4] = { 0xFFFFFFFF, 0xFFFFFFFF, 0, 0 };
+    const uint32x4_t minLanes = vld1q_u32(minLaneValues);
+    int32x4_t encompassing = vld1q_s32(reinterpret_cast<const int32_t*>(&result));
+#endif
+
+    for (size_t begin = 0; begin < count; begin += c_boxesPerBlock)
+    {
+        const size_t chunkSize = std::min<size_t>(c_boxesPerBlock, count - begin);
+        if (indices != nullptr)
+        {
+            Gather(indices + begin, chunkSize, boxes);
+        }
+        else
+        {
+            Decode(begin, chunkSize, boxes);
+        }
+
+        for (size_t i = 0; i < chunkSize; i++)
+        {
+#if defined(COMPACTBOUNDINGBOXES_SSE2)
+            const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&boxes[i]));
+            const __m128i takeValue = _mm_xor_si128(_mm_cmpgt_epi32(value, encompassing), _mm_andnot_si128(_mm_cmpeq_epi32(value, encompassing), minLanes));
+            encompassing = _mm_or_si128(_mm_and_si128(takeValue, value), _mm_andnot_si128(takeValue, encompassing));
+#elif defined(COMPACTBOUNDINGBOXES_NEON)
+            const int32x4_t value = vld1q_s32(reinterpret_cast<const int32_t*>(&boxes[i]));
+            encompassing = vbslq_s32(minLanes, vminq_s32(encompassing, value), vmaxq_s32(encompassing, value));
+#else
+            result.Left = std::min(result.Left, boxes[i].Left);
+            result.Top = std::min(result.Top, boxes[i].Top);
+            result.Right = std::max(result.Right, boxes[i].Right);
+            result.Bottom = std::max(result.Bottom, boxes[i].Bottom);
+#endif
+        }
+    }
+
+#if defined(COMPACTBOUNDINGBOXES_SSE2)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&result), encompassing);
+#elif defined(COMPACTBOUNDINGBOXES_NEON)
+    vst1q_s32(reinterpret_cast<int32_t*>(&result), encompassing);
+#endif
+
+    return result;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "KDTree.h"
+
+// Read-only list of BoundingBoxes stored as four 16-bit offsets from the origin of the block they
+// belong to, 8 bytes per box instead of 16. Boxes are grouped in blocks of up to c_boxesPerBlock
+// consecutive boxes, and a block ends early whenever the next box wouldn't fit within 16 bits of it.
+// Boxes wider or taller than 16 bits can hold are quantized to a coarser unit, rounding outwards,
+// so a decoded box always covers the original one.
+struct CompactBoundingBoxes
+{
+public:
+    static const uint32_t c_boxesPerBlock = 64;
+
+    // Replaces the content with boxes.
+    void Assign(const std::vector<BoundingBox>& boxes);
+
+    size_t GetCount() const { return m_offsets.size(); }
+    bool IsEmpty() const { return m_offsets.empty(); }
+
+    BoundingBox Get(size_t index) const noexcept;
+
+    // Decodes boxes [begin, begin + count) into destination, 4 coordinates at a time using SIMD.
+    // Much cheaper per box than Get when walking the list in order.
+    void Decode(size_t begin, size_t count, _Out_writes_(count) BoundingBox* destination) const noexcept;
+
+    // Decodes the boxes at indices[0..count) into destination. Fastest with ascending indices,
+    // which only ever walk forward through the blocks.
+    void Gather(
+        _In_reads_(count) const uint32_t* indices,
+        size_t count,
+        _Out_writes_(count) BoundingBox* destination) const noexcept;
+
+    // Smallest box containing the boxes at indices[0..count), or boxes [0, count) when indices is null.
+    // count must not be 0.
+    BoundingBox GetEncompassingBox(_In_reads_opt_(count) const uint32_t* indices, size_t count) const noexcept;
+
+private:
+    struct BoxOffsets
+    {
+        uint16_t Left;
+        uint16_t Top;
+        uint16_t Right;
+        uint16_t Bottom;
+    };
+
+    struct Block
+    {
+        int32_t Left;
+        int32_t Top;
+        size_t FirstBox;
+    };
+
+    // Index of the block holding box index.
+    size_t FindBlock(size_t index) const noexcept;
+
+    static void DecodeBox(const BoxOffsets& offsets, const Block& block, uint32_t shift, BoundingBox& destination) noexcept;
+
+    std::vector<BoxOffsets> m_offsets;
+    std::vector<Block> m_blocks; // Sorted by FirstBox
+
+    // Offsets are in units of (1 << m_shift), 0 unless a single box needs more than 16 bits.
+    uint32_t m_shift{};
+};
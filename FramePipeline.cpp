@@ -0,0 +1,354 @@
+#include "pch.h"
+#include "FramePipeline.h"
+#include "TraceRecorder.h"
+
+// Used for LampArrays that don't report a minimum update interval, about 60Hz.
+const std::chrono::microseconds c_defaultUpdateInterval(16667);
+
+// Sending is mostly waiting on the device, a few threads are plenty even for many LampArrays.
+const uint32_t c_senderThreadCount = 4;
+
+FramePipeline::FramePipeline() :
+    m_samplingThreadPool(WorkStealingThreadPool::GetPhysicalCoreCount()),
+    m_scheduler(c_senderThreadCount)
+{
+    m_samplingThread = std::thread([this]() { SamplingThread(); });
+}
+
+FramePipeline::~FramePipeline()
+{
+    m_stopRequested.store(true);
+    m_frameAvailable.SetEvent();
+    m_samplingThread.join();
+
+    for (auto& stage : m_deviceStages)
+    {
+        m_scheduler.RemoveDevice(stage->schedulerId);
+    }
+}
+
+void FramePipeline::SetLampArrays(std::shared_ptr<const LampArraySnapshot> lampArrays)
+{
+    std::atomic_store(&m_lampArrays, std::move(lampArrays));
+}
+
+uint8_t* FramePipeline::BeginFrame(uint32_t width, uint32_t height, BitmapFormat format)
+{
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(width, height, format, rowSize, chromaOffset, totalSize);
+
+    Frame& frame = m_frames.GetBackBuffer();
+    frame.owner.reset();
+
+    // Each of the three buffers grows to the largest frame once, then stops allocating
+    frame.pixels.resize(totalSize);
+    frame.view = BitmapView{
+        frame.pixels.data(),
+        width,
+        height,
+        static_cast<uint32_t>(rowSize),
+        format,
+        (format == BitmapFormat::NV12) ? frame.pixels.data() + chromaOffset : nullptr,
+        (format == BitmapFormat::NV12) ? ((width + 1) & ~1u) : 0 };
+
+    return frame.pixels.data();
+}
+
+void FramePipeline::EndFrame(bool isUrgent)
+{
+    Frame& frame = m_frames.GetBackBuffer();
+    frame.publishTime = std::chrono::steady_clock::now();
+    m_frames.Publish(isUrgent);
+    m_frameAvailable.SetEvent();
+}
+
+void FramePipeline::PublishFrame(const BitmapView& bitmap, bool isUrgent)
+{
+    uint8_t* pixels = BeginFrame(bitmap.Width, bitmap.Height, bitmap.Format);
+    const BitmapView& destination = m_frames.GetBackBuffer().view;
+
+    const size_t rowSize = static_cast<size_t>(bitmap.Width) * GetBytesPerPixel(bitmap.Format);
+    for (uint32_t y = 0; y < bitmap.Height; y++)
+    {
+        memcpy(pixels + y * rowSize, bitmap.Data + static_cast<size_t>(y) * bitmap.StrideInBytes, rowSize);
+    }
+
+    if (bitmap.Format == BitmapFormat::NV12)
+    {
+        uint8_t* chroma = const_cast<uint8_t*>(destination.ChromaData);
+        for (uint32_t y = 0; y < (bitmap.Height + 1) / 2; y++)
+        {
+            memcpy(
+                chroma + static_cast<size_t>(y) * destination.ChromaStrideInBytes,
+                bitmap.ChromaData + static_cast<size_t>(y) * bitmap.ChromaStrideInBytes,
+                destination.ChromaStrideInBytes);
+        }
+    }
+
+    EndFrame(isUrgent);
+}
+
+void FramePipeline::PublishSharedFrame(const BitmapView& bitmap, std::shared_ptr<const void> owner, bool isUrgent)
+{
+    // Leaves the buffer's pixels allocated for the next BeginFrame
+    Frame& frame = m_frames.GetBackBuffer();
+    frame.view = bitmap;
+    frame.owner = std::move(owner);
+
+    EndFrame(isUrgent);
+}
+
+void FramePipeline::SetCanvasPlacement(std::shared_ptr<const LampArrayBitmapHelper> helper, const LampArrayCanvasPlacement& placement)
+{
+    auto lock = m_canvasLock.lock_exclusive();
+    m_canvas.SetPlacement(std::move(helper), placement);
+}
+
+FramePipelineStatistics FramePipeline::GetStatistics()
+{
+    FramePipelineStatistics statistics{};
+    statistics.frameQueueDepth = m_frames.GetQueueDepth();
+    statistics.framesPublished = m_frames.GetPublishedCount();
+    statistics.framesSampled = m_frames.GetAcquiredCount();
+    statistics.framesDropped = m_frames.GetDroppedCount();
+
+    const auto schedulerStatistics = m_scheduler.GetStatistics();
+
+    auto lock = m_deviceStagesLock.lock_shared();
+    statistics.devices.reserve(m_deviceStages.size());
+    for (const auto& stage : m_deviceStages)
+    {
+        FramePipelineDeviceStatistics device{};
+        device.lampArray = stage->helper->GetLampArray();
+        device.queueDepth = stage->colors.GetQueueDepth();
+        device.colorsSent = stage->colors.GetAcquiredCount();
+        device.colorsDropped = stage->colors.GetDroppedCount();
+
+        for (const auto& schedulerDevice : schedulerStatistics)
+        {
+            if (schedulerDevice.id == stage->schedulerId)
+            {
+                device.updateInterval = schedulerDevice.updateInterval;
+                device.deadlineMissCount = schedulerDevice.deadlineMissCount;
+                device.maxLateness = schedulerDevice.maxLateness;
+            }
+        }
+
+        statistics.devices.push_back(device);
+    }
+
+    return statistics;
+}
+
+void FramePipeline::SamplingThread()
+{
+    for (;;)
+    {
+        m_frameAvailable.wait();
+
+        if (m_stopRequested.load())
+        {
+            break;
+        }
+
+        if (!m_frames.Acquire())
+        {
+            continue;
+        }
+
+        TRACE_FRAME_SCOPE("Sample frame");
+
+        const Frame& frame = m_frames.GetFrontBuffer();
+        const bool isUrgent = m_frames.IsFrontBufferUrgent();
+        const BitmapView& bitmap = frame.view;
+        const BitmapRegion region{ 0, 0, bitmap.Width, bitmap.Height };
+
+        const auto lampArrays = std::atomic_load(&m_lampArrays);
+        UpdateDeviceStages(*lampArrays);
+
+        const bool useCanvas = m_canvasMode.load() && SampleCanvas(*lampArrays, bitmap, region);
+
+        auto lock = m_deviceStagesLock.lock_shared();
+        for (auto& stage : m_deviceStages)
+        {
+            TRACE_SCOPE("Sample LampArray");
+
+            try
+            {
+                SampledColors& sampled = stage->colors.GetBackBuffer();
+                sampled.framePublishTime = frame.publishTime;
+
+                sampled.isFallback = (stage->helper->GetState() != LampArrayBitmapHelperState::Ready);
+                if (sampled.isFallback)
+                {
+                    sampled.fallbackColor = stage->helper->ComputeFallbackColor(bitmap, region);
+                }
+                else if (!useCanvas || !m_canvas.GetLampArrayColors(stage->helper.get(), sampled.colors))
+                {
+                    // Not on the canvas (yet), show the whole frame on it by itself
+                    stage->helper->SampleBitmap(bitmap, region, sampled.colors, &m_samplingThreadPool);
+                }
+
+                stage->colors.Publish(isUrgent);
+            }
+            CATCH_LOG();
+        }
+    }
+}
+
+bool FramePipeline::SampleCanvas(const LampArraySnapshot& lampArrays, const BitmapView& bitmap, const BitmapRegion& region)
+{
+    try
+    {
+        {
+            auto lock = [this]()
+            {
+                TRACE_SCOPE("Wait for m_canvasLock");
+                return m_canvasLock.lock_exclusive();
+            }();
+
+            // Only when a LampArray connects, disconnects, becomes Ready or is moved
+            if (m_canvas.NeedsBuild(lampArrays))
+            {
+                m_canvas.Build(lampArrays);
+            }
+        }
+
+        m_canvas.SampleBitmap(bitmap, region, &m_samplingThreadPool);
+        return true;
+    }
+    CATCH_LOG();
+
+    return false;
+}
+
+void FramePipeline::SendLatestColors(DeviceStage& stage) noexcept
+{
+    // Anything published since the previous update was overwritten by the newest colors,
+    // the stale ones are never sent. Nothing new means nothing to send this period, unless
+    // the device is still fading towards the latest keyframe.
+    const bool hasNewColors = stage.colors.Acquire();
+    if (!hasNewColors && stage.interpolator.IsFinished())
+    {
+        return;
+    }
+
+    TRACE_SCOPE("Send colors");
+
+    try
+    {
+        const SampledColors& sampled = stage.colors.GetFrontBuffer();
+        const LampColorEasing easing = m_keyframeEasing.load();
+
+        if (sampled.isFallback || (easing == LampColorEasing::None))
+        {
+            // Without new colors, interpolation was just turned off and the latest colors were already sent
+            stage.interpolator.Reset();
+
+            if (hasNewColors && sampled.isFallback)
+            {
+                stage.helper->SubmitFallbackColor(sampled.fallbackColor);
+            }
+            else if (hasNewColors)
+            {
+                const size_t lampsSent = stage.helper->SubmitColors(sampled.colors);
+                NotifySubmission(stage, sampled, true, lampsSent);
+            }
+        }
+        else
+        {
+            const auto now = LampColorInterpolator::Clock::now();
+
+            stage.interpolator.SetEasing(easing);
+            stage.interpolator.SetMaxLatency(m_keyframeMaxLatency.load());
+            if (hasNewColors)
+            {
+                stage.interpolator.AddKeyframe(sampled.colors, now, stage.colors.IsFrontBufferUrgent());
+            }
+
+            // The submitter only sends the Lamps that moved since the previous update. Only the
+            // first step towards a keyframe shows a new frame, the later ones would count the
+            // whole fade as latency.
+            if (stage.interpolator.GetColors(now, stage.interpolatedColors))
+            {
+                const size_t lampsSent = stage.helper->SubmitColors(stage.interpolatedColors);
+                NotifySubmission(stage, sampled, hasNewColors, lampsSent);
+            }
+        }
+    }
+    CATCH_LOG();
+}
+
+void FramePipeline::NotifySubmission(const DeviceStage& stage, const SampledColors& sampled, bool isNewFrame, size_t lampsSent) const noexcept
+{
+    if (m_submissionObserver)
+    {
+        try
+        {
+            const auto latency = isNewFrame ?
+                std::chrono::steady_clock::now() - sampled.framePublishTime :
+                std::chrono::steady_clock::duration::zero();
+            m_submissionObserver(*stage.helper, isNewFrame, latency, lampsSent);
+        }
+        CATCH_LOG();
+    }
+}
+
+void FramePipeline::UpdateDeviceStages(const LampArraySnapshot& lampArrays)
+{
+    auto isConnected = [&](const std::unique_ptr<DeviceStage>& stage)
+    {
+        return std::find(lampArrays.begin(), lampArrays.end(), stage->helper) != lampArrays.end();
+    };
+
+    const bool anyDisconnected = !std::all_of(m_deviceStages.begin(), m_deviceStages.end(), isConnected);
+    const bool anyConnected = std::any_of(lampArrays.begin(), lampArrays.end(),
+        [&](const std::shared_ptr<LampArrayBitmapHelper>& helper)
+        {
+            return std::none_of(m_deviceStages.begin(), m_deviceStages.end(),
+                [&](const std::unique_ptr<DeviceStage>& stage) { return stage->helper == helper; });
+        });
+
+    if (!anyDisconnected && !anyConnected)
+    {
+        return;
+    }
+
+    std::vector<std::unique_ptr<DeviceStage>> stoppedStages;
+    {
+        auto lock = m_deviceStagesLock.lock_exclusive();
+
+        auto firstDisconnected = std::stable_partition(m_deviceStages.begin(), m_deviceStages.end(), isConnected);
+        std::move(firstDisconnected, m_deviceStages.end(), std::back_inserter(stoppedStages));
+        m_deviceStages.erase(firstDisconnected, m_deviceStages.end());
+
+        for (const auto& helper : lampArrays)
+        {
+            if (std::none_of(m_deviceStages.begin(), m_deviceStages.end(),
+                [&](const std::unique_ptr<DeviceStage>& stage) { return stage->helper == helper; }))
+            {
+                // Known even while the helper is Pending, and read without calling into the device
+                const uint64_t minUpdateInterval = helper->GetDescription().minUpdateIntervalInMicroseconds;
+                const std::chrono::microseconds updateInterval = (minUpdateInterval != 0) ?
+                    std::chrono::microseconds(minUpdateInterval) :
+                    c_defaultUpdateInterval;
+
+                auto stage = std::make_unique<DeviceStage>();
+                stage->helper = helper;
+                DeviceStage* stagePointer = stage.get();
+                stage->schedulerId = m_scheduler.AddDevice(updateInterval, [this, stagePointer]() { SendLatestColors(*stagePointer); });
+                m_deviceStages.push_back(std::move(stage));
+            }
+        }
+    }
+
+    // Removed outside the lock, a device may be in the middle of a slow write
+    for (auto& stage : stoppedStages)
+    {
+        m_scheduler.RemoveDevice(stage->schedulerId);
+    }
+
+    // The canvas holds on to the helpers it has placements for
+    auto canvasLock = m_canvasLock.lock_exclusive();
+    m_canvas.RemoveDisconnectedPlacements(lampArrays);
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "LampArrayCanvas.h"
+#include "LampColorInterpolator.h"
+#include "TripleBuffer.h"
+#include "LampArrayUpdateScheduler.h"
+
+struct FramePipelineDeviceStatistics
+{
+    ILampArray* lampArray;
+    uint32_t queueDepth; // Sampled colors waiting to be sent, 0 or 1
+    uint64_t colorsSent;
+    uint64_t colorsDropped; // Replaced by newer colors before the device was ready for them
+    std::chrono::microseconds updateInterval; // The device's minimum update interval
+    uint64_t deadlineMissCount;
+    std::chrono::microseconds maxLateness;
+};
+
+struct FramePipelineStatistics
+{
+    uint32_t frameQueueDepth; // Frames waiting to be sampled, 0 or 1
+    uint64_t framesPublished;
+    uint64_t framesSampled;
+    uint64_t framesDropped; // Replaced by a newer frame before being sampled
+    std::vector<FramePipelineDeviceStatistics> devices;
+};
+
+// Moves frames to the LampArrays in three stages, each on its own thread(s):
+//  1. The producer publishes frames into a lock-free triple buffer.
+//  2. A sampling thread takes the newest frame and samples it for every LampArray, spreading
+//     very large LampArrays over a work-stealing pool with a thread per physical core.
+//  3. Every LampArray sends the newest sampled colors at its own minimum update interval,
+//     scheduled earliest deadline first on a small pool of sender threads.
+// No stage ever waits for the next one. A slow device only drops its own stale colors,
+// it never holds back sampling or the other devices.
+struct FramePipeline
+{
+public:
+    // Starts with no LampArrays, see SetLampArrays.
+    FramePipeline();
+    ~FramePipeline();
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // Replaces the LampArrays frames are sent to, from the next frame on. Safe to call from any
+    // thread, the sampling thread keeps the previous snapshot (and its helpers) alive until it is
+    // done with it.
+    void SetLampArrays(std::shared_ptr<const LampArraySnapshot> lampArrays);
+
+    // Producer side, only one thread may publish frames.
+    //
+    // BeginFrame returns memory to render the next frame into, in place, with a tight stride
+    // (for NV12 the UV plane follows the luma plane). EndFrame hands it to the sampling stage.
+    // With keyframe interpolation, an urgent frame (e.g. reacting to input) is shown at once
+    // instead of being faded in. A frame that replaces an urgent one before it was sampled is
+    // shown at once too, so the urgency isn't lost with the dropped frame.
+    uint8_t* BeginFrame(uint32_t width, uint32_t height, BitmapFormat format);
+    void EndFrame(bool isUrgent = false);
+
+    // Copies a frame the caller can't keep alive and publishes it.
+    void PublishFrame(const BitmapView& bitmap, bool isUrgent = false);
+
+    // Publishes a frame without copying it, e.g. one in a memory-mapped BitmapAnimationSource.
+    // The pipeline holds on to owner until it is done with the frame, which must stay unchanged
+    // for as long as owner is alive.
+    void PublishSharedFrame(const BitmapView& bitmap, std::shared_ptr<const void> owner, bool isUrgent = false);
+
+    // In canvas mode every Ready LampArray is laid out on one LampArrayCanvas and each frame is
+    // sampled once for all of them, instead of being stretched over every LampArray separately.
+    // Off by default. Safe to call from any thread, takes effect on the next frame. A placement
+    // is forgotten once its LampArray is no longer in the LampArrays passed to SetLampArrays.
+    void SetCanvasMode(bool enabled) { m_canvasMode.store(enabled); }
+    void SetCanvasPlacement(std::shared_ptr<const LampArrayBitmapHelper> helper, const LampArrayCanvasPlacement& placement);
+
+    // With an easing other than None, published frames are treated as keyframes: every LampArray
+    // fades from one to the next at its own update rate, so frames only need to be published at
+    // e.g. 20Hz. A keyframe is fully shown at most maxLatency after it was sampled.
+    // Off (None) by default. Safe to call from any thread.
+    void SetKeyframeInterpolation(LampColorEasing easing, std::chrono::microseconds maxLatency = std::chrono::microseconds(100000))
+    {
+        m_keyframeMaxLatency.store(maxLatency);
+        m_keyframeEasing.store(easing);
+    }
+
+    // Called on a sender thread every time a LampArray is sent colors. isNewFrame is true for the
+    // first colors sent from a frame, with latency the time since that frame was published. The
+    // in-between colors of keyframe interpolation carry no new frame, their latency is zero.
+    // Used to measure latency, e.g. by SessionReplay. Must be set before the first frame is published.
+    using SubmissionObserver = std::function<void(const LampArrayBitmapHelper& helper, bool isNewFrame, std::chrono::steady_clock::duration latency, size_t lampsSent)>;
+    void SetSubmissionObserver(SubmissionObserver observer) { m_submissionObserver = std::move(observer); }
+
+    FramePipelineStatistics GetStatistics();
+
+private:
+    struct Frame
+    {
+        std::vector<uint8_t> pixels;
+        BitmapView view;
+        std::shared_ptr<const void> owner; // Keeps a shared frame alive, view doesn't point into pixels then
+        std::chrono::steady_clock::time_point publishTime;
+    };
+
+    struct SampledColors
+    {
+        // Not Ready helpers get one solid color instead of per Lamp colors
+        bool isFallback;
+        LampArrayColor fallbackColor;
+        std::vector<LampArrayColor> colors;
+        std::chrono::steady_clock::time_point framePublishTime;
+    };
+
+    struct DeviceStage
+    {
+        std::shared_ptr<LampArrayBitmapHelper> helper;
+        TripleBuffer<SampledColors> colors;
+        uint64_t schedulerId;
+
+        // Only used by the sender, in keyframe mode
+        LampColorInterpolator interpolator;
+        std::vector<LampArrayColor> interpolatedColors;
+    };
+
+    void SamplingThread();
+    void SendLatestColors(DeviceStage& stage) noexcept;
+    void NotifySubmission(const DeviceStage& stage, const SampledColors& sampled, bool isNewFrame, size_t lampsSent) const noexcept;
+
+    // Schedules a DeviceStage for every new LampArray and removes those that disconnected.
+    void UpdateDeviceStages(const LampArraySnapshot& lampArrays);
+
+    // Rebuilds the canvas if needed and samples bitmap on it, returns false if it couldn't.
+    bool SampleCanvas(const LampArraySnapshot& lampArrays, const BitmapView& bitmap, const BitmapRegion& region);
+
+    // Only ever read and written through std::atomic_load/std::atomic_store
+    std::shared_ptr<const LampArraySnapshot> m_lampArrays = std::make_shared<const LampArraySnapshot>();
+
+    // Helps the sampling thread out with LampArrays that have thousands of Lamps
+    WorkStealingThreadPool m_samplingThreadPool;
+
+    TripleBuffer<Frame> m_frames;
+    wil::unique_event m_frameAvailable{ wil::EventOptions::None };
+    std::atomic<bool> m_stopRequested{};
+
+    // Used by the sampling thread. The lock is there for SetCanvasPlacement, and is only held
+    // while the placements are read, i.e. while the canvas is rebuilt, never while sampling.
+    std::atomic<bool> m_canvasMode{};
+    wil::srwlock m_canvasLock;
+    LampArrayCanvas m_canvas;
+
+    // Read by the senders on every update
+    std::atomic<LampColorEasing> m_keyframeEasing{ LampColorEasing::None };
+    std::atomic<std::chrono::microseconds> m_keyframeMaxLatency{};
+
+    SubmissionObserver m_submissionObserver;
+
+    // Only the sampling thread changes the list, the lock is there for GetStatistics.
+    wil::srwlock m_deviceStagesLock;
+    std::vector<std::unique_ptr<DeviceStage>> m_deviceStages;
+
+    // Declared after m_deviceStages so its threads are gone before the stages are destroyed
+    LampArrayUpdateScheduler m_scheduler;
+
+    std::thread m_samplingThread;
+};
@@ -1,10 +1,13 @@
 #include "pch.h"
 #include "KDTree.h"
+#include "PerformanceMetrics.h"
+#include "TraceRecorder.h"
 
 HRESULT KDTree::GenerateAllBoundingBoxes(
     std::vector<Data>& kdTree,
     const BoundingBox& globalBoundingBox,
-    std::vector<BoundingBox>& result) noexcept
+    std::vector<BoundingBox>& result,
+    const SearchConfig& config) noexcept
 {
     result.clear();
     const size_t kdTreeSize = kdTree.size();
@@ -42,8 +45,12 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
 
     if (kdTreeSize > 1)
     {
-        KDTree::GenerateKDTreeInPlace(kdTree, kdTreeScratchMemory);
+        METRICS_START_LAPS(passTimer);
+        TRACE_START_LAPS(passEvents);
 
+        KDTree::GenerateKDTreeInPlace(kdTree, kdTreeScratchMemory);
+        METRICS_LAP(passTimer, KDTreeBuild);
+        TRACE_LAP(passEvents, "KDTree build");
 
         // On the first pass find the nearest neighbor, and assume that they will intersect with each other
         for (size_t i = 0; i < kdTreeSize; ++i)
@@ -52,7 +59,7 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
             const KDTree::Point& ePoint = e.point;
 
             size_t nearestNeighborIndex;
-            RETURN_IF_FAILED(KDTree::FindNearestNeighbor(i, kdTree, kdTreeScratchMemory, nearestNeighborIndex));
+            RETURN_IF_FAILED(KDTree::FindNearestNeighbor(i, kdTree, kdTreeScratchMemory, nearestNeighborIndex, config));
             const KDTree::Point& nearestNeighbor = kdTree[nearestNeighborIndex].point;
 
             // The nearest neighbor is the closest point we can intersect with
@@ -88,6 +95,8 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
                 e.point.values[0] + nudgedDeltaX,
                 e.point.values[1] + nudgedDeltaY };
         }
+        METRICS_LAP(passTimer, NearestNeighborPass);
+        TRACE_LAP(passEvents, "Nearest neighbor pass");
 
         // On the second pass try to expand any rectangle into squares based on the existing bounding boxes
         for (size_t i = 0; i < kdTreeSize; ++i)
@@ -104,7 +113,7 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
             {
                 const int32_t deltaY2 = deltaY * 2;
                 const int32_t deltaY2Squared = deltaY2 * deltaY2;
-                RETURN_IF_FAILED(KDTree::FindNeighborsWithinRadius(i, deltaY2Squared, kdTree, kdTreeScratchMemory, neighborsWithinRange));
+                RETURN_IF_FAILED(KDTree::FindNeighborsWithinRadius(i, deltaY2Squared, kdTree, kdTreeScratchMemory, neighborsWithinRange, config));
 
                 int32_t leftCollision = std::numeric_limits<int32_t>::lowest();
                 int32_t rightCollision = std::numeric_limits<int32_t>::max();
@@ -138,7 +147,7 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
             {
                 const int32_t deltaX2 = deltaY * 2;
                 const int32_t deltaX2Squared = deltaX2 * deltaX2;
-                RETURN_IF_FAILED(KDTree::FindNeighborsWithinRadius(i, deltaX2Squared, kdTree, kdTreeScratchMemory, neighborsWithinRange));
+                RETURN_IF_FAILED(KDTree::FindNeighborsWithinRadius(i, deltaX2Squared, kdTree, kdTreeScratchMemory, neighborsWithinRange, config));
 
                 int32_t topCollision = std::numeric_limits<int32_t>::lowest();
                 int32_t bottomCollision = std::numeric_limits<int32_t>::max();
@@ -169,6 +178,8 @@ HRESULT KDTree::GenerateAllBoundingBoxes(
                 eBoundingBox.Bottom = ePoint.values[1] + newDeltaY;
             }
         }
+        METRICS_LAP(passTimer, ExpansionPass);
+        TRACE_LAP(passEvents, "Expansion pass");
     }
 
     // Clamp things that spilled over (also handles the edge case of 1 item)
@@ -289,163 +300,158 @@ static size_t FindParent(
     return parentIndex;
 }
 
-HRESULT KDTree::FindNearestNeighbor(
+// Walks the k-d tree for the points near elementIndex, on behalf of both searches below.
+// visitor.Consider(index, distanceSquared) is called for every point that is looked at,
+// and visitor.CanPrune(distanceSquared) says whether a range whose points are all at least
+// that far away can be skipped.
+template <typename Visitor>
+static HRESULT SearchKDTree(
     const size_t elementIndex,
-    const std::vector<Data>& kdTree,
-    std::vector<QueueData>(&searchQueue)[2],
-    size_t& result) noexcept
+    const std::vector<KDTree::Data>& kdTree,
+    const KDTree::SearchConfig& config,
+    std::vector<KDTree::QueueData>(&searchQueue)[2],
+    Visitor& visitor) noexcept
 {
     const size_t nodeCount = kdTree.size();
-    if (nodeCount < 2)
-    {
-        return E_INVALIDARG;
-    }
+    const KDTree::Point& elementPoint = kdTree[elementIndex].point;
 
-    size_t nearestNeighborCandidate = 0;
+    searchQueue[0].clear();
+    searchQueue[1].clear();
 
-    {
-        const size_t median = kdTree.size() / 2;
+    METRICS_ONLY(uint64_t nodesVisited = 0);
+    METRICS_ONLY(uint64_t leavesScanned = 0);
+    METRICS_ONLY(uint64_t pointsScanned = 0);
 
-        if (elementIndex != median)
+    auto scanRange = [&](size_t rangeBegin, size_t rangeEnd)
+    {
+        for (size_t i = rangeBegin; i < rangeEnd; ++i)
         {
-            nearestNeighborCandidate = FindParent(elementIndex, kdTree);
+            visitor.Consider(i, DistanceSquared(elementPoint, kdTree[i].point));
         }
-        else
+    };
+
+    // Scans a leaf, or looks at the median of a larger range and returns its two halves: the one on
+    // the side of the element, and the other one with the least distance its points can be at.
+    struct Split
+    {
+        bool isLeaf;
+        KDTree::QueueData left;
+        KDTree::QueueData right;
+        bool isLeftNear;
+    };
+    auto visitRange = [&](const KDTree::QueueData& e)
+    {
+        const size_t diff = e.rangeEnd - e.rangeBegin;
+
+        // Just do a linear search if we are close enough
+        if (diff < config.leafSize)
         {
-            // For the root take the left child
-            nearestNeighborCandidate = median / 2;
+            METRICS_ONLY(leavesScanned++);
+            METRICS_ONLY(pointsScanned += diff);
+
+            if (elementIndex < e.rangeBegin || elementIndex >= e.rangeEnd)
+            {
+                scanRange(e.rangeBegin, e.rangeEnd);
+            }
+            else
+            {
+                scanRange(e.rangeBegin, elementIndex);
+                scanRange(elementIndex + 1, e.rangeEnd);
+            }
+
+            return Split{ true };
         }
-    }
 
-    const Point& elementPoint = kdTree[elementIndex].point;
+        METRICS_ONLY(nodesVisited++);
 
-    int32_t distanceToBeatSquared = DistanceSquared(elementPoint, kdTree[nearestNeighborCandidate].point);
+        const size_t median = e.rangeBegin + (diff / 2);
+        const KDTree::Point& medianPoint = kdTree[median].point;
+        if (median != elementIndex)
+        {
+            visitor.Consider(median, DistanceSquared(elementPoint, medianPoint));
+        }
 
-    searchQueue[0].clear();
-    searchQueue[1].clear();
+        // 0 for the median itself, whose halves are both considered
+        const int32_t axisDistance = elementPoint.values[e.axis] - medianPoint.values[e.axis];
+        const int32_t axisDistanceSquared = axisDistance * axisDistance;
+        const bool isLeftNear = !(medianPoint.values[e.axis] < elementPoint.values[e.axis]);
+
+        const uint32_t otherAxis = e.axis ^ 1;
+        return Split{
+            false,
+            KDTree::QueueData{ e.rangeBegin, median, otherAxis, isLeftNear ? e.minDistanceSquared : axisDistanceSquared },
+            KDTree::QueueData{ median + 1, e.rangeEnd, otherAxis, isLeftNear ? axisDistanceSquared : e.minDistanceSquared },
+            isLeftNear };
+    };
 
     try
     {
-        searchQueue[0].push_back({ 0, nodeCount });
+        searchQueue[0].push_back({ 0, nodeCount, 0, 0 });
 
-        unsigned int recursionDepth = 0;
-        while (!searchQueue[0].empty() || !searchQueue[1].empty())
+        if (config.traversal == KDTree::SearchTraversal::DepthFirst)
         {
-            const unsigned int currentAxis = recursionDepth & 1;
-            const unsigned int otherAxis = currentAxis ^ 1;
-            while (!searchQueue[currentAxis].empty())
+            std::vector<KDTree::QueueData>& stack = searchQueue[0];
+            while (!stack.empty())
             {
-                const QueueData& e = searchQueue[currentAxis].back();
-                const size_t diff = e.rangeEnd - e.rangeBegin;
+                const KDTree::QueueData e = stack.back();
+                stack.pop_back();
 
-                // Just do a linear search if we are close enough
-                // 16 makes sure we're only checking a couple cache lines,
-                // and has shown to improve performance.
-                if (diff < 16)
+                // The far half of a node is only pruned once the near half was searched
+                if (visitor.CanPrune(e.minDistanceSquared))
                 {
-                    if (elementIndex < e.rangeBegin || elementIndex > e.rangeEnd)
-                    {
-                        for (size_t i = e.rangeBegin; i < e.rangeEnd; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < distanceToBeatSquared)
-                            {
-                                distanceToBeatSquared = distanceSquared;
-                                nearestNeighborCandidate = i;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        for (size_t i = e.rangeBegin; i < elementIndex; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < distanceToBeatSquared)
-                            {
-                                distanceToBeatSquared = distanceSquared;
-                                nearestNeighborCandidate = i;
-                            }
-                        }
-
-                        for (size_t i = elementIndex + 1; i < e.rangeEnd; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < distanceToBeatSquared)
-                            {
-                                distanceToBeatSquared = distanceSquared;
-                                nearestNeighborCandidate = i;
-                            }
-                        }
-                    }
+                    continue;
                 }
-                else
-                {
-                    const size_t median = e.rangeBegin + (diff / 2);
-                    if (elementIndex != median)
-                    {
-                        const Point& medianPoint = kdTree[median].point;
 
-                        const int32_t distanceSquared = DistanceSquared(elementPoint, medianPoint);
+                const Split split = visitRange(e);
+                if (split.isLeaf)
+                {
+                    continue;
+                }
 
-                        const int32_t axisDistance = elementPoint.values[currentAxis] - medianPoint.values[currentAxis];
-                        const int32_t axisDistanceSquared = axisDistance * axisDistance;
+                const KDTree::QueueData& nearHalf = split.isLeftNear ? split.left : split.right;
+                const KDTree::QueueData& farHalf = split.isLeftNear ? split.right : split.left;
+                if ((farHalf.rangeBegin < farHalf.rangeEnd) && !visitor.CanPrune(farHalf.minDistanceSquared))
+                {
+                    stack.push_back(farHalf);
+                }
+                if (nearHalf.rangeBegin < nearHalf.rangeEnd)
+                {
+                    stack.push_back(nearHalf);
+                }
+            }
+        }
+        else
+        {
+            unsigned int recursionDepth = 0;
+            while (!searchQueue[0].empty() || !searchQueue[1].empty())
+            {
+                const unsigned int currentAxis = recursionDepth & 1;
+                const unsigned int otherAxis = currentAxis ^ 1;
+                while (!searchQueue[currentAxis].empty())
+                {
+                    const KDTree::QueueData e = searchQueue[currentAxis].back();
+                    searchQueue[currentAxis].pop_back();
 
-                        if (distanceSquared < distanceToBeatSquared)
-                        {
-                            distanceToBeatSquared = distanceSquared;
-                            nearestNeighborCandidate = median;
-                        }
+                    const Split split = visitRange(e);
+                    if (split.isLeaf)
+                    {
+                        continue;
+                    }
 
-                        if (diff > 1)
-                        {
-                            if (medianPoint.values[currentAxis] < elementPoint.values[currentAxis])
-                            {
-                                // See if we can avoid checking the left half
-                                if (axisDistanceSquared < distanceToBeatSquared)
-                                {
-                                    searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-                                }
-
-                                if (median + 1 < e.rangeEnd)
-                                {
-                                    searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                                }
-                            }
-                            else
-                            {
-                                searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-
-                                // See if we can avoid checking the right half
-                                if (axisDistanceSquared < distanceToBeatSquared)
-                                {
-                                    if (median + 1 < e.rangeEnd)
-                                    {
-                                        searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                                    }
-                                }
-                            }
-                        }
+                    // See if we can avoid checking the far half
+                    if ((split.left.rangeBegin < split.left.rangeEnd) &&
+                        (split.isLeftNear || !visitor.CanPrune(split.left.minDistanceSquared)))
+                    {
+                        searchQueue[otherAxis].push_back(split.left);
                     }
-                    else
+                    if ((split.right.rangeBegin < split.right.rangeEnd) &&
+                        (!split.isLeftNear || !visitor.CanPrune(split.right.minDistanceSquared)))
                     {
-                        // Consider both halves
-                        if (diff > 1)
-                        {
-                            searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-                            if (median + 1 < e.rangeEnd)
-                            {
-                                searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                            }
-                        }
+                        searchQueue[otherAxis].push_back(split.right);
                     }
                 }
-
-                searchQueue[currentAxis].pop_back();
+                ++recursionDepth;
             }
-            ++recursionDepth;
         }
     }
     catch (const std::bad_alloc&)
@@ -453,21 +459,20 @@ HRESULT KDTree::FindNearestNeighbor(
         return E_OUTOFMEMORY;
     }
 
-    result = nearestNeighborCandidate;
+    METRICS_ADD(KDTreeQueries, 1);
+    METRICS_ADD(KDTreeNodesVisited, nodesVisited);
+    METRICS_ADD(KDTreeLeavesScanned, leavesScanned);
+    METRICS_ADD(KDTreePointsScanned, pointsScanned);
 
     return S_OK;
 }
 
-
-// Does the same as FindNearestNeighbor, except instead of
-// keeping track of distanceToBeatSquared & updating nearestNeighborCandidate
-// it pushes the neighbor into result if they are within searchDistanceSquared
-HRESULT KDTree::FindNeighborsWithinRadius(
-    size_t elementIndex,
-    int32_t searchDistanceSquared,
+HRESULT KDTree::FindNearestNeighbor(
+    const size_t elementIndex,
     const std::vector<Data>& kdTree,
     std::vector<QueueData>(&searchQueue)[2],
-    std::vector<size_t>& results) noexcept
+    size_t& result,
+    const SearchConfig& config) noexcept
 {
     const size_t nodeCount = kdTree.size();
     if (nodeCount < 2)
@@ -475,137 +480,91 @@ HRESULT KDTree::FindNeighborsWithinRadius(
         return E_INVALIDARG;
     }
 
-    results.clear();
+    size_t nearestNeighborCandidate = 0;
 
-    const Point& elementPoint = kdTree[elementIndex].point;
+    {
+        const size_t median = kdTree.size() / 2;
 
-    searchQueue[0].clear();
-    searchQueue[1].clear();
+        if (elementIndex != median)
+        {
+            nearestNeighborCandidate = FindParent(elementIndex, kdTree);
+        }
+        else
+        {
+            // For the root take the left child
+            nearestNeighborCandidate = median / 2;
+        }
+    }
 
-    try
+    struct NearestNeighborVisitor
     {
-        searchQueue[0].push_back({ 0, nodeCount });
+        size_t nearestNeighborCandidate;
+        int32_t distanceToBeatSquared;
 
-        unsigned int recursionDepth = 0;
-        while (!searchQueue[0].empty() || !searchQueue[1].empty())
+        // Of equally near points the one earliest in the k-d tree is kept, whichever is found first,
+        // so every SearchConfig gives the same neighbor and the same boxes
+        void Consider(size_t index, int32_t distanceSquared) noexcept
         {
-            const unsigned int currentAxis = recursionDepth & 1;
-            const unsigned int otherAxis = currentAxis ^ 1;
-            while (!searchQueue[currentAxis].empty())
+            if ((distanceSquared < distanceToBeatSquared) ||
+                ((distanceSquared == distanceToBeatSquared) && (index < nearestNeighborCandidate)))
             {
-                const QueueData& e = searchQueue[currentAxis].back();
-                const size_t diff = e.rangeEnd - e.rangeBegin;
+                distanceToBeatSquared = distanceSquared;
+                nearestNeighborCandidate = index;
+            }
+        }
 
-                // Just do a linear search if we are close enough
-                // 16 makes sure we're only checking a couple cache lines,
-                // and has shown to improve performance.
-                if (diff < 16)
-                {
-                    if (elementIndex < e.rangeBegin || elementIndex > e.rangeEnd)
-                    {
-                        for (size_t i = e.rangeBegin; i < e.rangeEnd; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < searchDistanceSquared)
-                            {
-                                results.push_back(i);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        for (size_t i = e.rangeBegin; i < elementIndex; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < searchDistanceSquared)
-                            {
-                                results.push_back(i);
-                            }
-                        }
+        // A range exactly as far as the candidate may still hold an earlier point
+        bool CanPrune(int32_t distanceSquared) const noexcept
+        {
+            return distanceSquared > distanceToBeatSquared;
+        }
+    };
 
-                        for (size_t i = elementIndex + 1; i < e.rangeEnd; ++i)
-                        {
-                            const KDTree::Point& e = kdTree[i].point;
-                            const int32_t distanceSquared = DistanceSquared(elementPoint, e);
-                            if (distanceSquared < searchDistanceSquared)
-                            {
-                                results.push_back(i);
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    const size_t median = e.rangeBegin + (diff / 2);
-                    if (elementIndex != median)
-                    {
-                        const Point& medianPoint = kdTree[median].point;
+    NearestNeighborVisitor visitor{
+        nearestNeighborCandidate,
+        DistanceSquared(kdTree[elementIndex].point, kdTree[nearestNeighborCandidate].point) };
+    RETURN_IF_FAILED(SearchKDTree(elementIndex, kdTree, config, searchQueue, visitor));
 
-                        const int32_t distanceSquared = DistanceSquared(elementPoint, medianPoint);
+    result = visitor.nearestNeighborCandidate;
 
-                        const int32_t axisDistance = elementPoint.values[currentAxis] - medianPoint.values[currentAxis];
-                        const int32_t axisDistanceSquared = axisDistance * axisDistance;
+    return S_OK;
+}
 
-                        if (distanceSquared < searchDistanceSquared)
-                        {
-                            results.push_back(median);
-                        }
+HRESULT KDTree::FindNeighborsWithinRadius(
+    size_t elementIndex,
+    int32_t searchDistanceSquared,
+    const std::vector<Data>& kdTree,
+    std::vector<QueueData>(&searchQueue)[2],
+    std::vector<size_t>& results,
+    const SearchConfig& config) noexcept
+{
+    const size_t nodeCount = kdTree.size();
+    if (nodeCount < 2)
+    {
+        return E_INVALIDARG;
+    }
 
-                        if (diff > 1)
-                        {
-                            if (medianPoint.values[currentAxis] < elementPoint.values[currentAxis])
-                            {
-                                // See if we can avoid checking the left half
-                                if (axisDistanceSquared < searchDistanceSquared)
-                                {
-                                    searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-                                }
-
-                                if (median + 1 < e.rangeEnd)
-                                {
-                                    searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                                }
-                            }
-                            else
-                            {
-                                searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-
-                                // See if we can avoid checking the right half
-                                if (axisDistanceSquared < searchDistanceSquared)
-                                {
-                                    if (median + 1 < e.rangeEnd)
-                                    {
-                                        searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        // Consider both halves
-                        if (diff > 1)
-                        {
-                            searchQueue[otherAxis].push_back({ e.rangeBegin, median });
-                            if (median + 1 < e.rangeEnd)
-                            {
-                                searchQueue[otherAxis].push_back({ median + 1, e.rangeEnd });
-                            }
-                        }
-                    }
-                }
+    results.clear();
+
+    struct RadiusVisitor
+    {
+        int32_t searchDistanceSquared;
+        std::vector<size_t>& results;
 
-                searchQueue[currentAxis].pop_back();
+        void Consider(size_t index, int32_t distanceSquared)
+        {
+            if (distanceSquared < searchDistanceSquared)
+            {
+                results.push_back(index);
             }
-            ++recursionDepth;
         }
-    }
-    catch (const std::bad_alloc&)
-    {
-        return E_OUTOFMEMORY;
-    }
 
-    return S_OK;
+        bool CanPrune(int32_t distanceSquared) const noexcept
+        {
+            return distanceSquared >= searchDistanceSquared;
+        }
+    };
+
+    RadiusVisitor visitor{ searchDistanceSquared, results };
+    return SearchKDTree(elementIndex, kdTree, config, searchQueue, visitor);
 }
@@ -26,12 +26,39 @@ namespace KDTree
     {
         size_t rangeBegin;
         size_t rangeEnd;
+
+        // Only used by the searches
+        uint32_t axis;
+        int32_t minDistanceSquared; // No point of the range is closer to the element than this
+    };
+
+    enum class SearchTraversal : uint32_t
+    {
+        // One level of the tree at a time, the far half of a node is pruned when it is queued.
+        LevelOrder,
+
+        // The near half of a node is searched first, so the far half can be pruned against
+        // the (usually much smaller) distance found in the meantime.
+        DepthFirst,
+    };
+
+    // How the searches walk the tree. Which config is fastest depends on the CPU and the layout,
+    // KDTreeTuner picks one per machine. The searches find the same points with every config (of
+    // several equally near points FindNearestNeighbor returns the one earliest in the k-d tree, which
+    // doesn't depend on the config), so every config gives the same boxes.
+    struct SearchConfig
+    {
+        // Ranges of fewer points than this are scanned linearly instead of being split further.
+        // 16 makes sure we're only checking a couple cache lines.
+        uint32_t leafSize = 16;
+        SearchTraversal traversal = SearchTraversal::LevelOrder;
     };
 
     HRESULT GenerateAllBoundingBoxes(
         std::vector<Data>& looseNodes,
         const BoundingBox& globalBoundingBox,
-        std::vector<BoundingBox>& result) noexcept;
+        std::vector<BoundingBox>& result,
+        const SearchConfig& config = SearchConfig{}) noexcept;
 
     // Repeatedly partitions the points such that all points to the left of the median are smaller
     // and all points to the right are larger.
@@ -40,18 +67,22 @@ namespace KDTree
         std::vector<Data>& looseNodes,
         std::vector<QueueData>(&partitioningQueue)[2]) noexcept;
 
-    // The k-d tree must contain at least 2 points
+    // The k-d tree must contain at least 2 points.
+    // Of equally near points, the one earliest in the k-d tree is returned (see SearchConfig).
     HRESULT FindNearestNeighbor(
         size_t elementIndex,
         const std::vector<Data>& kdTree,
         std::vector<QueueData>(&searchQueue)[2],
-        size_t& result) noexcept;
+        size_t& result,
+        const SearchConfig& config = SearchConfig{}) noexcept;
 
-    // The k-d tree must contain at least 2 points
+    // The k-d tree must contain at least 2 points.
+    // The order of the results depends on the SearchConfig.
     HRESULT FindNeighborsWithinRadius(
         size_t elementIndex,
         int32_t searchDistanceSquared,
         const std::vector<Data>& kdTree,
         std::vector<QueueData>(&searchQueue)[2],
-        std::vector<size_t>& results) noexcept;
+        std::vector<size_t>& results,
+        const SearchConfig& config = SearchConfig{}) noexcept;
 }
@@ -0,0 +1,287 @@
+#include "pch.h"
+#include "KDTreeTuner.h"
+
+#include <random>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+// "LAKP" read as a little endian uint32
+const uint32_t c_profileMagic = 0x504B414C;
+
+// Bump when the candidates or the benchmark change, so existing profiles are tuned again
+const uint32_t c_profileVersion = 2;
+
+const uint32_t c_layoutClassCount = static_cast<uint32_t>(KDTreeTuner::LayoutClass::Count);
+
+// Largest Lamp count of each class but the last, and the size of the synthetic layout it is tuned on
+const size_t c_layoutClassMaxLampCounts[] = { 256, 4096, 65536 };
+const size_t c_layoutClassBenchmarkLampCounts[c_layoutClassCount] = { 128, 2048, 32768, 262144 };
+
+const uint32_t c_candidateLeafSizes[] = { 4, 8, 16, 32, 64 };
+const uint32_t c_maxLeafSize = 1024;
+
+// Keyboard key pitch, with Lamps up to a quarter of it off the grid
+const int32_t c_benchmarkLampSpacing = 19;
+const int32_t c_benchmarkLampJitter = 4;
+
+// Each round times every candidate once on the same sample of queries, and a candidate's best
+// round counts, which filters out preemptions and frequency changes.
+const size_t c_benchmarkQueryCount = 2048;
+const uint32_t c_benchmarkRoundCount = 5;
+
+// Hash of the boxes GenerateAllBoundingBoxes gives for benchmark layouts of these sizes. Every
+// candidate config has to give exactly these. The larger layouts have enough equally near neighbors
+// that a change in which of them is kept shows up in the hash.
+const size_t c_referenceLampCounts[] = { 128, 2048, 8192 };
+const uint64_t c_referenceBoxesHash = 0x82817B71ADF8AB7E;
+
+const uint64_t c_hashOffsetBasis = 0xCBF29CE484222325;
+
+struct ProfileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t machineSignature;
+    uint32_t layoutClassCount;
+    uint32_t reserved;
+};
+
+static std::atomic<KDTree::SearchConfig> s_searchConfigs[c_layoutClassCount]{
+    KDTree::SearchConfig{},
+    KDTree::SearchConfig{},
+    KDTree::SearchConfig{},
+    KDTree::SearchConfig{} };
+
+// FNV-1a
+static uint64_t AddToHash(uint64_t hash, const void* data, size_t size) noexcept
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 0x100000001B3;
+    }
+
+    return hash;
+}
+
+// Tells machines apart well enough that a profile copied to (or roamed onto) another one is tuned
+// again: the CPU model and how many logical processors it has.
+static uint64_t GetMachineSignature() noexcept
+{
+    uint64_t signature = c_hashOffsetBasis;
+
+#if defined(_M_X64) || defined(_M_IX86)
+    int cpuInfo[4]{};
+    __cpuid(cpuInfo, static_cast<int>(0x80000000));
+    if (static_cast<uint32_t>(cpuInfo[0]) >= 0x80000004)
+    {
+        // The processor brand string
+        for (uint32_t leaf = 0x80000002; leaf <= 0x80000004; leaf++)
+        {
+            __cpuid(cpuInfo, static_cast<int>(leaf));
+            signature = AddToHash(signature, cpuInfo, sizeof(cpuInfo));
+        }
+    }
+#endif
+
+    const uint32_t processorCount = std::thread::hardware_concurrency();
+    signature = AddToHash(signature, &processorCount, sizeof(processorCount));
+
+    return signature;
+}
+
+static std::vector<KDTree::SearchConfig> GetCandidates()
+{
+    // The default first, so it wins ties
+    std::vector<KDTree::SearchConfig> candidates{ KDTree::SearchConfig{} };
+    for (const KDTree::SearchTraversal traversal : { KDTree::SearchTraversal::LevelOrder, KDTree::SearchTraversal::DepthFirst })
+    {
+        for (const uint32_t leafSize : c_candidateLeafSizes)
+        {
+            const KDTree::SearchConfig candidate{ leafSize, traversal };
+            if ((candidate.leafSize != candidates[0].leafSize) || (candidate.traversal != candidates[0].traversal))
+            {
+                candidates.push_back(candidate);
+            }
+        }
+    }
+
+    return candidates;
+}
+
+// Lamps on a roughly square, slightly irregular grid, the same every time. The jitter is taken
+// from the mt19937 output directly, since what std::uniform_int_distribution makes of it is up to
+// the standard library and would change the reference hash.
+static std::vector<KDTree::Data> GenerateBenchmarkLayout(size_t lampCount)
+{
+    const size_t columnCount = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(lampCount))));
+
+    std::mt19937 random(1);
+    const auto jitter = [](std::mt19937& random)
+    {
+        return static_cast<int32_t>(random() % (2 * c_benchmarkLampJitter + 1)) - c_benchmarkLampJitter;
+    };
+
+    std::vector<KDTree::Data> layout(lampCount);
+    for (size_t i = 0; i < lampCount; i++)
+    {
+        layout[i].point.values[0] = static_cast<int32_t>(i % columnCount) * c_benchmarkLampSpacing + jitter(random);
+        layout[i].point.values[1] = static_cast<int32_t>(i / columnCount) * c_benchmarkLampSpacing + jitter(random);
+        layout[i].indexBoundingBox = i;
+    }
+
+    return layout;
+}
+
+// Runs the searches GenerateAllBoundingBoxes makes for a sample of the Lamps.
+static std::chrono::steady_clock::duration TimeSearches(
+    const std::vector<KDTree::Data>& kdTree,
+    const KDTree::SearchConfig& config,
+    std::vector<KDTree::QueueData>(&searchQueue)[2],
+    std::vector<size_t>& neighbors)
+{
+    const size_t stride = std::max<size_t>(kdTree.size() / c_benchmarkQueryCount, 1);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kdTree.size(); i += stride)
+    {
+        size_t nearestNeighborIndex;
+        THROW_IF_FAILED(KDTree::FindNearestNeighbor(i, kdTree, searchQueue, nearestNeighborIndex, config));
+
+        // The expansion pass searches within about twice the distance to the nearest neighbor
+        const int32_t deltaX = kdTree[i].point.values[0] - kdTree[nearestNeighborIndex].point.values[0];
+        const int32_t deltaY = kdTree[i].point.values[1] - kdTree[nearestNeighborIndex].point.values[1];
+        THROW_IF_FAILED(KDTree::FindNeighborsWithinRadius(i, 4 * (deltaX * deltaX + deltaY * deltaY), kdTree, searchQueue, neighbors, config));
+    }
+
+    return std::chrono::steady_clock::now() - start;
+}
+
+KDTreeTuner::LayoutClass KDTreeTuner::GetLayoutClass(size_t lampCount) noexcept
+{
+    uint32_t layoutClass = 0;
+    while ((layoutClass < std::size(c_layoutClassMaxLampCounts)) && (lampCount > c_layoutClassMaxLampCounts[layoutClass]))
+    {
+        layoutClass++;
+    }
+
+    return static_cast<LayoutClass>(layoutClass);
+}
+
+KDTree::SearchConfig KDTreeTuner::GetSearchConfig(size_t lampCount) noexcept
+{
+    return s_searchConfigs[static_cast<uint32_t>(GetLayoutClass(lampCount))].load(std::memory_order_relaxed);
+}
+
+bool KDTreeTuner::CheckSearchConfigs()
+{
+    const BoundingBox globalBoundingBox{
+        std::numeric_limits<int32_t>::lowest(),
+        std::numeric_limits<int32_t>::lowest(),
+        std::numeric_limits<int32_t>::max(),
+        std::numeric_limits<int32_t>::max() };
+
+    for (const KDTree::SearchConfig& config : GetCandidates())
+    {
+        uint64_t hash = c_hashOffsetBasis;
+        for (const size_t lampCount : c_referenceLampCounts)
+        {
+            std::vector<KDTree::Data> layout = GenerateBenchmarkLayout(lampCount);
+            std::vector<BoundingBox> boxes;
+            THROW_IF_FAILED(KDTree::GenerateAllBoundingBoxes(layout, globalBoundingBox, boxes, config));
+            hash = AddToHash(hash, boxes.data(), boxes.size() * sizeof(BoundingBox));
+        }
+
+        if (hash != c_referenceBoxesHash)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+KDTree::SearchConfig KDTreeTuner::Tune(LayoutClass layoutClass)
+{
+    THROW_HR_IF(E_INVALIDARG, static_cast<uint32_t>(layoutClass) >= c_layoutClassCount);
+
+    std::vector<KDTree::Data> kdTree = GenerateBenchmarkLayout(c_layoutClassBenchmarkLampCounts[static_cast<uint32_t>(layoutClass)]);
+    std::vector<KDTree::QueueData> searchQueue[2];
+    std::vector<size_t> neighbors;
+    THROW_IF_FAILED(KDTree::GenerateKDTreeInPlace(kdTree, searchQueue));
+
+    const std::vector<KDTree::SearchConfig> candidates = GetCandidates();
+    std::vector<std::chrono::steady_clock::duration> bestTimes(candidates.size(), std::chrono::steady_clock::duration::max());
+
+    for (uint32_t round = 0; round < c_benchmarkRoundCount; round++)
+    {
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            bestTimes[i] = std::min(bestTimes[i], TimeSearches(kdTree, candidates[i], searchQueue, neighbors));
+        }
+    }
+
+    const size_t fastest = static_cast<size_t>(std::min_element(bestTimes.begin(), bestTimes.end()) - bestTimes.begin());
+    return candidates[fastest];
+}
+
+void KDTreeTuner::LoadOrTuneProfile(const std::filesystem::path& path)
+{
+#if defined(_DEBUG)
+    THROW_HR_IF(E_UNEXPECTED, !CheckSearchConfigs());
+#endif
+
+    const uint64_t machineSignature = GetMachineSignature();
+    KDTree::SearchConfig configs[c_layoutClassCount];
+
+    // Anything wrong with the profile just means tuning again
+    {
+        std::ifstream file(path, std::ios::binary);
+
+        ProfileHeader header{};
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        file.read(reinterpret_cast<char*>(configs), sizeof(configs));
+
+        bool isValid = file &&
+            (header.magic == c_profileMagic) &&
+            (header.version == c_profileVersion) &&
+            (header.machineSignature == machineSignature) &&
+            (header.layoutClassCount == c_layoutClassCount);
+        for (const KDTree::SearchConfig& config : configs)
+        {
+            isValid = isValid &&
+                (config.leafSize <= c_maxLeafSize) &&
+                ((config.traversal == KDTree::SearchTraversal::LevelOrder) || (config.traversal == KDTree::SearchTraversal::DepthFirst));
+        }
+
+        if (isValid)
+        {
+            for (uint32_t i = 0; i < c_layoutClassCount; i++)
+            {
+                s_searchConfigs[i].store(configs[i], std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+
+    for (uint32_t i = 0; i < c_layoutClassCount; i++)
+    {
+        configs[i] = Tune(static_cast<LayoutClass>(i));
+    }
+
+    // Used even if the profile can't be saved
+    for (uint32_t i = 0; i < c_layoutClassCount; i++)
+    {
+        s_searchConfigs[i].store(configs[i], std::memory_order_relaxed);
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_OPEN_FAILED), !file.is_open());
+
+    const ProfileHeader header{ c_profileMagic, c_profileVersion, machineSignature, c_layoutClassCount, 0 };
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(configs), sizeof(configs));
+    file.flush();
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), !file);
+}
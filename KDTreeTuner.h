@@ -0,0 +1,41 @@
+#pragma once
+
+#include "KDTree.h"
+
+// Picks the KDTree::SearchConfig that generates boxes fastest on this machine, for each class of
+// layout, by timing the searches of every candidate on a synthetic layout of the class. The winners
+// are kept in a small profile file, so the benchmarks (well under a second) only run again when the
+// app is started on another machine.
+//
+// Until a profile is loaded or tuned, GetSearchConfig returns the defaults. Every config gives the
+// same boxes (see KDTree::SearchConfig), so a profile only changes how fast they're generated.
+namespace KDTreeTuner
+{
+    // Layouts are grouped by how many Lamps they have, which is what the best config depends on most.
+    enum class LayoutClass : uint32_t
+    {
+        Small, // Up to 256 Lamps, e.g. keyboards and mice
+        Medium, // Up to 4096 Lamps, e.g. strips and panels
+        Large, // Up to 65536 Lamps, e.g. video walls
+        Huge, // Installations
+        Count,
+    };
+
+    LayoutClass GetLayoutClass(size_t lampCount) noexcept;
+
+    // The config to generate the boxes of a layout of lampCount Lamps with. Safe to call from any thread.
+    KDTree::SearchConfig GetSearchConfig(size_t lampCount) noexcept;
+
+    // Regression check: generates the boxes of fixed layouts with every candidate SearchConfig and
+    // returns false if any of them differ from the reference boxes. Debug builds run it before
+    // loading or tuning a profile.
+    bool CheckSearchConfigs();
+
+    // Benchmarks every candidate config for layoutClass and returns the fastest.
+    KDTree::SearchConfig Tune(LayoutClass layoutClass);
+
+    // Uses the configs of the profile at path if it was made on this machine, otherwise tunes every
+    // class and saves them there. Throws if tuning or saving fails, tuned configs are used even
+    // if they couldn't be saved.
+    void LoadOrTuneProfile(const std::filesystem::path& path);
+}
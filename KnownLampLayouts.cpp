@@ -0,0 +1,41 @@
+#include "pch.h"
+#include "KnownLampLayouts.h"
+
+// LampArrayTools generates the tables, so it is built without them
+#if !defined(LAMPARRAY_NO_KNOWN_LAYOUTS)
+#include "KnownLampLayoutReferenceKeyboard104.h"
+#endif
+
+constexpr KnownLampLayout c_knownLampLayouts[] =
+{
+#if !defined(LAMPARRAY_NO_KNOWN_LAYOUTS)
+    // Reference layout that keeps the build step exercised. Its vendor ID isn't assigned to
+    // anyone, so it never matches a device.
+    KNOWN_LAMP_LAYOUT(ReferenceKeyboard104),
+#endif
+
+    // Keeps the list valid when it is empty (in LampArrayTools), a table without Lamps never matches
+    KnownLampLayout{},
+};
+
+bool KnownLampLayouts::HasLampCount(uint32_t lampCount)
+{
+    return (lampCount != 0) && std::any_of(std::begin(c_knownLampLayouts), std::end(c_knownLampLayouts),
+        [&](const KnownLampLayout& knownLayout) { return knownLayout.layout.lampCount == lampCount; });
+}
+
+const PrecomputedLampLayout* KnownLampLayouts::Find(uint16_t vendorId, uint16_t productId, uint32_t lampCount)
+{
+    for (const KnownLampLayout& knownLayout : c_knownLampLayouts)
+    {
+        if ((knownLayout.vendorId == vendorId) &&
+            (knownLayout.productId == productId) &&
+            (knownLayout.layout.lampCount == lampCount) &&
+            (lampCount != 0))
+        {
+            return &knownLayout.layout;
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "LampArrayBitmapHelper.h"
+
+// Built-in layouts of LampArray models whose Lamp positions are fixed and published, e.g. the
+// keyboards and mice we ship with. LampArrayBitmapHelper::Initialize sets these models up from
+// their table instead of querying every Lamp and generating the boxes on every connect.
+//
+// The tables are generated by a build step: LampArrayTools compile-layout runs over the Lamp
+// positions in KnownLampLayouts\<Model>.csv and writes KnownLampLayout<Model>.h to the generated
+// files. Models this small are compiled as a single tile, so their boxes are exactly the ones
+// Initialize generates, whatever KDTree::SearchConfig it uses. The build fails rather than build in
+// a table with approximate Lamps. To add a model, add its KnownLampLayout item (positions, IDs and
+// bounding box) to the project, and its header and KNOWN_LAMP_LAYOUT entry to KnownLampLayouts.cpp.
+struct KnownLampLayout
+{
+    uint16_t vendorId;
+    uint16_t productId;
+    PrecomputedLampLayout layout;
+};
+
+// Entry for the tables of a generated KnownLampLayout<Model>.h.
+#define KNOWN_LAMP_LAYOUT(model) \
+    KnownLampLayout{ \
+        KnownLampLayouts::model::c_vendorId, \
+        KnownLampLayouts::model::c_productId, \
+        PrecomputedLampLayout{ \
+            KnownLampLayouts::model::c_minUpdateIntervalInMicroseconds, \
+            KnownLampLayouts::model::c_boundingBox, \
+            std::size(KnownLampLayouts::model::c_lampPositions), \
+            KnownLampLayouts::model::c_lampPositions, \
+            KnownLampLayouts::model::c_planePositions, \
+            KnownLampLayouts::model::c_lampBoxes } }
+
+namespace KnownLampLayouts
+{
+    // Whether any built-in layout has lampCount Lamps, so devices that can't match any skip
+    // asking for their IDs.
+    bool HasLampCount(uint32_t lampCount);
+
+    // The layout built in for this model, or nullptr if there is none. A device reporting a
+    // different number of Lamps than its model's table (e.g. another revision) gets nullptr too.
+    const PrecomputedLampLayout* Find(uint16_t vendorId, uint16_t productId, uint32_t lampCount);
+}
@@ -1,23 +1,171 @@
 #include "pch.h"
 #include "LampArrayBitmapHelper.h"
+#include "KnownLampLayouts.h"
+#include "LampLayoutFile.h"
+#include "KDTreeTuner.h"
+#include "PerformanceMetrics.h"
+#include "TraceRecorder.h"
 
 const uint32_t c_metersToMillimetersConversion = 1000;
 
-void LampArrayBitmapHelper::Initialize()
+// Coarse grid sampled by DisplayBitmapFallback, 8x8 pixels is enough for an average color.
+const uint32_t c_fallbackSampleGridSize = 8;
+
+LampArrayBitmapHelper::LampArrayBitmapHelper(_In_opt_ ILampArray* lampArray) :
+    m_lampArray(lampArray),
+    m_colorSubmitter(lampArray)
+{
+    // The frame pipeline schedules a LampArray at its own rate as soon as it connects
+    if (lampArray != nullptr)
+    {
+        m_description.minUpdateIntervalInMicroseconds = lampArray->GetMinUpdateIntervalInMicroseconds();
+    }
+}
+
+void LampArrayBitmapHelper::Initialize(const LampLayoutDirectory* layoutDirectory)
+{
+    METRICS_TIME_SCOPE(Initialize);
+    TRACE_SCOPE("LampArrayBitmapHelper::Initialize");
+
+    try
+    {
+        const uint32_t lampCount = m_lampArray->GetLampCount();
+
+        // Models with compiled or published Lamp positions skip querying every Lamp and generating
+        // the boxes. A layout file wins over a built-in table, so a model can be fixed without a rebuild.
+        // Only a device with as many Lamps as some layout is asked for its IDs.
+        const bool hasLayoutFile = (layoutDirectory != nullptr) && layoutDirectory->HasLampCount(lampCount);
+        const PrecomputedLampLayout* knownLayout = nullptr;
+        if (hasLayoutFile || KnownLampLayouts::HasLampCount(lampCount))
+        {
+            const uint16_t vendorId = m_lampArray->GetHardwareVendorId();
+            const uint16_t productId = m_lampArray->GetHardwareProductId();
+
+            knownLayout = hasLayoutFile ? layoutDirectory->Find(vendorId, productId, lampCount) : nullptr;
+            if (knownLayout == nullptr)
+            {
+                knownLayout = KnownLampLayouts::Find(vendorId, productId, lampCount);
+            }
+        }
+
+        if (knownLayout != nullptr)
+        {
+            LoadPrecomputedLayout(*knownLayout);
+        }
+        else
+        {
+            QueryDescription(lampCount);
+            InitializeLayout();
+        }
+    }
+    catch (...)
+    {
+        m_state.store(LampArrayBitmapHelperState::Failed, std::memory_order_release);
+        throw;
+    }
+
+    m_state.store(LampArrayBitmapHelperState::Ready, std::memory_order_release);
+}
+
+void LampArrayBitmapHelper::InitializeFromDescription(const LampArrayDescription& description)
+{
+    try
+    {
+        m_description = description;
+        InitializeLayout();
+    }
+    catch (...)
+    {
+        m_state.store(LampArrayBitmapHelperState::Failed, std::memory_order_release);
+        throw;
+    }
+
+    m_state.store(LampArrayBitmapHelperState::Ready, std::memory_order_release);
+}
+
+void LampArrayBitmapHelper::InitializeFromPrecomputedLayout(const PrecomputedLampLayout& layout)
+{
+    METRICS_TIME_SCOPE(Initialize);
+    TRACE_SCOPE("LampArrayBitmapHelper::InitializeFromPrecomputedLayout");
+
+    try
+    {
+        THROW_HR_IF(E_INVALIDARG, m_lampArray && (m_lampArray->GetLampCount() != layout.lampCount));
+        LoadPrecomputedLayout(layout);
+    }
+    catch (...)
+    {
+        m_state.store(LampArrayBitmapHelperState::Failed, std::memory_order_release);
+        throw;
+    }
+
+    m_state.store(LampArrayBitmapHelperState::Ready, std::memory_order_release);
+}
+
+void LampArrayBitmapHelper::LoadPrecomputedLayout(const PrecomputedLampLayout& layout)
+{
+    // A LampArray's own interval was read on construction
+    if (!m_lampArray)
+    {
+        m_description.minUpdateIntervalInMicroseconds = layout.minUpdateIntervalInMicroseconds;
+    }
+
+    m_description.boundingBox = layout.boundingBox;
+    m_description.lampPositions.assign(layout.lampPositions, layout.lampPositions + layout.lampCount);
+
+    m_selectedLampIndices.resize(layout.lampCount);
+    std::iota(m_selectedLampIndices.begin(), m_selectedLampIndices.end(), 0);
+
+    CalculateOrientationAndBottomRightCorner();
+    LoadBoundingBoxesForAllLamps(layout);
+    FindBoundingBoxesForSelectedLamps();
+    ThrowIfCancelled();
+}
+
+void LampArrayBitmapHelper::QueryDescription(uint32_t lampCount)
+{
+    TRACE_SCOPE("QueryDescription");
+
+    m_lampArray->GetBoundingBox(&m_description.boundingBox);
+
+    m_description.lampPositions.resize(lampCount);
+
+    for (auto i = 0u; i < lampCount; i++)
+    {
+        // Querying every Lamp is the slow part, so bail out early if the device went away
+        ThrowIfCancelled();
+
+        wil::com_ptr_nothrow<ILampInfo> lampInfo;
+        THROW_IF_FAILED(m_lampArray->GetLampInfo(i, &lampInfo));
+
+        lampInfo->GetPosition(&m_description.lampPositions[i]);
+    }
+}
+
+void LampArrayBitmapHelper::InitializeLayout()
 {
     //  In this example, all Lamps of the LampArray will be used.
-    m_selectedLampIndices.resize(m_lampArray->GetLampCount());
+    m_selectedLampIndices.resize(m_description.lampPositions.size());
     std::iota(m_selectedLampIndices.begin(), m_selectedLampIndices.end(), 0);
 
     CalculateOrientationAndBottomRightCorner();
     FindBoundingBoxesForAllLamps();
+    ThrowIfCancelled();
     FindBoundingBoxesForSelectedLamps();
+    ThrowIfCancelled();
 }
 
-void LampArrayBitmapHelper::CalculateOrientationAndBottomRightCorner()
+void LampArrayBitmapHelper::ThrowIfCancelled() const
+{
+    if (m_cancelRequested.load(std::memory_order_relaxed))
+    {
+        THROW_HR(HRESULT_FROM_WIN32(ERROR_CANCELLED));
+    }
+}
+
+LampArrayBitmapOrientation LampArrayBitmapHelper::SelectOrientation(const LampArrayPosition& boundingBoxInMeters)
 {
-    LampArrayPosition boundingBox{};
-    m_lampArray->GetBoundingBox(&boundingBox);
+    LampArrayPosition boundingBox = boundingBoxInMeters;
 
     boundingBox.xInMeters *= c_metersToMillimetersConversion;
     boundingBox.yInMeters *= c_metersToMillimetersConversion;
@@ -29,53 +177,63 @@ void LampArrayBitmapHelper::CalculateOrientationAndBottomRightCorner()
 
     if (xyPlane >= yzPlane && xyPlane >= xzPlane)
     {
-        m_orientation = LampArrayBitmapOrientation::XYPlane;
+        return LampArrayBitmapOrientation::XYPlane;
     }
     else if (yzPlane >= xzPlane && yzPlane >= xyPlane)
     {
-        m_orientation = LampArrayBitmapOrientation::YZPlane;
+        return LampArrayBitmapOrientation::YZPlane;
     }
     else if (xzPlane >= yzPlane && xzPlane >= xyPlane)
     {
-        m_orientation = LampArrayBitmapOrientation::XZPlane;
-    }
-    else
-    {
-        // All else fails assume XY.
-        m_orientation = LampArrayBitmapOrientation::XYPlane;
+        return LampArrayBitmapOrientation::XZPlane;
     }
 
-    m_lampArrayBottomRight = TransformToOrientation(boundingBox);
+    // All else fails assume XY.
+    return LampArrayBitmapOrientation::XYPlane;
+}
+
+void LampArrayBitmapHelper::CalculateOrientationAndBottomRightCorner()
+{
+    LampArrayPosition boundingBox = m_description.boundingBox;
+
+    boundingBox.xInMeters *= c_metersToMillimetersConversion;
+    boundingBox.yInMeters *= c_metersToMillimetersConversion;
+    boundingBox.zInMeters *= c_metersToMillimetersConversion;
+
+    m_orientation = SelectOrientation(m_description.boundingBox);
+    m_lampArrayBottomRight = TransformToOrientation(m_orientation, boundingBox);
+}
+
+KDTree::Point LampArrayBitmapHelper::GetPlanePosition(LampArrayBitmapOrientation orientation, const LampArrayPosition& position)
+{
+    // All positions are in meters, convert to millimeters
+    LampArrayPosition position2D = TransformToOrientation(orientation, position);
+
+    position2D.xInMeters *= c_metersToMillimetersConversion;
+    position2D.yInMeters *= c_metersToMillimetersConversion;
+
+    return KDTree::Point{ { static_cast<int32_t>(position2D.xInMeters), static_cast<int32_t>(position2D.yInMeters) } };
 }
 
 void LampArrayBitmapHelper::FindBoundingBoxesForAllLamps()
 {
-    auto lampCount = m_lampArray->GetLampCount();
+    TRACE_SCOPE("FindBoundingBoxesForAllLamps");
+
+    const size_t lampCount = m_description.lampPositions.size();
     if (lampCount == 0) { return; }
 
     std::vector<KDTree::Data> looseKdTreeNodes;
     looseKdTreeNodes.resize(lampCount);
+    m_lampPositions.resize(lampCount);
 
-    for (auto i = 0u; i < lampCount; i++)
+    for (size_t i = 0; i < lampCount; i++)
     {
-        wil::com_ptr_nothrow<ILampInfo> lampInfo;
-        THROW_IF_FAILED(m_lampArray->GetLampInfo(i, &lampInfo));
-
-        LampArrayPosition position3D{};
-        lampInfo->GetPosition(&position3D);
-
-        // All positions are in meters, convert to millimeters
-        LampArrayPosition position2D = TransformToOrientation(position3D);
-
-        position2D.xInMeters *= c_metersToMillimetersConversion;
-        position2D.yInMeters *= c_metersToMillimetersConversion;
-
         // Push in the loose data nodes into the k-d tree, still needs to be generated
         KDTree::Data data{};
-        data.point.values[0] = static_cast<int32_t>(position2D.xInMeters);
-        data.point.values[1] = static_cast<int32_t>(position2D.yInMeters);
+        data.point = GetPlanePosition(m_orientation, m_description.lampPositions[i]);
         data.indexBoundingBox = i;
         looseKdTreeNodes[i] = data;
+        m_lampPositions[i] = data.point;
     }
 
     // Makes sure that all the bounding boxes are clamped to the published device limits
@@ -85,64 +243,267 @@ void LampArrayBitmapHelper::FindBoundingBoxesForAllLamps()
         static_cast<int32_t>(m_lampArrayBottomRight.xInMeters),
         static_cast<int32_t>(m_lampArrayBottomRight.yInMeters) };
 
-    KDTree::GenerateAllBoundingBoxes(looseKdTreeNodes, globalBoundingBox, m_lampBoxes);
+    std::vector<BoundingBox> lampBoxes;
+    THROW_IF_FAILED(KDTree::GenerateAllBoundingBoxes(
+        looseKdTreeNodes,
+        globalBoundingBox,
+        lampBoxes,
+        KDTreeTuner::GetSearchConfig(looseKdTreeNodes.size())));
+
+    SortLampsSpatially(lampBoxes);
+    m_lampBoxes.Assign(lampBoxes);
+}
+
+void LampArrayBitmapHelper::LoadBoundingBoxesForAllLamps(const PrecomputedLampLayout& layout)
+{
+    if (layout.lampCount == 0) { return; }
+
+    m_lampPositions.assign(layout.planePositions, layout.planePositions + layout.lampCount);
+
+    // Stored by Lamp index, only the (cheap) spatial sort is left to do
+    std::vector<BoundingBox> lampBoxes(layout.lampBoxes, layout.lampBoxes + layout.lampCount);
+    SortLampsSpatially(lampBoxes);
+    m_lampBoxes.Assign(lampBoxes);
 }
 
 void LampArrayBitmapHelper::FindBoundingBoxesForSelectedLamps()
 {
-    m_selectedLampBoxes.reserve(m_selectedLampIndices.size());
+    if (m_selectedLampIndices.empty()) { return; }
+
+    // Every Lamp is selected and m_lampBoxes already holds them in sampling order,
+    // so only the width/height of the selection is left to find.
+    m_selectedEncompassingBox = m_lampBoxes.GetEncompassingBox(nullptr, m_lampBoxes.GetCount());
+}
+
+void LampArrayBitmapHelper::SortLampsSpatially(std::vector<BoundingBox>& lampBoxes)
+{
+    const size_t lampCount = lampBoxes.size();
+    if (lampCount < 2) { return; }
+
+    const std::vector<uint32_t> order = LampSampling::GetSpatialOrder(
+        lampBoxes,
+        static_cast<int32_t>(m_lampArrayBottomRight.xInMeters),
+        static_cast<int32_t>(m_lampArrayBottomRight.yInMeters));
+
+    std::vector<uint32_t> sortedIndices(lampCount);
+    std::vector<BoundingBox> sortedBoxes(lampCount);
+    for (size_t i = 0; i < lampCount; i++)
+    {
+        sortedIndices[i] = m_selectedLampIndices[order[i]];
+        sortedBoxes[i] = lampBoxes[order[i]];
+    }
+
+    m_selectedLampIndices = std::move(sortedIndices);
+    lampBoxes = std::move(sortedBoxes);
+}
+
+void LampArrayBitmapHelper::AddZone(const std::string& name, const std::vector<uint32_t>& lampIndices)
+{
+    const size_t lampCount = m_selectedLampIndices.size();
 
-    // Find corresponding selected positions.
-    for (auto i = 0u; i < m_selectedLampIndices.size(); i++)
+    // Where each Lamp's box sits in m_lampBoxes
+    std::vector<uint32_t> boxIndexOfLamp(lampCount);
+    for (size_t i = 0; i < lampCount; i++)
     {
-        m_selectedLampBoxes.push_back(m_lampBoxes[m_selectedLampIndices[i]]);
+        boxIndexOfLamp[m_selectedLampIndices[i]] = static_cast<uint32_t>(i);
     }
 
-    // Determine width/height of the selection.
-    BoundingBox selectedEncompassingBox = m_selectedLampBoxes[0];
-    for (size_t i = 1; i < m_selectedLampBoxes.size(); i++)
+    auto zone = std::make_shared<Zone>();
+    zone->name = name;
+    zone->boxIndices.reserve(lampIndices.size());
+    for (uint32_t lampIndex : lampIndices)
     {
-        if (m_selectedLampBoxes[i].Left < selectedEncompassingBox.Left)
-        {
-            selectedEncompassingBox.Left = m_selectedLampBoxes[i].Left;
-        }
+        THROW_HR_IF(E_INVALIDARG, lampIndex >= lampCount);
+        zone->boxIndices.push_back(boxIndexOfLamp[lampIndex]);
+    }
+
+    // Ascending box indices walk m_lampBoxes forward, in sampling order
+    std::sort(zone->boxIndices.begin(), zone->boxIndices.end());
+    zone->boxIndices.erase(std::unique(zone->boxIndices.begin(), zone->boxIndices.end()), zone->boxIndices.end());
+
+    if (!zone->boxIndices.empty())
+    {
+        zone->encompassingBox = m_lampBoxes.GetEncompassingBox(zone->boxIndices.data(), zone->boxIndices.size());
+    }
+
+    auto lock = m_zonesLock.lock_exclusive();
+    RemoveZoneLocked(name);
+    m_zones.push_back(std::move(zone));
+}
+
+void LampArrayBitmapHelper::RemoveZone(const std::string& name)
+{
+    auto lock = m_zonesLock.lock_exclusive();
+    RemoveZoneLocked(name);
+}
 
-        if (m_selectedLampBoxes[i].Top < selectedEncompassingBox.Top)
+void LampArrayBitmapHelper::RemoveZoneLocked(const std::string& name)
+{
+    m_zones.erase(
+        std::remove_if(m_zones.begin(), m_zones.end(),
+            [&](const std::shared_ptr<const Zone>& zone) { return zone->name == name; }),
+        m_zones.end());
+}
+
+void LampArrayBitmapHelper::SampleZoneBitmap(
+    const std::string& name,
+    const BitmapView& bitmap,
+    const BitmapRegion& region,
+    std::vector<LampArrayColor>& colors,
+    WorkStealingThreadPool* threadPool) const
+{
+    // Held on to, so the zone can be removed while it is being sampled
+    std::shared_ptr<const Zone> zone;
+    {
+        auto lock = m_zonesLock.lock_shared();
+        for (const auto& existingZone : m_zones)
         {
-            selectedEncompassingBox.Top = m_selectedLampBoxes[i].Top;
+            if (existingZone->name == name)
+            {
+                zone = existingZone;
+            }
         }
+    }
+
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), zone == nullptr);
 
-        if (m_selectedLampBoxes[i].Right > selectedEncompassingBox.Right)
+    colors.resize(m_lampBoxes.GetCount());
+    if (zone->boxIndices.empty())
+    {
+        return;
+    }
+
+    const LampBoxLayout layout{ &m_lampBoxes, zone->boxIndices.data(), zone->boxIndices.size(), zone->encompassingBox };
+
+    LampSampling::SampleBitmap(
+        bitmap,
+        region,
+        layout,
+        (m_colorTransformStage == ColorTransformStage::BeforeSampling) ? &m_colorTransform : nullptr,
+        (m_colorTransformStage == ColorTransformStage::AfterSampling) ? &m_colorTransform : nullptr,
+        colors,
+        threadPool);
+}
+
+void LampArrayBitmapHelper::SampleBitmap(
+    const BitmapView& bitmap,
+    const BitmapRegion& region,
+    std::vector<LampArrayColor>& colors,
+    WorkStealingThreadPool* threadPool) const
+{
+    LampSampling::SampleBitmap(
+        bitmap,
+        region,
+        GetSelectedLampLayout(),
+        (m_colorTransformStage == ColorTransformStage::BeforeSampling) ? &m_colorTransform : nullptr,
+        (m_colorTransformStage == ColorTransformStage::AfterSampling) ? &m_colorTransform : nullptr,
+        colors,
+        threadPool);
+}
+
+void LampArrayBitmapHelper::SampleBitmap(const BitmapView& bitmap, std::vector<LampArrayColor>& colors) const
+{
+    SampleBitmap(bitmap, BitmapRegion{ 0, 0, bitmap.Width, bitmap.Height }, colors);
+}
+
+void LampArrayBitmapHelper::DisplayBitmap(const BitmapView& bitmap, const BitmapRegion& region)
+{
+    SampleBitmap(bitmap, region, m_selectedLampColors);
+    SubmitColors(m_selectedLampColors);
+}
+
+size_t LampArrayBitmapHelper::SubmitColors(const std::vector<LampArrayColor>& colors)
+{
+    return m_colorSubmitter.Submit(m_selectedLampIndices, colors);
+}
+
+void LampArrayBitmapHelper::DisplayBitmapFallback(const BitmapView& bitmap, const BitmapRegion& region)
+{
+    SubmitFallbackColor(ComputeFallbackColor(bitmap, region));
+}
+
+LampArrayColor LampArrayBitmapHelper::ComputeFallbackColor(const BitmapView& bitmap, const BitmapRegion& region) const
+{
+    THROW_HR_IF(E_INVALIDARG, bitmap.Data == nullptr);
+    THROW_HR_IF(E_INVALIDARG, (bitmap.Format == BitmapFormat::NV12) && (bitmap.ChromaData == nullptr));
+    THROW_HR_IF(E_INVALIDARG, !IsRegionInsideBitmap(bitmap, region));
+    THROW_HR_IF(E_INVALIDARG, !IsRegionAlignedForFormat(bitmap.Format, region));
+
+    if (region.Width == 0 || region.Height == 0)
+    {
+        return LampArrayColor{};
+    }
+
+    const BitmapView regionView = CropBitmapView(bitmap, region);
+
+    uint32_t sums[4]{};
+    uint32_t sampleCount = 0;
+    for (uint32_t row = 0; row < c_fallbackSampleGridSize; row++)
+    {
+        const uint32_t y = static_cast<uint32_t>((static_cast<uint64_t>(regionView.Height) * (2 * row + 1)) / (2 * c_fallbackSampleGridSize));
+        for (uint32_t column = 0; column < c_fallbackSampleGridSize; column++)
         {
-            selectedEncompassingBox.Right = m_selectedLampBoxes[i].Right;
+            const uint32_t x = static_cast<uint32_t>((static_cast<uint64_t>(regionView.Width) * (2 * column + 1)) / (2 * c_fallbackSampleGridSize));
+
+            LampArrayColor color;
+            PixelConversion::ConvertPixels(regionView, x, y, 1, nullptr, &color);
+            sums[0] += color.r;
+            sums[1] += color.g;
+            sums[2] += color.b;
+            sums[3] += color.a;
+            sampleCount++;
         }
+    }
+
+    LampArrayColor fallbackColor{
+        static_cast<uint8_t>(sums[0] / sampleCount),
+        static_cast<uint8_t>(sums[1] / sampleCount),
+        static_cast<uint8_t>(sums[2] / sampleCount),
+        static_cast<uint8_t>(sums[3] / sampleCount) };
+
+    if (m_colorTransformStage != ColorTransformStage::None)
+    {
+        PixelConversion::ApplyColorTransform(m_colorTransform, &fallbackColor, 1);
+    }
+
+    return fallbackColor;
+}
 
-        if (m_selectedLampBoxes[i].Bottom > selectedEncompassingBox.Bottom)
+void LampArrayBitmapHelper::SubmitFallbackColor(const LampArrayColor& fallbackColor)
+{
+    if (!m_hasSentFallbackColor ||
+        (memcmp(&fallbackColor, &m_fallbackColor, sizeof(fallbackColor)) != 0))
+    {
+        if (m_lampArray)
         {
-            selectedEncompassingBox.Bottom = m_selectedLampBoxes[i].Bottom;
+            m_lampArray->SetColor(fallbackColor);
         }
+        m_fallbackColor = fallbackColor;
+        m_hasSentFallbackColor = true;
+
+        // Every Lamp was just overwritten
+        m_colorSubmitter.Invalidate();
     }
+}
 
-    m_selectedEncompassingBoxWidth = static_cast<uint32_t>(
-        selectedEncompassingBox.Right - selectedEncompassingBox.Left);
-    m_selectedEncompassingBoxHeight = static_cast<uint32_t>(
-        selectedEncompassingBox.Bottom - selectedEncompassingBox.Top);
+void LampArrayBitmapHelper::SetColorTransform(const ColorTransform& transform, ColorTransformStage stage)
+{
+    m_colorTransform = transform;
+    m_colorTransformStage = stage;
+}
 
-    // Zero all selected positions to the new origin.
-    for (size_t i = 0; i < m_selectedLampBoxes.size(); i++)
+void LampArrayBitmapHelper::ApplyColorTransform(std::vector<LampArrayColor>& colors) const
+{
+    if (m_colorTransformStage != ColorTransformStage::None)
     {
-        m_selectedLampBoxes[i].Left -= selectedEncompassingBox.Left;
-        m_selectedLampBoxes[i].Top -= selectedEncompassingBox.Top;
-
-        m_selectedLampBoxes[i].Right -= selectedEncompassingBox.Left;
-        m_selectedLampBoxes[i].Bottom -= selectedEncompassingBox.Top;
+        PixelConversion::ApplyColorTransform(m_colorTransform, colors.data(), colors.size());
     }
 }
 
-LampArrayPosition LampArrayBitmapHelper::TransformToOrientation(const LampArrayPosition& position)
+LampArrayPosition LampArrayBitmapHelper::TransformToOrientation(LampArrayBitmapOrientation orientation, const LampArrayPosition& position)
 {
     LampArrayPosition ret{};
-    switch (m_orientation)
+    switch (orientation)
     {
     case LampArrayBitmapOrientation::YZPlane:
         ret.xInMeters = position.yInMeters;
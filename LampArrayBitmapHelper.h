@@ -1,6 +1,8 @@
 #pragma once
 
 #include "KDTree.h"
+#include "LampSampling.h"
+#include "LampColorSubmitter.h"
 
 enum class LampArrayBitmapOrientation : uint32_t
 {
@@ -9,26 +11,167 @@ enum class LampArrayBitmapOrientation : uint32_t
     YZPlane,
 };
 
+// Everything Initialize reads from a LampArray. Lets a session be recorded and the same layout
+// replayed later without the device (see SessionTrace).
+struct LampArrayDescription
+{
+    uint64_t minUpdateIntervalInMicroseconds;
+    LampArrayPosition boundingBox; // In meters
+    std::vector<LampArrayPosition> lampPositions; // In meters, by Lamp index
+};
+
+// A LampArray layout computed ahead of time (see LampLayoutFile), with everything the k-d tree
+// would otherwise generate on connect. Borrows the arrays, which are lampCount long each.
+struct PrecomputedLampLayout
+{
+    uint64_t minUpdateIntervalInMicroseconds;
+    LampArrayPosition boundingBox; // In meters
+    size_t lampCount;
+    const LampArrayPosition* lampPositions; // In meters, by Lamp index
+    const KDTree::Point* planePositions; // On the bitmap plane in millimeters, by Lamp index
+    const BoundingBox* lampBoxes; // By Lamp index
+};
+
+struct LampLayoutDirectory;
+
+enum class LampArrayBitmapHelperState : uint32_t
+{
+    Pending, // Initialize hasn't completed yet
+    Ready,
+    Failed, // Initialize threw or was cancelled
+};
+
 struct LampArrayBitmapHelper
 {
 public:
-    LampArrayBitmapHelper(_In_ ILampArray* lampArray) : m_lampArray(lampArray) {}
-    void Initialize();
+    // lampArray is nullptr for a stand-in replaying a recorded LampArrayDescription. It samples like
+    // any other helper, but sending only keeps track of what a device would have been sent.
+    LampArrayBitmapHelper(_In_opt_ ILampArray* lampArray);
+
+    // Safe to call from any thread, but only once. Everything but GetLampArray, GetState, Cancel
+    // and DisplayBitmapFallback must wait until GetState() returns Ready.
+    // Models with a layout file in layoutDirectory, or else listed in KnownLampLayouts, are set up
+    // from that layout instead.
+    void Initialize(_In_opt_ const LampLayoutDirectory* layoutDirectory = nullptr);
+
+    // Same as Initialize, with the layout taken from description instead of the LampArray.
+    void InitializeFromDescription(const LampArrayDescription& description);
+
+    // Same as Initialize, but skips querying every Lamp and generating the boxes. Throws if the
+    // LampArray (when there is one) doesn't have as many Lamps as layout. layout is copied.
+    void InitializeFromPrecomputedLayout(const PrecomputedLampLayout& layout);
+
+    // What Initialize read from the LampArray, once Ready. minUpdateIntervalInMicroseconds is read
+    // on construction already, and can be used while Pending.
+    const LampArrayDescription& GetDescription() const { return m_description; }
+
+    // Makes a pending or running Initialize stop early and fail, e.g. when the LampArray disconnects.
+    void Cancel() { m_cancelRequested.store(true, std::memory_order_relaxed); }
+
+    LampArrayBitmapHelperState GetState() const { return m_state.load(std::memory_order_acquire); }
 
     ILampArray* GetLampArray() { return m_lampArray.get(); }
     LampArrayBitmapOrientation GetOrientation() { return m_orientation; }
+    const std::vector<uint32_t>& GetSelectedLampIndices() const { return m_selectedLampIndices; }
+
+    // The boxes of the selected Lamps, ordered like GetSelectedLampIndices(), for code that works
+    // on Lamp positions rather than bitmaps (e.g. ProceduralEffectEvaluator).
+    LampBoxLayout GetSelectedLampLayout() const { return LampBoxLayout{ &m_lampBoxes, nullptr, 0, m_selectedEncompassingBox }; }
+
+    // Where each Lamp (by Lamp index) and the bottom right corner of the LampArray sit on the
+    // bitmap plane, in millimeters. Lets a LampArrayCanvas lay out several LampArrays together.
+    const std::vector<KDTree::Point>& GetLampPositions() const { return m_lampPositions; }
+    KDTree::Point GetBottomRight() const
+    {
+        return KDTree::Point{ { static_cast<int32_t>(m_lampArrayBottomRight.xInMeters), static_cast<int32_t>(m_lampArrayBottomRight.yInMeters) } };
+    }
+
+    // Averages the pixels under each selected Lamp into colors, ordered like GetSelectedLampIndices().
+    // The encompassing box of the selected Lamps is stretched over region, and only the pixels of
+    // bitmap under a selected Lamp are read. The bitmap is borrowed, nothing is copied.
+    // Large selections are split into shards sampled in parallel on threadPool, when given.
+    void SampleBitmap(
+        const BitmapView& bitmap,
+        const BitmapRegion& region,
+        std::vector<LampArrayColor>& colors,
+        _In_opt_ WorkStealingThreadPool* threadPool = nullptr) const;
+    void SampleBitmap(const BitmapView& bitmap, std::vector<LampArrayColor>& colors) const;
+
+    // Zones are named subsets of the Lamps, e.g. WASD, the function row or the underglow, that each
+    // show their own bitmap stretched over their own encompassing box. They only hold indices into
+    // the boxes shared by the whole LampArray, so adding or removing one copies no boxes.
+    // Zones may overlap. Adding a zone under an existing name replaces it.
+    void AddZone(const std::string& name, const std::vector<uint32_t>& lampIndices);
+    void RemoveZone(const std::string& name);
+
+    // Samples region of bitmap onto the Lamps of the zone and writes them into colors, ordered like
+    // GetSelectedLampIndices(). The other Lamps' colors are left untouched, so several zones can be
+    // drawn into the same colors in one frame, later ones on top, and sent with a single SubmitColors.
+    void SampleZoneBitmap(
+        const std::string& name,
+        const BitmapView& bitmap,
+        const BitmapRegion& region,
+        std::vector<LampArrayColor>& colors,
+        _In_opt_ WorkStealingThreadPool* threadPool = nullptr) const;
+
+    // Corrects this LampArray's colors, e.g. for its white point. Pass ColorTransformStage::None to disable.
+    void SetColorTransform(const ColorTransform& transform, ColorTransformStage stage);
+
+    // Applies the color transform, whatever its stage, to colors sampled elsewhere (e.g. by a LampArrayCanvas).
+    void ApplyColorTransform(std::vector<LampArrayColor>& colors) const;
+
+    // Samples region of bitmap and sends the selected Lamps whose color changed by more than
+    // the change threshold since the last time they were sent.
+    void DisplayBitmap(const BitmapView& bitmap, const BitmapRegion& region);
+    void SetColorChangeThreshold(uint8_t threshold) { m_colorSubmitter.SetChangeThreshold(threshold); }
+
+    // Sends colors sampled by SampleBitmap, the two can run on different threads.
+    // Returns how many Lamps had changed enough to be sent.
+    size_t SubmitColors(const std::vector<LampArrayColor>& colors);
+
+    // Shows the average color of region on every Lamp. Needs nothing from Initialize,
+    // so it can stand in for DisplayBitmap while the helper isn't Ready.
+    void DisplayBitmapFallback(const BitmapView& bitmap, const BitmapRegion& region);
+    LampArrayColor ComputeFallbackColor(const BitmapView& bitmap, const BitmapRegion& region) const;
+    void SubmitFallbackColor(const LampArrayColor& fallbackColor);
+
+    // Call after writing to the LampArray directly (e.g. SetColor) so the next frame resends every Lamp.
+    void InvalidateSentColors() { m_colorSubmitter.Invalidate(); }
+
+    // The plane a LampArray with boundingBox (in meters) is shown on, the one with the largest area.
+    static LampArrayBitmapOrientation SelectOrientation(const LampArrayPosition& boundingBox);
+    static LampArrayPosition TransformToOrientation(LampArrayBitmapOrientation orientation, const LampArrayPosition& position);
+
+    // Where position (in meters) sits on the bitmap plane, in millimeters. Also used by
+    // LampLayoutCompiler, so layouts computed offline match the ones computed here.
+    static KDTree::Point GetPlanePosition(LampArrayBitmapOrientation orientation, const LampArrayPosition& position);
 
 private:
+    void QueryDescription(uint32_t lampCount);
+    void InitializeLayout();
+    void LoadPrecomputedLayout(const PrecomputedLampLayout& layout);
     void CalculateOrientationAndBottomRightCorner();
     void FindBoundingBoxesForAllLamps();
+    void LoadBoundingBoxesForAllLamps(const PrecomputedLampLayout& layout);
     void FindBoundingBoxesForSelectedLamps();
+    void SortLampsSpatially(std::vector<BoundingBox>& lampBoxes);
+    void RemoveZoneLocked(const std::string& name);
 
-    LampArrayPosition TransformToOrientation(const LampArrayPosition& position);
+    void ThrowIfCancelled() const;
 
     wil::com_ptr_nothrow<ILampArray> m_lampArray;
 
+    // Initialize publishes everything below by storing Ready with release semantics.
+    std::atomic<LampArrayBitmapHelperState> m_state{ LampArrayBitmapHelperState::Pending };
+    std::atomic<bool> m_cancelRequested{};
+
+    // But minUpdateIntervalInMicroseconds, which the constructor sets and Initialize leaves alone.
+    LampArrayDescription m_description{};
+
     // Which Lamps will be used to display the bitmap. In this example,
     // all Lamps of the LampArray will be used.
+    // Once initialized, sorted along a Morton curve like m_lampBoxes, so it doubles as
+    // the permutation from sampling order back to Lamp indices.
     std::vector<uint32_t> m_selectedLampIndices;
 
     // Which plane the bitmap will render on.
@@ -38,14 +181,42 @@ private:
     // No need for the top-left as it will always be 0,0
     LampArrayPosition m_lampArrayBottomRight{};
 
-    // Bounding boxes for every Lamp.
-    std::vector<BoundingBox> m_lampBoxes;
+    // Position of every Lamp on the bitmap plane, in millimeters.
+    std::vector<KDTree::Point> m_lampPositions;
+
+    // Bounding boxes for every Lamp, shared by the selection and every zone.
+    // Sorted along a Morton curve of their centers rather than by Lamp index, so consecutive
+    // Lamps sample nearby pixels and the frame is swept in a cache friendly order.
+    // Blocks of Lamps close together on the curve also share an origin, which keeps the offsets small.
+    CompactBoundingBoxes m_lampBoxes;
+
+    // Smallest box encompassing all bounding boxes selected by this effect.
+    BoundingBox m_selectedEncompassingBox{};
+
+    struct Zone
+    {
+        std::string name;
+        std::vector<uint32_t> boxIndices; // Into m_lampBoxes, ascending
+        BoundingBox encompassingBox;
+    };
+
+    // Zones are immutable once added, so a sampling thread can keep using one after it is removed.
+    mutable wil::srwlock m_zonesLock;
+    std::vector<std::shared_ptr<const Zone>> m_zones;
 
-    // Bounding boxes for just those Lamps selected by this effect.
-    // Origin is zero'd to that of the encompassing box.
-    std::vector<BoundingBox> m_selectedLampBoxes;
+    // Gamma/brightness/white balance correction specific to this LampArray.
+    ColorTransform m_colorTransform{};
+    ColorTransformStage m_colorTransformStage = ColorTransformStage::None;
+
+    // Scratch buffer for DisplayBitmap, kept around so the frame path doesn't allocate.
+    std::vector<LampArrayColor> m_selectedLampColors;
+
+    LampColorSubmitter m_colorSubmitter;
+
+    // Last color sent by SubmitFallbackColor, to avoid resending it every frame.
+    LampArrayColor m_fallbackColor{};
+    bool m_hasSentFallbackColor{};
+};
 
-    // Width/Height of smallest box encompassing all bounding boxes selected by this effect.
-    int32_t m_selectedEncompassingBoxWidth{};
-    int32_t m_selectedEncompassingBoxHeight{};
-};
\ No newline at end of file
+// Immutable list of the connected LampArrays, replaced as a whole whenever one connects or disconnects.
+using LampArraySnapshot = std::vector<std::shared_ptr<LampArrayBitmapHelper>>;
\ No newline at end of file
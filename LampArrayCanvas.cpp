@@ -0,0 +1,270 @@
+#include "pch.h"
+#include "LampArrayCanvas.h"
+#include "KDTreeTuner.h"
+
+const float c_metersToMillimetersConversion = 1000.0f;
+
+// Space left between LampArrays lined up without a placement, in millimeters.
+const int32_t c_automaticPlacementGap = 20;
+
+void LampArrayCanvas::SetPlacement(std::shared_ptr<const LampArrayBitmapHelper> helper, const LampArrayCanvasPlacement& placement)
+{
+    for (auto& existingPlacement : m_placements)
+    {
+        if (existingPlacement.first == helper)
+        {
+            existingPlacement.second = placement;
+            m_placementsChanged = true;
+            return;
+        }
+    }
+
+    m_placements.emplace_back(std::move(helper), placement);
+    m_placementsChanged = true;
+}
+
+void LampArrayCanvas::RemovePlacement(const LampArrayBitmapHelper* helper)
+{
+    m_placements.erase(
+        std::remove_if(m_placements.begin(), m_placements.end(),
+            [&](const auto& placement) { return placement.first.get() == helper; }),
+        m_placements.end());
+    m_placementsChanged = true;
+}
+
+void LampArrayCanvas::RemoveDisconnectedPlacements(const LampArraySnapshot& lampArrays)
+{
+    auto isDisconnected = [&](const auto& placement)
+    {
+        return std::none_of(lampArrays.begin(), lampArrays.end(),
+            [&](const std::shared_ptr<LampArrayBitmapHelper>& helper) { return helper == placement.first; });
+    };
+
+    const auto firstDisconnected = std::remove_if(m_placements.begin(), m_placements.end(), isDisconnected);
+    if (firstDisconnected != m_placements.end())
+    {
+        m_placements.erase(firstDisconnected, m_placements.end());
+        m_placementsChanged = true;
+    }
+}
+
+bool LampArrayCanvas::NeedsBuild(const LampArraySnapshot& lampArrays) const
+{
+    if (m_placementsChanged)
+    {
+        return true;
+    }
+
+    // Build keeps the Ready helpers in snapshot order, so any difference shows up in a single walk
+    size_t placedIndex = 0;
+    for (const auto& helper : lampArrays)
+    {
+        if (helper->GetState() != LampArrayBitmapHelperState::Ready)
+        {
+            continue;
+        }
+
+        if ((placedIndex == m_lampArrays.size()) || (m_lampArrays[placedIndex].helper != helper))
+        {
+            return true;
+        }
+        placedIndex++;
+    }
+
+    return placedIndex != m_lampArrays.size();
+}
+
+void LampArrayCanvas::Build(const LampArraySnapshot& lampArrays)
+{
+    m_lampArrays.clear();
+    m_lampBoxes.Assign({});
+    m_encompassingBoxWidth = 0;
+    m_encompassingBoxHeight = 0;
+    m_lampColors.clear();
+
+    try
+    {
+        BuildLayout(lampArrays);
+    }
+    catch (...)
+    {
+        // Leave the canvas empty rather than half built, the next Build starts over
+        m_lampArrays.clear();
+        throw;
+    }
+
+    m_placementsChanged = false;
+}
+
+void LampArrayCanvas::BuildLayout(const LampArraySnapshot& lampArrays)
+{
+    // Top-left corner of every placed LampArray, explicit placements first so the others
+    // can be lined up to the right of them.
+    std::vector<KDTree::Point> origins;
+    std::vector<bool> isPlaced;
+    int32_t automaticPlacementLeft = 0;
+
+    for (const auto& helper : lampArrays)
+    {
+        if (helper->GetState() != LampArrayBitmapHelperState::Ready)
+        {
+            continue;
+        }
+
+        PlacedLampArray placedLampArray;
+        placedLampArray.helper = helper;
+        m_lampArrays.push_back(std::move(placedLampArray));
+
+        KDTree::Point origin{};
+        bool hasPlacement = false;
+        for (const auto& placement : m_placements)
+        {
+            if (placement.first == helper)
+            {
+                origin.values[0] = static_cast<int32_t>(placement.second.xInMeters * c_metersToMillimetersConversion);
+                origin.values[1] = static_cast<int32_t>(placement.second.yInMeters * c_metersToMillimetersConversion);
+                hasPlacement = true;
+
+                automaticPlacementLeft = std::max(
+                    automaticPlacementLeft,
+                    origin.values[0] + helper->GetBottomRight().values[0] + c_automaticPlacementGap);
+            }
+        }
+
+        origins.push_back(origin);
+        isPlaced.push_back(hasPlacement);
+    }
+
+    for (size_t i = 0; i < m_lampArrays.size(); i++)
+    {
+        if (!isPlaced[i])
+        {
+            origins[i].values[0] = automaticPlacementLeft;
+            origins[i].values[1] = 0;
+            automaticPlacementLeft += m_lampArrays[i].helper->GetBottomRight().values[0] + c_automaticPlacementGap;
+        }
+    }
+
+    // Every selected Lamp of every LampArray, moved to the canvas
+    std::vector<KDTree::Data> looseKdTreeNodes;
+    std::vector<std::pair<uint32_t, uint32_t>> lampOwners; // LampArray, and which of its selected Lamps
+
+    BoundingBox globalBoundingBox = {
+        std::numeric_limits<int32_t>::max(),
+        std::numeric_limits<int32_t>::max(),
+        std::numeric_limits<int32_t>::lowest(),
+        std::numeric_limits<int32_t>::lowest() };
+
+    for (size_t i = 0; i < m_lampArrays.size(); i++)
+    {
+        const LampArrayBitmapHelper& helper = *m_lampArrays[i].helper;
+        const KDTree::Point& origin = origins[i];
+        const KDTree::Point bottomRight = helper.GetBottomRight();
+        const std::vector<KDTree::Point>& lampPositions = helper.GetLampPositions();
+        const std::vector<uint32_t>& selectedLampIndices = helper.GetSelectedLampIndices();
+
+        globalBoundingBox.Left = std::min(globalBoundingBox.Left, origin.values[0]);
+        globalBoundingBox.Top = std::min(globalBoundingBox.Top, origin.values[1]);
+        globalBoundingBox.Right = std::max(globalBoundingBox.Right, origin.values[0] + bottomRight.values[0]);
+        globalBoundingBox.Bottom = std::max(globalBoundingBox.Bottom, origin.values[1] + bottomRight.values[1]);
+
+        for (size_t j = 0; j < selectedLampIndices.size(); j++)
+        {
+            const KDTree::Point& position = lampPositions[selectedLampIndices[j]];
+
+            KDTree::Data data{};
+            data.point.values[0] = origin.values[0] + position.values[0];
+            data.point.values[1] = origin.values[1] + position.values[1];
+            data.indexBoundingBox = looseKdTreeNodes.size();
+            looseKdTreeNodes.push_back(data);
+            lampOwners.emplace_back(static_cast<uint32_t>(i), static_cast<uint32_t>(j));
+        }
+
+        m_lampArrays[i].canvasLamps.resize(selectedLampIndices.size());
+    }
+
+    if (looseKdTreeNodes.empty())
+    {
+        return;
+    }
+
+    std::vector<BoundingBox> lampBoxes;
+    THROW_IF_FAILED(KDTree::GenerateAllBoundingBoxes(
+        looseKdTreeNodes,
+        globalBoundingBox,
+        lampBoxes,
+        KDTreeTuner::GetSearchConfig(looseKdTreeNodes.size())));
+
+    // Zero the boxes to the box encompassing all of them, like LampArrayBitmapHelper does
+    BoundingBox encompassingBox = lampBoxes[0];
+    for (const BoundingBox& box : lampBoxes)
+    {
+        encompassingBox.Left = std::min(encompassingBox.Left, box.Left);
+        encompassingBox.Top = std::min(encompassingBox.Top, box.Top);
+        encompassingBox.Right = std::max(encompassingBox.Right, box.Right);
+        encompassingBox.Bottom = std::max(encompassingBox.Bottom, box.Bottom);
+    }
+
+    m_encompassingBoxWidth = encompassingBox.Right - encompassingBox.Left;
+    m_encompassingBoxHeight = encompassingBox.Bottom - encompassingBox.Top;
+
+    for (BoundingBox& box : lampBoxes)
+    {
+        box.Left -= encompassingBox.Left;
+        box.Top -= encompassingBox.Top;
+        box.Right -= encompassingBox.Left;
+        box.Bottom -= encompassingBox.Top;
+    }
+
+    // Sampled in Morton order across all LampArrays, then gathered back per LampArray
+    const std::vector<uint32_t> order = LampSampling::GetSpatialOrder(lampBoxes, m_encompassingBoxWidth, m_encompassingBoxHeight);
+
+    std::vector<BoundingBox> sortedBoxes(lampBoxes.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        sortedBoxes[i] = lampBoxes[order[i]];
+
+        const auto& owner = lampOwners[order[i]];
+        m_lampArrays[owner.first].canvasLamps[owner.second] = static_cast<uint32_t>(i);
+    }
+
+    m_lampBoxes.Assign(sortedBoxes);
+}
+
+void LampArrayCanvas::SampleBitmap(
+    const BitmapView& bitmap,
+    const BitmapRegion& region,
+    WorkStealingThreadPool* threadPool)
+{
+    // Device color transforms are per LampArray, so they can only be applied once gathered
+    const LampBoxLayout layout{ &m_lampBoxes, nullptr, 0, BoundingBox{ 0, 0, m_encompassingBoxWidth, m_encompassingBoxHeight } };
+    LampSampling::SampleBitmap(bitmap, region, layout, nullptr, nullptr, m_lampColors, threadPool);
+}
+
+bool LampArrayCanvas::GetLampArrayColors(const LampArrayBitmapHelper* helper, std::vector<LampArrayColor>& colors) const
+{
+    for (const auto& placedLampArray : m_lampArrays)
+    {
+        if (placedLampArray.helper.get() != helper)
+        {
+            continue;
+        }
+
+        if (m_lampColors.size() != m_lampBoxes.GetCount())
+        {
+            // Not sampled since the last Build
+            return false;
+        }
+
+        colors.resize(placedLampArray.canvasLamps.size());
+        for (size_t i = 0; i < colors.size(); i++)
+        {
+            colors[i] = m_lampColors[placedLampArray.canvasLamps[i]];
+        }
+
+        helper->ApplyColorTransform(colors);
+        return true;
+    }
+
+    return false;
+}
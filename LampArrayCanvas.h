@@ -0,0 +1,75 @@
+#pragma once
+
+#include "LampArrayBitmapHelper.h"
+
+// Where a LampArray sits on the canvas: the top-left corner of its bounding box,
+// on its bitmap plane, relative to the canvas origin.
+struct LampArrayCanvasPlacement
+{
+    float xInMeters;
+    float yInMeters;
+};
+
+// Lays several LampArrays out in one shared space and samples a frame for all of them at once,
+// so a single bitmap can span e.g. a keyboard, a mouse and a couple of light bars instead of
+// being stretched over each of them separately.
+//
+// Every Lamp of every placed LampArray goes into one combined k-d tree, so Lamps of neighboring
+// LampArrays share the space between them like Lamps of the same LampArray do. The whole canvas
+// is then sampled in a single pass, and the colors are gathered per LampArray afterwards.
+//
+// Build, SampleBitmap and GetLampArrayColors must be called from the same thread. The placements
+// are only read by NeedsBuild and Build, so they can be changed from another thread as long as the
+// caller serializes those four calls, sampling then needs no lock.
+struct LampArrayCanvas
+{
+public:
+    // LampArrays without a placement are lined up to the right of the placed ones, top aligned.
+    // Placements are kept per helper, so stand-in helpers without a LampArray can be placed too.
+    void SetPlacement(std::shared_ptr<const LampArrayBitmapHelper> helper, const LampArrayCanvasPlacement& placement);
+    void RemovePlacement(_In_ const LampArrayBitmapHelper* helper);
+
+    // Forgets the placements of LampArrays that are no longer in lampArrays.
+    void RemoveDisconnectedPlacements(const LampArraySnapshot& lampArrays);
+
+    // True when Build has to run again for lampArrays, because a placement changed
+    // or a LampArray connected, disconnected or became Ready.
+    bool NeedsBuild(const LampArraySnapshot& lampArrays) const;
+
+    // Lays out every Ready LampArray of lampArrays. The others are left out until the next Build.
+    void Build(const LampArraySnapshot& lampArrays);
+
+    // The encompassing box of every Lamp on the canvas is stretched over region.
+    void SampleBitmap(
+        const BitmapView& bitmap,
+        const BitmapRegion& region,
+        _In_opt_ WorkStealingThreadPool* threadPool = nullptr);
+
+    // Colors of helper's Lamps from the last SampleBitmap, ordered like GetSelectedLampIndices()
+    // and corrected with helper's color transform. Returns false if helper isn't on the canvas.
+    bool GetLampArrayColors(const LampArrayBitmapHelper* helper, std::vector<LampArrayColor>& colors) const;
+
+private:
+    struct PlacedLampArray
+    {
+        std::shared_ptr<LampArrayBitmapHelper> helper;
+
+        // canvasLamps[i] is where the i-th selected Lamp of helper is on the canvas
+        std::vector<uint32_t> canvasLamps;
+    };
+
+    void BuildLayout(const LampArraySnapshot& lampArrays);
+
+    // Holds on to the helpers, so their addresses can't be reused until the placement is removed
+    std::vector<std::pair<std::shared_ptr<const LampArrayBitmapHelper>, LampArrayCanvasPlacement>> m_placements;
+    bool m_placementsChanged{};
+
+    std::vector<PlacedLampArray> m_lampArrays;
+
+    // Every Lamp of the canvas in Morton order, relative to the canvas' encompassing box.
+    CompactBoundingBoxes m_lampBoxes;
+    int32_t m_encompassingBoxWidth{};
+    int32_t m_encompassingBoxHeight{};
+
+    std::vector<LampArrayColor> m_lampColors;
+};
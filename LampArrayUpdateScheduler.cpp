@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "LampArrayUpdateScheduler.h"
+
+LampArrayUpdateScheduler::LampArrayUpdateScheduler(uint32_t threadCount)
+{
+    m_threads.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        m_threads.emplace_back([this]() { WorkerThread(); });
+    }
+}
+
+LampArrayUpdateScheduler::~LampArrayUpdateScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stopRequested = true;
+    }
+    m_devicesChanged.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+uint64_t LampArrayUpdateScheduler::AddDevice(std::chrono::microseconds updateInterval, std::function<void()> update)
+{
+    const auto now = Clock::now();
+
+    auto device = std::make_unique<Device>();
+    device->updateInterval = std::max(updateInterval, std::chrono::microseconds(1));
+    device->update = std::move(update);
+    device->releaseTime = now;
+    device->deadline = now + device->updateInterval;
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        id = m_nextId++;
+        device->id = id;
+        m_devices.push_back(std::move(device));
+    }
+    m_devicesChanged.notify_one();
+
+    return id;
+}
+
+void LampArrayUpdateScheduler::RemoveDevice(uint64_t id)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    auto iter = std::find_if(m_devices.begin(), m_devices.end(),
+        [&](const std::unique_ptr<Device>& device) { return device->id == id; });
+    if (iter == m_devices.end())
+    {
+        return;
+    }
+
+    Device* device = iter->get();
+    device->isRemoved = true;
+    m_devicesChanged.wait(lock, [&]() { return !device->isRunning; });
+
+    m_devices.erase(std::find_if(m_devices.begin(), m_devices.end(),
+        [&](const std::unique_ptr<Device>& entry) { return entry.get() == device; }));
+}
+
+std::vector<LampArrayUpdateSchedulerDeviceStatistics> LampArrayUpdateScheduler::GetStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    std::vector<LampArrayUpdateSchedulerDeviceStatistics> statistics;
+    statistics.reserve(m_devices.size());
+    for (const auto& device : m_devices)
+    {
+        statistics.push_back({
+            device->id,
+            device->updateInterval,
+            device->updateCount,
+            device->deadlineMissCount,
+            std::chrono::duration_cast<std::chrono::microseconds>(device->maxLateness) });
+    }
+
+    return statistics;
+}
+
+void LampArrayUpdateScheduler::WorkerThread()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_stopRequested)
+    {
+        const auto now = Clock::now();
+
+        // Earliest deadline among the released updates, and the earliest release still to come
+        Device* next = nullptr;
+        Clock::time_point nextRelease = Clock::time_point::max();
+        for (const auto& device : m_devices)
+        {
+            if (device->isRunning || device->isRemoved)
+            {
+                continue;
+            }
+
+            if (device->releaseTime <= now)
+            {
+                if (next == nullptr || device->deadline < next->deadline)
+                {
+                    next = device.get();
+                }
+            }
+            else
+            {
+                nextRelease = std::min(nextRelease, device->releaseTime);
+            }
+        }
+
+        if (next == nullptr)
+        {
+            if (nextRelease == Clock::time_point::max())
+            {
+                m_devicesChanged.wait(lock);
+            }
+            else
+            {
+                m_devicesChanged.wait_until(lock, nextRelease);
+            }
+            continue;
+        }
+
+        next->isRunning = true;
+        lock.unlock();
+
+        next->update();
+        const auto finished = Clock::now();
+
+        lock.lock();
+        next->isRunning = false;
+        next->updateCount++;
+
+        if (finished > next->deadline)
+        {
+            next->deadlineMissCount++;
+            next->maxLateness = std::max(next->maxLateness, finished - next->deadline);
+        }
+
+        // Periodic release. After falling behind, restart the period from now rather than
+        // releasing a burst of catch-up updates the device can't take anyway.
+        next->releaseTime = std::max(next->releaseTime + next->updateInterval, finished);
+        next->deadline = next->releaseTime + next->updateInterval;
+
+        // Wakes RemoveDevice, and other workers waiting on a release this one may have moved
+        m_devicesChanged.notify_all();
+    }
+}
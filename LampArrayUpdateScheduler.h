@@ -0,0 +1,63 @@
+#pragma once
+
+struct LampArrayUpdateSchedulerDeviceStatistics
+{
+    uint64_t id;
+    std::chrono::microseconds updateInterval;
+    uint64_t updateCount;
+    uint64_t deadlineMissCount; // Updates that finished after their deadline
+    std::chrono::microseconds maxLateness; // The most any update finished past its deadline, 0 if none missed
+};
+
+// Runs a periodic update for every device, each at its own rate, on a small fixed pool of threads.
+// Every update is released one interval after the previous one and is due one interval after that;
+// whenever a thread is free it runs the released update with the earliest deadline (EDF).
+// A 30Hz device is then only serviced at 30Hz, and can't starve a 250Hz one.
+struct LampArrayUpdateScheduler
+{
+public:
+    explicit LampArrayUpdateScheduler(uint32_t threadCount);
+    ~LampArrayUpdateScheduler();
+
+    LampArrayUpdateScheduler(const LampArrayUpdateScheduler&) = delete;
+    LampArrayUpdateScheduler& operator=(const LampArrayUpdateScheduler&) = delete;
+
+    // update must not throw. The first update is released right away.
+    uint64_t AddDevice(std::chrono::microseconds updateInterval, std::function<void()> update);
+
+    // Waits for a running update of this device to complete, so must not be called from an update.
+    void RemoveDevice(uint64_t id);
+
+    std::vector<LampArrayUpdateSchedulerDeviceStatistics> GetStatistics();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Device
+    {
+        uint64_t id;
+        std::chrono::microseconds updateInterval;
+        std::function<void()> update;
+
+        Clock::time_point releaseTime;
+        Clock::time_point deadline;
+        bool isRunning;
+        bool isRemoved;
+
+        uint64_t updateCount;
+        uint64_t deadlineMissCount;
+        Clock::duration maxLateness;
+    };
+
+    void WorkerThread();
+
+    std::mutex m_lock;
+    std::condition_variable m_devicesChanged;
+
+    // Scanned linearly, there are only ever a handful of LampArrays connected
+    std::vector<std::unique_ptr<Device>> m_devices;
+    uint64_t m_nextId = 1;
+    bool m_stopRequested{};
+
+    std::vector<std::thread> m_threads;
+};
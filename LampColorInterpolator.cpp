@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "LampColorInterpolator.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define LAMPCOLORINTERPOLATOR_SSE2
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define LAMPCOLORINTERPOLATOR_NEON
+#endif
+
+// Weights are fixed point with 8 fractional bits, 256 is all of the keyframe.
+const uint32_t c_fullWeight = 256;
+
+// destination = (from * (256 - weight) + to * weight) / 256, rounded, per channel.
+// Every product fits in 16 bits, so 16 channels (4 Lamps) are blended at a time.
+static void BlendColors(
+    const LampArrayColor* from,
+    const LampArrayColor* to,
+    uint32_t weight,
+    size_t count,
+    LampArrayColor* destination) noexcept
+{
+    static_assert(sizeof(LampArrayColor) == 4, "Colors are blended as bytes");
+
+    const uint8_t* fromBytes = reinterpret_cast<const uint8_t*>(from);
+    const uint8_t* toBytes = reinterpret_cast<const uint8_t*>(to);
+    uint8_t* destinationBytes = reinterpret_cast<uint8_t*>(destination);
+    const size_t byteCount = count * sizeof(LampArrayColor);
+
+    size_t i = 0;
+
+#if defined(LAMPCOLORINTERPOLATOR_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i toWeight = _mm_set1_epi16(static_cast<short>(weight));
+    const __m128i fromWeight = _mm_set1_epi16(static_cast<short>(c_fullWeight - weight));
+    const __m128i half = _mm_set1_epi16(128);
+
+    for (; i + 16 <= byteCount; i += 16)
+    {
+        const __m128i fromValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fromBytes + i));
+        const __m128i toValues = _mm_loadu_si128(reinterpret_cast<const __m128i*>(toBytes + i));
+
+        auto blend = [&](__m128i fromHalf, __m128i toHalf)
+        {
+            const __m128i sum = _mm_add_epi16(_mm_mullo_epi16(fromHalf, fromWeight), _mm_mullo_epi16(toHalf, toWeight));
+            return _mm_srli_epi16(_mm_add_epi16(sum, half), 8);
+        };
+
+        const __m128i low = blend(_mm_unpacklo_epi8(fromValues, zero), _mm_unpacklo_epi8(toValues, zero));
+        const __m128i high = blend(_mm_unpackhi_epi8(fromValues, zero), _mm_unpackhi_epi8(toValues, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destinationBytes + i), _mm_packus_epi16(low, high));
+    }
+#elif defined(LAMPCOLORINTERPOLATOR_NEON)
+    const uint16x8_t toWeight = vdupq_n_u16(static_cast<uint16_t>(weight));
+    const uint16x8_t fromWeight = vdupq_n_u16(static_cast<uint16_t>(c_fullWeight - weight));
+
+    for (; i + 16 <= byteCount; i += 16)
+    {
+        const uint8x16_t fromValues = vld1q_u8(fromBytes + i);
+        const uint8x16_t toValues = vld1q_u8(toBytes + i);
+
+        auto blend = [&](uint8x8_t fromHalf, uint8x8_t toHalf)
+        {
+            const uint16x8_t sum = vmlaq_u16(vmulq_u16(vmovl_u8(fromHalf), fromWeight), vmovl_u8(toHalf), toWeight);
+            return vrshrn_n_u16(sum, 8);
+        };
+
+        const uint8x8_t low = blend(vget_low_u8(fromValues), vget_low_u8(toValues));
+        const uint8x8_t high = blend(vget_high_u8(fromValues), vget_high_u8(toValues));
+        vst1q_u8(destinationBytes + i, vcombine_u8(low, high));
+    }
+#endif
+
+    for (; i < byteCount; i++)
+    {
+        const uint32_t sum = fromBytes[i] * (c_fullWeight - weight) + toBytes[i] * weight;
+        destinationBytes[i] = static_cast<uint8_t>((sum + 128) >> 8);
+    }
+}
+
+uint32_t LampColorInterpolator::GetWeight(Clock::time_point time) const noexcept
+{
+    float progress = 1.0f;
+    if ((m_duration > Clock::duration::zero()) && (time < m_startTime + m_duration))
+    {
+        progress = std::max(std::chrono::duration<float>(time - m_startTime) / std::chrono::duration<float>(m_duration), 0.0f);
+    }
+
+    if (m_easing == LampColorEasing::SmoothStep)
+    {
+        progress = progress * progress * (3.0f - 2.0f * progress);
+    }
+
+    return std::min(static_cast<uint32_t>(progress * c_fullWeight + 0.5f), c_fullWeight);
+}
+
+void LampColorInterpolator::AddKeyframe(const std::vector<LampArrayColor>& colors, Clock::time_point time, bool isUrgent)
+{
+    // A different Lamp count means a different device layout, there is nothing to move from
+    const bool isFirst = !m_hasKeyframe || (colors.size() != m_to.size());
+
+    if (isFirst)
+    {
+        m_from = colors;
+        m_keyframeInterval = Clock::duration::zero();
+    }
+    else
+    {
+        // Start from wherever the previous transition is at right now, blending in place is safe
+        BlendColors(m_from.data(), m_to.data(), GetWeight(time), m_to.size(), m_from.data());
+
+        const Clock::duration interval = time - m_lastKeyframeTime;
+        m_keyframeInterval = (m_keyframeInterval == Clock::duration::zero()) ?
+            interval :
+            (m_keyframeInterval * 3 + interval) / 4;
+    }
+
+    m_to = colors;
+    m_startTime = time;
+    m_lastKeyframeTime = time;
+
+    const bool showAtOnce = isFirst || isUrgent || (m_easing == LampColorEasing::None);
+    m_duration = showAtOnce ?
+        Clock::duration::zero() :
+        std::min<Clock::duration>(m_keyframeInterval, m_maxLatency);
+
+    m_hasKeyframe = true;
+    m_isFinished = false;
+}
+
+bool LampColorInterpolator::GetColors(Clock::time_point time, std::vector<LampArrayColor>& colors)
+{
+    if (!m_hasKeyframe || m_isFinished)
+    {
+        return false;
+    }
+
+    const uint32_t weight = GetWeight(time);
+
+    colors.resize(m_to.size());
+    BlendColors(m_from.data(), m_to.data(), weight, m_to.size(), colors.data());
+
+    m_isFinished = (weight == c_fullWeight);
+    return true;
+}
+
+void LampColorInterpolator::Reset()
+{
+    m_from.clear();
+    m_to.clear();
+    m_hasKeyframe = false;
+    m_isFinished = true;
+    m_keyframeInterval = Clock::duration::zero();
+}
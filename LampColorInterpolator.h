@@ -0,0 +1,55 @@
+#pragma once
+
+enum class LampColorEasing : uint32_t
+{
+    None, // Keyframes are shown as they arrive
+    Linear,
+    SmoothStep, // Eases in and out of every keyframe
+};
+
+// Fills in the frames between keyframes: each Lamp moves from the color it shows towards the
+// newest keyframe over one keyframe interval, so content rendered and sampled at e.g. 20Hz can
+// be sent at the device's full update rate without visible steps.
+//
+// The interval is measured from the keyframes themselves and capped by the maximum latency, so a
+// keyframe is never shown later than that. An urgent keyframe (e.g. a key press) is shown at once.
+struct LampColorInterpolator
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void SetEasing(LampColorEasing easing) { m_easing = easing; }
+    void SetMaxLatency(std::chrono::microseconds maxLatency) { m_maxLatency = maxLatency; }
+
+    // Starts moving from the colors shown at time towards colors.
+    void AddKeyframe(const std::vector<LampArrayColor>& colors, Clock::time_point time, bool isUrgent);
+
+    // Colors to show at time. Returns false, leaving colors untouched, once the latest keyframe
+    // has been reached and returned.
+    bool GetColors(Clock::time_point time, std::vector<LampArrayColor>& colors);
+
+    // True once the latest keyframe has been returned by GetColors, or when there is none.
+    bool IsFinished() const noexcept { return m_isFinished; }
+
+    // Forgets every keyframe, e.g. when the device stops showing per Lamp colors.
+    void Reset();
+
+private:
+    // How far from m_from to m_to the transition is at time, 0 to 256
+    uint32_t GetWeight(Clock::time_point time) const noexcept;
+
+    LampColorEasing m_easing = LampColorEasing::Linear;
+    std::chrono::microseconds m_maxLatency{ 100000 };
+
+    // Moving from m_from at m_startTime to m_to over m_duration
+    std::vector<LampArrayColor> m_from;
+    std::vector<LampArrayColor> m_to;
+    Clock::time_point m_startTime;
+    Clock::duration m_duration{};
+    bool m_hasKeyframe{};
+    bool m_isFinished = true;
+
+    // Smoothed time between keyframes
+    Clock::time_point m_lastKeyframeTime;
+    Clock::duration m_keyframeInterval{};
+};
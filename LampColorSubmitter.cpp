@@ -0,0 +1,144 @@
+#include "pch.h"
+#include "LampColorSubmitter.h"
+#include "PerformanceMetrics.h"
+#include "TraceRecorder.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define LAMPCOLORSUBMITTER_SSE2
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define LAMPCOLORSUBMITTER_NEON
+#endif
+
+static bool HasColorChanged(
+    const LampArrayColor& previous,
+    const LampArrayColor& current,
+    uint8_t threshold) noexcept
+{
+    return (std::abs(previous.r - current.r) > threshold) ||
+        (std::abs(previous.g - current.g) > threshold) ||
+        (std::abs(previous.b - current.b) > threshold) ||
+        (std::abs(previous.a - current.a) > threshold);
+}
+
+// Returns a bit per Lamp, set when that Lamp of the block changed by more than threshold.
+// Blocks are 4 Lamps, or 16 bytes of colors.
+static uint32_t FindChangedLampsInBlock(
+    const LampArrayColor* previous,
+    const LampArrayColor* current,
+    uint8_t threshold) noexcept
+{
+#if defined(LAMPCOLORSUBMITTER_SSE2)
+    const __m128i previousColors = _mm_loadu_si128(reinterpret_cast<const __m128i*>(previous));
+    const __m128i currentColors = _mm_loadu_si128(reinterpret_cast<const __m128i*>(current));
+
+    // |a - b| per channel with unsigned saturation, then whatever is left above the threshold
+    const __m128i difference = _mm_or_si128(
+        _mm_subs_epu8(previousColors, currentColors),
+        _mm_subs_epu8(currentColors, previousColors));
+    const __m128i overThreshold = _mm_subs_epu8(difference, _mm_set1_epi8(static_cast<char>(threshold)));
+
+    // A Lamp is unchanged when all 4 of its channels are zero
+    const __m128i unchangedLamps = _mm_cmpeq_epi32(overThreshold, _mm_setzero_si128());
+    return static_cast<uint32_t>(~_mm_movemask_ps(_mm_castsi128_ps(unchangedLamps))) & 0xF;
+#elif defined(LAMPCOLORSUBMITTER_NEON)
+    const uint8x16_t previousColors = vld1q_u8(reinterpret_cast<const uint8_t*>(previous));
+    const uint8x16_t currentColors = vld1q_u8(reinterpret_cast<const uint8_t*>(current));
+
+    const uint8x16_t overThreshold = vcgtq_u8(vabdq_u8(previousColors, currentColors), vdupq_n_u8(threshold));
+    const uint32x4_t changedLamps = vtstq_u32(vreinterpretq_u32_u8(overThreshold), vreinterpretq_u32_u8(overThreshold));
+    return (vgetq_lane_u32(changedLamps, 0) & 1) |
+        (vgetq_lane_u32(changedLamps, 1) & 2) |
+        (vgetq_lane_u32(changedLamps, 2) & 4) |
+        (vgetq_lane_u32(changedLamps, 3) & 8);
+#else
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        if (HasColorChanged(previous[i], current[i], threshold))
+        {
+            changed |= 1u << i;
+        }
+    }
+    return changed;
+#endif
+}
+
+size_t LampColorSubmitter::Submit(const std::vector<uint32_t>& lampIndices, const std::vector<LampArrayColor>& colors)
+{
+    const size_t lampCount = std::min(lampIndices.size(), colors.size());
+    if (lampCount == 0)
+    {
+        return 0;
+    }
+
+    METRICS_TIME_SCOPE(Submission);
+
+    if (m_lastSentColors.size() != lampCount)
+    {
+        // Nothing known about what the device shows, send everything
+        METRICS_ADD(LampsSubmitted, lampCount);
+        TRACE_SCOPE("SetColorsForIndices");
+        if (m_lampArray)
+        {
+            m_lampArray->SetColorsForIndices(static_cast<uint32_t>(lampCount), lampIndices.data(), colors.data());
+        }
+        m_lastSentColors.assign(colors.begin(), colors.begin() + lampCount);
+        m_changedLampIndices.reserve(lampCount);
+        m_changedLampColors.reserve(lampCount);
+        return lampCount;
+    }
+
+    m_changedLampIndices.clear();
+    m_changedLampColors.clear();
+
+    // Only the changed Lamps update m_lastSentColors, so slow drifts below the threshold
+    // still get sent once they add up.
+    auto markChanged = [&](size_t i)
+    {
+        m_changedLampIndices.push_back(lampIndices[i]);
+        m_changedLampColors.push_back(colors[i]);
+        m_lastSentColors[i] = colors[i];
+    };
+
+    size_t i = 0;
+    for (; i + 4 <= lampCount; i += 4)
+    {
+        uint32_t changed = FindChangedLampsInBlock(&m_lastSentColors[i], &colors[i], m_changeThreshold);
+        while (changed != 0)
+        {
+            uint32_t lamp = 0;
+            while ((changed & (1u << lamp)) == 0)
+            {
+                lamp++;
+            }
+
+            markChanged(i + lamp);
+            changed &= changed - 1;
+        }
+    }
+
+    for (; i < lampCount; i++)
+    {
+        if (HasColorChanged(m_lastSentColors[i], colors[i], m_changeThreshold))
+        {
+            markChanged(i);
+        }
+    }
+
+    if (!m_changedLampIndices.empty())
+    {
+        METRICS_ADD(LampsSubmitted, m_changedLampIndices.size());
+        TRACE_SCOPE("SetColorsForIndices");
+        if (m_lampArray)
+        {
+            m_lampArray->SetColorsForIndices(
+                static_cast<uint32_t>(m_changedLampIndices.size()),
+                m_changedLampIndices.data(),
+                m_changedLampColors.data());
+        }
+    }
+
+    return m_changedLampIndices.size();
+}
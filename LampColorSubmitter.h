@@ -0,0 +1,33 @@
+#pragma once
+
+// Remembers the colors last sent to a LampArray and only sends the Lamps that changed since,
+// all in a single SetColorsForIndices call.
+struct LampColorSubmitter
+{
+public:
+    LampColorSubmitter(_In_opt_ ILampArray* lampArray) : m_lampArray(lampArray) {}
+
+    // A Lamp is only resent once one of its channels moved by more than threshold.
+    // 0 (the default) resends on any change.
+    void SetChangeThreshold(uint8_t threshold) { m_changeThreshold = threshold; }
+
+    // colors[i] is the color of Lamp lampIndices[i]. The same lampIndices must be passed
+    // on every call, use Invalidate() whenever they change. Returns how many Lamps were sent.
+    // Without a LampArray (a replay stand-in) nothing is sent, but changes are tracked the same way.
+    size_t Submit(const std::vector<uint32_t>& lampIndices, const std::vector<LampArrayColor>& colors);
+
+    // Forgets what the device shows, e.g. after SetColor, so the next Submit sends every Lamp.
+    void Invalidate() { m_lastSentColors.clear(); }
+
+private:
+    wil::com_ptr_nothrow<ILampArray> m_lampArray;
+
+    uint8_t m_changeThreshold{};
+
+    // What the device currently shows, in the same order as the submitted colors.
+    std::vector<LampArrayColor> m_lastSentColors;
+
+    // Scratch buffers for the Lamps that changed, kept around so Submit doesn't allocate.
+    std::vector<uint32_t> m_changedLampIndices;
+    std::vector<LampArrayColor> m_changedLampColors;
+};
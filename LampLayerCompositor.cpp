@@ -0,0 +1,300 @@
+#include "pch.h"
+#include "LampLayerCompositor.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define LAMPLAYERCOMPOSITOR_SSE2
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define LAMPLAYERCOMPOSITOR_NEON
+#endif
+
+// 8 Lamps of one plane widened to 16 bits, so products of two 8-bit values fit.
+#if defined(LAMPLAYERCOMPOSITOR_SSE2)
+using Word8 = __m128i;
+
+static Word8 Load(const uint8_t* values) noexcept
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(values)), _mm_setzero_si128());
+}
+static void Store(uint8_t* values, Word8 value) noexcept
+{
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(values), _mm_packus_epi16(value, value));
+}
+static Word8 Set(uint16_t value) noexcept { return _mm_set1_epi16(static_cast<short>(value)); }
+static Word8 Add(Word8 a, Word8 b) noexcept { return _mm_add_epi16(a, b); }
+static Word8 Subtract(Word8 a, Word8 b) noexcept { return _mm_sub_epi16(a, b); }
+static Word8 Multiply(Word8 a, Word8 b) noexcept { return _mm_mullo_epi16(a, b); }
+static Word8 ShiftRight8(Word8 a) noexcept { return _mm_srli_epi16(a, 8); }
+// Operands never exceed 510, so the signed comparisons are fine
+static Word8 Min(Word8 a, Word8 b) noexcept { return _mm_min_epi16(a, b); }
+static Word8 Max(Word8 a, Word8 b) noexcept { return _mm_max_epi16(a, b); }
+#elif defined(LAMPLAYERCOMPOSITOR_NEON)
+using Word8 = uint16x8_t;
+
+static Word8 Load(const uint8_t* values) noexcept { return vmovl_u8(vld1_u8(values)); }
+static void Store(uint8_t* values, Word8 value) noexcept { vst1_u8(values, vmovn_u16(value)); }
+static Word8 Set(uint16_t value) noexcept { return vdupq_n_u16(value); }
+static Word8 Add(Word8 a, Word8 b) noexcept { return vaddq_u16(a, b); }
+static Word8 Subtract(Word8 a, Word8 b) noexcept { return vsubq_u16(a, b); }
+static Word8 Multiply(Word8 a, Word8 b) noexcept { return vmulq_u16(a, b); }
+static Word8 ShiftRight8(Word8 a) noexcept { return vshrq_n_u16(a, 8); }
+static Word8 Min(Word8 a, Word8 b) noexcept { return vminq_u16(a, b); }
+static Word8 Max(Word8 a, Word8 b) noexcept { return vmaxq_u16(a, b); }
+#else
+struct Word8
+{
+    uint16_t values[8];
+};
+
+template <typename Operation>
+static Word8 Apply(Word8 a, Word8 b, Operation operation) noexcept
+{
+    Word8 result;
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        result.values[i] = static_cast<uint16_t>(operation(a.values[i], b.values[i]));
+    }
+    return result;
+}
+
+static Word8 Load(const uint8_t* values) noexcept
+{
+    Word8 result;
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        result.values[i] = values[i];
+    }
+    return result;
+}
+static void Store(uint8_t* values, Word8 value) noexcept
+{
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        values[i] = static_cast<uint8_t>(value.values[i]);
+    }
+}
+static Word8 Set(uint16_t value) noexcept { return Word8{ { value, value, value, value, value, value, value, value } }; }
+static Word8 Add(Word8 a, Word8 b) noexcept { return Apply(a, b, [](uint32_t x, uint32_t y) { return x + y; }); }
+static Word8 Subtract(Word8 a, Word8 b) noexcept { return Apply(a, b, [](uint32_t x, uint32_t y) { return x - y; }); }
+static Word8 Multiply(Word8 a, Word8 b) noexcept { return Apply(a, b, [](uint32_t x, uint32_t y) { return x * y; }); }
+static Word8 ShiftRight8(Word8 a) noexcept { return Apply(a, a, [](uint32_t x, uint32_t) { return x >> 8; }); }
+static Word8 Min(Word8 a, Word8 b) noexcept { return Apply(a, b, [](uint32_t x, uint32_t y) { return std::min(x, y); }); }
+static Word8 Max(Word8 a, Word8 b) noexcept { return Apply(a, b, [](uint32_t x, uint32_t y) { return std::max(x, y); }); }
+#endif
+
+// Exact round(x / 255) for x up to 255 * 255, without a division.
+static Word8 Divide255(Word8 x) noexcept
+{
+    const Word8 rounded = Add(x, Set(128));
+    return ShiftRight8(Add(rounded, ShiftRight8(rounded)));
+}
+
+static void ResizePlanes(std::vector<uint8_t>& red, std::vector<uint8_t>& green, std::vector<uint8_t>& blue, size_t size, uint8_t value)
+{
+    red.assign(size, value);
+    green.assign(size, value);
+    blue.assign(size, value);
+}
+
+void LampLayerCompositor::SetLampCount(size_t lampCount)
+{
+    m_lampCount = lampCount;
+    m_paddedLampCount = (lampCount + 7) & ~static_cast<size_t>(7);
+    m_layers.clear();
+    ResizePlanes(m_black.red, m_black.green, m_black.blue, m_paddedLampCount, 0);
+
+    m_firstChangedLayer = 0;
+    m_hasComposited = false;
+}
+
+size_t LampLayerCompositor::AddLayer(LampBlendMode blendMode)
+{
+    Layer layer{};
+    layer.blendMode = blendMode;
+    layer.opacity = 0xFF;
+    ResizePlanes(layer.colors.red, layer.colors.green, layer.colors.blue, m_paddedLampCount, 0);
+    ResizePlanes(layer.result.red, layer.result.green, layer.result.blue, m_paddedLampCount, 0);
+    layer.alpha.assign(m_paddedLampCount, 0);
+    layer.mask.assign(m_paddedLampCount, 0xFF);
+    layer.isTransparent = true;
+
+    m_layers.push_back(std::move(layer));
+    MarkChanged(m_layers.size() - 1);
+    return m_layers.size() - 1;
+}
+
+void LampLayerCompositor::RemoveLayer(size_t index)
+{
+    THROW_HR_IF(E_BOUNDS, index >= m_layers.size());
+
+    m_layers.erase(m_layers.begin() + index);
+    MarkChanged(index);
+}
+
+void LampLayerCompositor::SetLayerColors(size_t index, const std::vector<LampArrayColor>& colors)
+{
+    THROW_HR_IF(E_BOUNDS, index >= m_layers.size());
+    THROW_HR_IF(E_INVALIDARG, colors.size() != m_lampCount);
+
+    Layer& layer = m_layers[index];
+
+    // Split into planes while checking whether anything actually changed
+    bool changed = false;
+    for (size_t i = 0; i < m_lampCount; i++)
+    {
+        const LampArrayColor& color = colors[i];
+        changed |= (layer.colors.red[i] != color.r) ||
+            (layer.colors.green[i] != color.g) ||
+            (layer.colors.blue[i] != color.b) ||
+            (layer.alpha[i] != color.a);
+
+        layer.colors.red[i] = color.r;
+        layer.colors.green[i] = color.g;
+        layer.colors.blue[i] = color.b;
+        layer.alpha[i] = color.a;
+    }
+
+    if (changed)
+    {
+        UpdateIsTransparent(layer);
+        MarkChanged(index);
+    }
+}
+
+void LampLayerCompositor::SetLayerBlendMode(size_t index, LampBlendMode blendMode)
+{
+    THROW_HR_IF(E_BOUNDS, index >= m_layers.size());
+
+    if (m_layers[index].blendMode != blendMode)
+    {
+        m_layers[index].blendMode = blendMode;
+        MarkChanged(index);
+    }
+}
+
+void LampLayerCompositor::SetLayerOpacity(size_t index, uint8_t opacity)
+{
+    THROW_HR_IF(E_BOUNDS, index >= m_layers.size());
+
+    if (m_layers[index].opacity != opacity)
+    {
+        m_layers[index].opacity = opacity;
+        MarkChanged(index);
+    }
+}
+
+void LampLayerCompositor::SetLayerMask(size_t index, const std::vector<uint8_t>& mask)
+{
+    THROW_HR_IF(E_BOUNDS, index >= m_layers.size());
+    THROW_HR_IF(E_INVALIDARG, !mask.empty() && (mask.size() != m_lampCount));
+
+    Layer& layer = m_layers[index];
+    if (mask.empty())
+    {
+        std::fill(layer.mask.begin(), layer.mask.end(), static_cast<uint8_t>(0xFF));
+    }
+    else
+    {
+        std::copy(mask.begin(), mask.end(), layer.mask.begin());
+    }
+
+    UpdateIsTransparent(layer);
+    MarkChanged(index);
+}
+
+void LampLayerCompositor::UpdateIsTransparent(Layer& layer) noexcept
+{
+    layer.isTransparent = true;
+    for (size_t i = 0; i < m_lampCount; i++)
+    {
+        if ((layer.alpha[i] != 0) && (layer.mask[i] != 0))
+        {
+            layer.isTransparent = false;
+            break;
+        }
+    }
+}
+
+void LampLayerCompositor::BlendLayer(const ColorPlanes& below, Layer& layer) const noexcept
+{
+    const Word8 opacity = Set(layer.opacity);
+    const Word8 full = Set(255);
+
+    const uint8_t* belowPlanes[3] = { below.red.data(), below.green.data(), below.blue.data() };
+    const uint8_t* layerPlanes[3] = { layer.colors.red.data(), layer.colors.green.data(), layer.colors.blue.data() };
+    uint8_t* resultPlanes[3] = { layer.result.red.data(), layer.result.green.data(), layer.result.blue.data() };
+
+    for (size_t i = 0; i < m_paddedLampCount; i += 8)
+    {
+        // How much of the blended color shows, 0 to 255
+        const Word8 weight = Divide255(Multiply(Divide255(Multiply(Load(&layer.alpha[i]), opacity)), Load(&layer.mask[i])));
+        const Word8 inverseWeight = Subtract(full, weight);
+
+        for (uint32_t plane = 0; plane < 3; plane++)
+        {
+            const Word8 destination = Load(belowPlanes[plane] + i);
+            const Word8 source = Load(layerPlanes[plane] + i);
+
+            Word8 blended;
+            switch (layer.blendMode)
+            {
+            case LampBlendMode::Additive:
+                blended = Min(Add(destination, source), full);
+                break;
+            case LampBlendMode::Multiply:
+                blended = Divide255(Multiply(destination, source));
+                break;
+            case LampBlendMode::Max:
+                blended = Max(destination, source);
+                break;
+            case LampBlendMode::Alpha:
+            default:
+                blended = source;
+                break;
+            }
+
+            // destination * (1 - weight) + blended * weight, never above 255 * 255
+            Store(resultPlanes[plane] + i, Divide255(Add(Multiply(destination, inverseWeight), Multiply(blended, weight))));
+        }
+    }
+}
+
+bool LampLayerCompositor::Composite(std::vector<LampArrayColor>& colors)
+{
+    if (m_hasComposited && (m_firstChangedLayer == SIZE_MAX))
+    {
+        return false;
+    }
+
+    const size_t firstLayer = m_hasComposited ? std::min(m_firstChangedLayer, m_layers.size()) : 0;
+    for (size_t i = firstLayer; i < m_layers.size(); i++)
+    {
+        const ColorPlanes& below = (i == 0) ? m_black : m_layers[i - 1].result;
+        Layer& layer = m_layers[i];
+
+        if ((layer.opacity == 0) || layer.isTransparent)
+        {
+            // Nothing of this layer shows, pass what is below through
+            layer.result.red = below.red;
+            layer.result.green = below.green;
+            layer.result.blue = below.blue;
+        }
+        else
+        {
+            BlendLayer(below, layer);
+        }
+    }
+
+    const ColorPlanes& result = m_layers.empty() ? m_black : m_layers.back().result;
+
+    colors.resize(m_lampCount);
+    for (size_t i = 0; i < m_lampCount; i++)
+    {
+        colors[i] = LampArrayColor{ result.red[i], result.green[i], result.blue[i], 0xFF };
+    }
+
+    m_firstChangedLayer = SIZE_MAX;
+    m_hasComposited = true;
+    return true;
+}
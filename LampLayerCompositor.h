@@ -0,0 +1,80 @@
+#pragma once
+
+// How a layer combines with the layers below it. Whatever the mode, the result is then faded in
+// by the layer's weight: the Lamp's alpha times the layer's opacity times the layer's mask.
+enum class LampBlendMode : uint32_t
+{
+    Alpha, // The layer's color
+    Additive, // Sum of both, saturated
+    Multiply, // Product of both, darkens
+    Max, // Brightest of both, per channel
+};
+
+// Stacks several per Lamp effects (e.g. a base gradient, a key press layer and a notification
+// overlay) into the colors of one LampArray.
+//
+// Layers are stored as separate red/green/blue/alpha planes and blended 8 Lamps at a time with
+// SIMD. Layers that can't show (opacity 0, fully transparent or fully masked) are skipped, and the
+// result below every layer is kept, so a frame only redoes the work from the lowest changed layer up.
+struct LampLayerCompositor
+{
+public:
+    // Removes every layer.
+    void SetLampCount(size_t lampCount);
+
+    // Adds a layer on top of the others and returns its index. Layers start fully transparent.
+    size_t AddLayer(LampBlendMode blendMode);
+
+    // The layers above index move down by one.
+    void RemoveLayer(size_t index);
+
+    // colors must have one color per Lamp, in the order the result will be used in.
+    void SetLayerColors(size_t index, const std::vector<LampArrayColor>& colors);
+    void SetLayerBlendMode(size_t index, LampBlendMode blendMode);
+    void SetLayerOpacity(size_t index, uint8_t opacity);
+
+    // One coverage value per Lamp, 0 hides the layer on that Lamp. An empty mask shows it everywhere.
+    void SetLayerMask(size_t index, const std::vector<uint8_t>& mask);
+
+    // Blends all layers, bottom first, over black. The alpha of the result is always 0xFF.
+    // Returns false, leaving colors untouched, when nothing changed since the last call.
+    bool Composite(std::vector<LampArrayColor>& colors);
+
+private:
+    struct ColorPlanes
+    {
+        std::vector<uint8_t> red;
+        std::vector<uint8_t> green;
+        std::vector<uint8_t> blue;
+    };
+
+    struct Layer
+    {
+        LampBlendMode blendMode;
+        uint8_t opacity;
+        ColorPlanes colors;
+        std::vector<uint8_t> alpha;
+        std::vector<uint8_t> mask; // All 0xFF when the layer has no mask
+        bool isTransparent; // Every Lamp has alpha or mask 0
+
+        // What the layers up to and including this one add up to
+        ColorPlanes result;
+    };
+
+    void MarkChanged(size_t index) { m_firstChangedLayer = std::min(m_firstChangedLayer, index); }
+    void UpdateIsTransparent(Layer& layer) noexcept;
+
+    // Blends layer over below into layer.result.
+    void BlendLayer(const ColorPlanes& below, Layer& layer) const noexcept;
+
+    size_t m_lampCount{};
+    size_t m_paddedLampCount{}; // Multiple of 8, so SIMD never has to handle a partial group
+
+    std::vector<Layer> m_layers;
+
+    // Everything from this layer up has to be blended again, SIZE_MAX when nothing changed
+    size_t m_firstChangedLayer = SIZE_MAX;
+    bool m_hasComposited{};
+
+    ColorPlanes m_black;
+};
@@ -0,0 +1,496 @@
+#include "pch.h"
+#include "LampLayoutCompiler.h"
+#include "KDTreeTuner.h"
+
+#include <charconv>
+#include <cstdio>
+
+// CSV input is split into chunks of about this many bytes, parsed in parallel.
+const size_t c_csvChunkSize = 4 * 1024 * 1024;
+
+// Lamps read or converted by one task.
+const uint64_t c_lampsPerChunk = 256 * 1024;
+
+// A box depends on the Lamps within about twice its size, whose boxes in turn depend on their
+// nearest neighbors. Lamps further than this many times their box's width + height from the edge
+// of the halo are sure to have seen every Lamp that matters.
+const int64_t c_haloReachFactor = 4;
+
+// Part of the input holding the Lamps [firstLamp, firstLamp + lampCount).
+struct InputChunk
+{
+    size_t begin;
+    size_t end;
+    uint64_t firstLamp;
+    uint64_t lampCount;
+};
+
+// The plane cut into columns x rows square tiles. The outer tiles extend to infinity, so Lamps
+// outside the bounding box still belong to a tile.
+struct TileGrid
+{
+    int64_t tileSize;
+    int64_t halo;
+    uint32_t columns;
+    uint32_t rows;
+};
+
+// Same as ParallelFor, but the first exception thrown by a task is rethrown once they all completed.
+static void ParallelForOrThrow(WorkStealingThreadPool& threadPool, size_t taskCount, const std::function<void(size_t)>& task)
+{
+    std::mutex errorLock;
+    std::exception_ptr error;
+
+    threadPool.ParallelFor(taskCount, [&](size_t i)
+        {
+            try
+            {
+                task(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        });
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+static const char* SkipBlanks(const char* current, const char* end)
+{
+    while ((current < end) && ((*current == ' ') || (*current == '\t')))
+    {
+        current++;
+    }
+    return current;
+}
+
+static bool IsCsvDataLine(const char* begin, const char* end)
+{
+    begin = SkipBlanks(begin, end);
+    return (begin < end) && (*begin != '#') && (*begin != '\r');
+}
+
+// Calls lineHandler(begin, end) for every line of [begin, end), without the '\n'.
+template<typename LineHandler>
+static void ForEachLine(const char* begin, const char* end, LineHandler&& lineHandler)
+{
+    while (begin < end)
+    {
+        const char* lineEnd = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+
+        lineHandler(begin, lineEnd);
+        begin = lineEnd + 1;
+    }
+}
+
+static LampArrayPosition ParseCsvLine(const char* begin, const char* end)
+{
+    float values[3];
+    const char* current = begin;
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        if (i > 0)
+        {
+            current = SkipBlanks(current, end);
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), (current == end) || (*current != ','));
+            current++;
+        }
+
+        current = SkipBlanks(current, end);
+        const auto parsed = std::from_chars(current, end, values[i]);
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), parsed.ec != std::errc());
+        current = parsed.ptr;
+    }
+
+    current = SkipBlanks(current, end);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), (current != end) && (*current != '\r'));
+
+    return LampArrayPosition{ values[0], values[1], values[2] };
+}
+
+// Splits the input into chunks that can be read in parallel and counts the Lamps in each.
+static std::vector<InputChunk> SplitInput(const MappedFile& input, LampLayoutInputFormat format, WorkStealingThreadPool& threadPool)
+{
+    const size_t size = static_cast<size_t>(input.GetSize());
+    std::vector<InputChunk> chunks;
+
+    if (format == LampLayoutInputFormat::Binary)
+    {
+        THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), size % sizeof(LampArrayPosition) != 0);
+
+        const uint64_t lampCount = size / sizeof(LampArrayPosition);
+        for (uint64_t firstLamp = 0; firstLamp < lampCount; firstLamp += c_lampsPerChunk)
+        {
+            const uint64_t chunkLampCount = std::min(c_lampsPerChunk, lampCount - firstLamp);
+            chunks.push_back(InputChunk{
+                static_cast<size_t>(firstLamp * sizeof(LampArrayPosition)),
+                static_cast<size_t>((firstLamp + chunkLampCount) * sizeof(LampArrayPosition)),
+                firstLamp,
+                chunkLampCount });
+        }
+        return chunks;
+    }
+
+    // Every chunk but the first starts right after a line break
+    const char* text = reinterpret_cast<const char*>(input.GetData());
+    size_t begin = 0;
+    while (begin < size)
+    {
+        size_t end = std::min(begin + c_csvChunkSize, size);
+        const char* lineBreak = static_cast<const char*>(memchr(text + end, '\n', size - end));
+        end = (lineBreak != nullptr) ? (lineBreak - text) + 1 : size;
+
+        chunks.push_back(InputChunk{ begin, end, 0, 0 });
+        begin = end;
+    }
+
+    ParallelForOrThrow(threadPool, chunks.size(), [&](size_t i)
+        {
+            InputChunk& chunk = chunks[i];
+            ForEachLine(text + chunk.begin, text + chunk.end, [&](const char* lineBegin, const char* lineEnd)
+                {
+                    chunk.lampCount += IsCsvDataLine(lineBegin, lineEnd) ? 1 : 0;
+                });
+        });
+
+    uint64_t firstLamp = 0;
+    for (InputChunk& chunk : chunks)
+    {
+        chunk.firstLamp = firstLamp;
+        firstLamp += chunk.lampCount;
+    }
+
+    return chunks;
+}
+
+// Largest coordinates of positions[0..count), or of the origin if they are all negative.
+static LampArrayPosition GetLargestCoordinates(const LampArrayPosition* positions, uint64_t count)
+{
+    LampArrayPosition largest{};
+    for (uint64_t i = 0; i < count; i++)
+    {
+        largest.xInMeters = std::max(largest.xInMeters, positions[i].xInMeters);
+        largest.yInMeters = std::max(largest.yInMeters, positions[i].yInMeters);
+        largest.zInMeters = std::max(largest.zInMeters, positions[i].zInMeters);
+    }
+    return largest;
+}
+
+static int64_t FloorDivide(int64_t value, int64_t divisor)
+{
+    const int64_t quotient = value / divisor;
+    return ((value % divisor != 0) && (value < 0)) ? quotient - 1 : quotient;
+}
+
+// Column (or row) of the tile holding coordinate, the outer ones extending to infinity.
+static uint32_t GetTileIndex(int64_t coordinate, const TileGrid& grid, uint32_t count)
+{
+    return static_cast<uint32_t>(std::clamp<int64_t>(FloorDivide(coordinate, grid.tileSize), 0, count - 1));
+}
+
+// How far point is from the inner edges of the halo of tile (column, row).
+static int64_t GetDistanceToHaloEdge(const KDTree::Point& point, const TileGrid& grid, uint32_t column, uint32_t row)
+{
+    const int64_t x = point.values[0];
+    const int64_t y = point.values[1];
+    int64_t distance = std::numeric_limits<int64_t>::max();
+
+    if (column > 0)
+    {
+        distance = std::min(distance, x - (column * grid.tileSize - grid.halo));
+    }
+    if (column + 1 < grid.columns)
+    {
+        distance = std::min(distance, (column + 1) * grid.tileSize + grid.halo - x);
+    }
+    if (row > 0)
+    {
+        distance = std::min(distance, y - (row * grid.tileSize - grid.halo));
+    }
+    if (row + 1 < grid.rows)
+    {
+        distance = std::min(distance, (row + 1) * grid.tileSize + grid.halo - y);
+    }
+
+    return distance;
+}
+
+LampLayoutCompilerResults LampLayoutCompiler::Compile(
+    const std::filesystem::path& inputPath,
+    const std::filesystem::path& outputPath,
+    const LampLayoutCompilerOptions& options)
+{
+    THROW_HR_IF(E_INVALIDARG, options.lampsPerTile == 0);
+    THROW_HR_IF(E_INVALIDARG, options.haloInMillimeters < 0);
+
+    WorkStealingThreadPool threadPool(WorkStealingThreadPool::GetPhysicalCoreCount());
+
+    const MappedFile input(inputPath);
+    const std::vector<InputChunk> inputChunks = SplitInput(input, options.inputFormat, threadPool);
+    const uint64_t lampCount = inputChunks.empty() ? 0 : inputChunks.back().firstLamp + inputChunks.back().lampCount;
+
+    const LampLayoutFileOffsets offsets = GetLampLayoutFileOffsets(lampCount);
+    MappedFile output(outputPath, offsets.totalSize);
+    uint8_t* outputData = output.GetWritableData();
+    auto lampPositions = reinterpret_cast<LampArrayPosition*>(outputData + offsets.lampPositions);
+    auto planePositions = reinterpret_cast<KDTree::Point*>(outputData + offsets.planePositions);
+    auto lampBoxes = reinterpret_cast<BoundingBox*>(outputData + offsets.lampBoxes);
+
+    // Read every Lamp straight into the output
+    std::vector<LampArrayPosition> largestCoordinates(inputChunks.size());
+    ParallelForOrThrow(threadPool, inputChunks.size(), [&](size_t i)
+        {
+            const InputChunk& chunk = inputChunks[i];
+            LampArrayPosition* positions = lampPositions + chunk.firstLamp;
+
+            if (options.inputFormat == LampLayoutInputFormat::Binary)
+            {
+                memcpy(positions, input.GetData() + chunk.begin, chunk.end - chunk.begin);
+            }
+            else
+            {
+                const char* text = reinterpret_cast<const char*>(input.GetData());
+                ForEachLine(text + chunk.begin, text + chunk.end, [&](const char* lineBegin, const char* lineEnd)
+                    {
+                        if (IsCsvDataLine(lineBegin, lineEnd))
+                        {
+                            *positions++ = ParseCsvLine(lineBegin, lineEnd);
+                        }
+                    });
+            }
+
+            largestCoordinates[i] = GetLargestCoordinates(lampPositions + chunk.firstLamp, chunk.lampCount);
+        });
+
+    LampArrayPosition boundingBox = options.boundingBox;
+    if ((boundingBox.xInMeters == 0) && (boundingBox.yInMeters == 0) && (boundingBox.zInMeters == 0))
+    {
+        boundingBox = GetLargestCoordinates(largestCoordinates.data(), largestCoordinates.size());
+    }
+
+    // Same plane and coordinates as LampArrayBitmapHelper would pick
+    const LampArrayBitmapOrientation orientation = LampArrayBitmapHelper::SelectOrientation(boundingBox);
+    const KDTree::Point bottomRight = LampArrayBitmapHelper::GetPlanePosition(orientation, boundingBox);
+    const BoundingBox globalBoundingBox = { 0, 0, bottomRight.values[0], bottomRight.values[1] };
+
+    const size_t lampChunkCount = static_cast<size_t>((lampCount + c_lampsPerChunk - 1) / c_lampsPerChunk);
+    ParallelForOrThrow(threadPool, lampChunkCount, [&](size_t chunk)
+        {
+            const uint64_t end = std::min(lampCount, (chunk + 1) * c_lampsPerChunk);
+            for (uint64_t i = chunk * c_lampsPerChunk; i < end; i++)
+            {
+                planePositions[i] = LampArrayBitmapHelper::GetPlanePosition(orientation, lampPositions[i]);
+            }
+        });
+
+    // Square tiles of about options.lampsPerTile Lamps each, assuming they are spread evenly
+    const int64_t width = std::max<int64_t>(globalBoundingBox.Right, 1);
+    const int64_t height = std::max<int64_t>(globalBoundingBox.Bottom, 1);
+    const uint64_t targetTileCount = std::max<uint64_t>((lampCount + options.lampsPerTile - 1) / options.lampsPerTile, 1);
+
+    // A layout that fits in one tile is generated whole, so its boxes are exactly the ones
+    // Initialize generates, whatever KDTree::SearchConfig it uses
+    TileGrid grid{};
+    grid.tileSize = (targetTileCount == 1) ?
+        std::max(width, height) :
+        std::max<int64_t>(static_cast<int64_t>(std::ceil(std::sqrt(static_cast<double>(width) * height / targetTileCount))), 1);
+    grid.halo = options.haloInMillimeters;
+    grid.columns = static_cast<uint32_t>((width + grid.tileSize - 1) / grid.tileSize);
+    grid.rows = static_cast<uint32_t>((height + grid.tileSize - 1) / grid.tileSize);
+
+    // Enough rows of tiles at a time to keep every core busy, and no more so memory stays bounded
+    const uint32_t rowsPerPass = std::max<uint32_t>((threadPool.GetThreadCount() + grid.columns - 1) / grid.columns, 1);
+
+    std::atomic<uint64_t> approximateLampCount{};
+
+    for (uint32_t firstRow = 0; (firstRow < grid.rows) && (lampCount > 0); firstRow += rowsPerPass)
+    {
+        const uint32_t lastRow = std::min(firstRow + rowsPerPass, grid.rows) - 1;
+        const size_t passTileCount = static_cast<size_t>(lastRow - firstRow + 1) * grid.columns;
+
+        // Every chunk of Lamps hands the Lamps in or near the tiles of this pass to those tiles.
+        // Kept per chunk so no locking is needed, and concatenated in order later.
+        std::vector<std::vector<std::vector<KDTree::Data>>> chunkTiles(lampChunkCount);
+        ParallelForOrThrow(threadPool, lampChunkCount, [&](size_t chunk)
+            {
+                auto& tiles = chunkTiles[chunk];
+                tiles.resize(passTileCount);
+
+                const uint64_t end = std::min(lampCount, (chunk + 1) * c_lampsPerChunk);
+                for (uint64_t i = chunk * c_lampsPerChunk; i < end; i++)
+                {
+                    const KDTree::Point& point = planePositions[i];
+
+                    const uint32_t rowBegin = std::max(GetTileIndex(point.values[1] - grid.halo, grid, grid.rows), firstRow);
+                    const uint32_t rowEnd = std::min(GetTileIndex(point.values[1] + grid.halo, grid, grid.rows), lastRow);
+                    const uint32_t columnBegin = GetTileIndex(point.values[0] - grid.halo, grid, grid.columns);
+                    const uint32_t columnEnd = GetTileIndex(point.values[0] + grid.halo, grid, grid.columns);
+
+                    for (uint32_t row = rowBegin; row <= rowEnd; row++)
+                    {
+                        for (uint32_t column = columnBegin; column <= columnEnd; column++)
+                        {
+                            tiles[(row - firstRow) * grid.columns + column].push_back(KDTree::Data{ point, static_cast<size_t>(i) });
+                        }
+                    }
+                }
+            });
+
+        ParallelForOrThrow(threadPool, passTileCount, [&](size_t tile)
+            {
+                const uint32_t row = firstRow + static_cast<uint32_t>(tile / grid.columns);
+                const uint32_t column = static_cast<uint32_t>(tile % grid.columns);
+
+                size_t nodeCount = 0;
+                for (const auto& tiles : chunkTiles)
+                {
+                    nodeCount += tiles[tile].size();
+                }
+
+                std::vector<KDTree::Data> nodes;
+                nodes.reserve(nodeCount);
+                for (auto& tiles : chunkTiles)
+                {
+                    nodes.insert(nodes.end(), tiles[tile].begin(), tiles[tile].end());
+                    std::vector<KDTree::Data>().swap(tiles[tile]);
+                }
+
+                // The boxes are generated by index into the tile, remember which Lamp each one is
+                std::vector<uint64_t> nodeLampIndices(nodeCount);
+                for (size_t i = 0; i < nodeCount; i++)
+                {
+                    nodeLampIndices[i] = nodes[i].indexBoundingBox;
+                    nodes[i].indexBoundingBox = i;
+                }
+
+                std::vector<BoundingBox> boxes;
+                THROW_IF_FAILED(KDTree::GenerateAllBoundingBoxes(nodes, globalBoundingBox, boxes, KDTreeTuner::GetSearchConfig(nodes.size())));
+
+                // Only the Lamps of this tile are kept, the halo was only there to surround them
+                uint64_t tileApproximateLampCount = 0;
+                for (size_t i = 0; i < nodeCount; i++)
+                {
+                    const uint64_t lampIndex = nodeLampIndices[i];
+                    const KDTree::Point& point = planePositions[lampIndex];
+                    if ((GetTileIndex(point.values[0], grid, grid.columns) != column) ||
+                        (GetTileIndex(point.values[1], grid, grid.rows) != row))
+                    {
+                        continue;
+                    }
+
+                    const BoundingBox& box = boxes[i];
+                    lampBoxes[lampIndex] = box;
+
+                    const int64_t reach = c_haloReachFactor *
+                        ((static_cast<int64_t>(box.Right) - box.Left) + (static_cast<int64_t>(box.Bottom) - box.Top));
+                    if (reach > GetDistanceToHaloEdge(point, grid, column, row))
+                    {
+                        tileApproximateLampCount++;
+                    }
+                }
+
+                approximateLampCount.fetch_add(tileApproximateLampCount, std::memory_order_relaxed);
+            });
+    }
+
+    // Written last, a compilation that failed halfway never leaves a valid layout file behind
+    LampLayoutFileHeader header{};
+    header.magic = LampLayoutFileHeader::c_magic;
+    header.version = LampLayoutFileHeader::c_version;
+    header.lampCount = lampCount;
+    header.minUpdateIntervalInMicroseconds = options.minUpdateIntervalInMicroseconds;
+    header.boundingBox = boundingBox;
+    memcpy(outputData, &header, sizeof(header));
+
+    LampLayoutCompilerResults results{};
+    results.lampCount = lampCount;
+    results.tileCount = (lampCount > 0) ? grid.columns * grid.rows : 0;
+    results.approximateLampCount = approximateLampCount.load();
+    return results;
+}
+
+// Enough digits to read back as the same float, always with an exponent so it is a float literal.
+static std::string FormatFloat(float value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.8ef", value);
+    return text;
+}
+
+void LampLayoutCompiler::WriteKnownLayoutHeader(
+    const PrecomputedLampLayout& layout,
+    const std::filesystem::path& headerPath,
+    const std::wstring& model,
+    uint16_t vendorId,
+    uint16_t productId)
+{
+    // Arrays can't be empty, and a table without Lamps would never match anyway
+    THROW_HR_IF(E_INVALIDARG, layout.lampCount == 0);
+
+    std::string modelName;
+    for (wchar_t character : model)
+    {
+        const bool isValid = ((character >= L'a') && (character <= L'z')) ||
+            ((character >= L'A') && (character <= L'Z')) ||
+            ((character >= L'0') && (character <= L'9') && !modelName.empty()) ||
+            (character == L'_');
+        THROW_HR_IF(E_INVALIDARG, !isValid);
+        modelName += static_cast<char>(character);
+    }
+    THROW_HR_IF(E_INVALIDARG, modelName.empty());
+
+    std::ofstream header(headerPath, std::ios::trunc);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_OPEN_FAILED), !header.is_open());
+
+    char ids[64];
+    snprintf(ids, sizeof(ids), "0x%04X;\n    constexpr uint16_t c_productId = 0x%04X;\n", vendorId, productId);
+
+    header << "#pragma once\n\n";
+    header << "// Generated by LampLayoutCompiler, do not edit.\n\n";
+    header << "namespace KnownLampLayouts::" << modelName << "\n{\n";
+    header << "    constexpr uint16_t c_vendorId = " << ids;
+    header << "    constexpr uint64_t c_minUpdateIntervalInMicroseconds = " << layout.minUpdateIntervalInMicroseconds << ";\n";
+    header << "    constexpr LampArrayPosition c_boundingBox = { " << FormatFloat(layout.boundingBox.xInMeters) << ", " <<
+        FormatFloat(layout.boundingBox.yInMeters) << ", " << FormatFloat(layout.boundingBox.zInMeters) << " };\n\n";
+
+    header << "    constexpr LampArrayPosition c_lampPositions[] =\n    {\n";
+    for (size_t i = 0; i < layout.lampCount; i++)
+    {
+        const LampArrayPosition& position = layout.lampPositions[i];
+        header << "        { " << FormatFloat(position.xInMeters) << ", " << FormatFloat(position.yInMeters) << ", " <<
+            FormatFloat(position.zInMeters) << " },\n";
+    }
+    header << "    };\n\n";
+
+    header << "    constexpr KDTree::Point c_planePositions[] =\n    {\n";
+    for (size_t i = 0; i < layout.lampCount; i++)
+    {
+        const KDTree::Point& point = layout.planePositions[i];
+        header << "        { { " << point.values[0] << ", " << point.values[1] << " } },\n";
+    }
+    header << "    };\n\n";
+
+    header << "    constexpr BoundingBox c_lampBoxes[] =\n    {\n";
+    for (size_t i = 0; i < layout.lampCount; i++)
+    {
+        const BoundingBox& box = layout.lampBoxes[i];
+        header << "        { " << box.Left << ", " << box.Top << ", " << box.Right << ", " << box.Bottom << " },\n";
+    }
+    header << "    };\n}\n";
+
+    header.close();
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), header.fail());
+}
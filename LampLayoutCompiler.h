@@ -0,0 +1,63 @@
+#pragma once
+
+#include "LampLayoutFile.h"
+
+enum class LampLayoutInputFormat : uint32_t
+{
+    Binary, // Nothing but LampArrayPositions, 3 little endian floats in meters per Lamp
+    Csv, // One "x,y,z" line in meters per Lamp, empty lines and lines starting with # are skipped
+};
+
+struct LampLayoutCompilerOptions
+{
+    LampLayoutInputFormat inputFormat = LampLayoutInputFormat::Binary;
+
+    // Stored in the layout for stand-in helpers, LampArrays report their own.
+    uint64_t minUpdateIntervalInMicroseconds = 0;
+
+    // The LampArray's bounding box in meters, or all zeros to use the largest coordinates of the Lamps.
+    LampArrayPosition boundingBox{};
+
+    // The plane is cut into tiles of about this many Lamps, generated independently. Memory use
+    // grows with it (and with how much denser than average the densest tiles are).
+    uint32_t lampsPerTile = 65536;
+
+    // Lamps this close to a tile are taken into account when generating its boxes, in millimeters.
+    int32_t haloInMillimeters = 100;
+};
+
+struct LampLayoutCompilerResults
+{
+    uint64_t lampCount;
+    uint32_t tileCount;
+
+    // Lamps far enough from their neighbors that Lamps beyond the halo of their tile may have
+    // affected their box, which can then differ from a box generated over the whole LampArray.
+    // Compile again with a larger halo if this isn't 0.
+    uint64_t approximateLampCount;
+};
+
+// Generates the Lamp boxes of very large installations ahead of time. The input is memory-mapped
+// and the plane is cut into tiles that are generated on every core with KDTree::GenerateAllBoundingBoxes,
+// a few rows of tiles at a time, so memory use stays bounded however many Lamps there are.
+// The result is a LampLayoutFile, written through a mapping as well.
+//
+// Boxes are the ones GenerateAllBoundingBoxes gives over the whole LampArray, except where its
+// expansion pass depends on the order the Lamps are visited in, which differs from tree to tree.
+namespace LampLayoutCompiler
+{
+    // Throws if the input can't be read or parsed, or the output can't be written.
+    LampLayoutCompilerResults Compile(
+        const std::filesystem::path& inputPath,
+        const std::filesystem::path& outputPath,
+        const LampLayoutCompilerOptions& options);
+
+    // Writes layout as a C++ header of constexpr tables in namespace KnownLampLayouts::<model>,
+    // to be built in through KnownLampLayouts. model must be a valid C++ identifier.
+    void WriteKnownLayoutHeader(
+        const PrecomputedLampLayout& layout,
+        const std::filesystem::path& headerPath,
+        const std::wstring& model,
+        uint16_t vendorId,
+        uint16_t productId);
+}
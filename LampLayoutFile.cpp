@@ -0,0 +1,107 @@
+#include "pch.h"
+#include "LampLayoutFile.h"
+
+#include <cstdio>
+
+const wchar_t c_layoutFileExtension[] = L".lalf";
+
+LampLayoutFile::LampLayoutFile(const std::filesystem::path& path) :
+    m_file(path)
+{
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), m_file.GetSize() < sizeof(LampLayoutFileHeader));
+
+    const uint8_t* data = m_file.GetData();
+    const auto& header = *reinterpret_cast<const LampLayoutFileHeader*>(data);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.magic != LampLayoutFileHeader::c_magic);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), header.version != LampLayoutFileHeader::c_version);
+
+    // Checked before computing the offsets, so they can't overflow
+    const uint64_t lampSize = sizeof(LampArrayPosition) + sizeof(KDTree::Point) + sizeof(BoundingBox);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.lampCount > m_file.GetSize() / lampSize);
+
+    const LampLayoutFileOffsets offsets = GetLampLayoutFileOffsets(header.lampCount);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), offsets.totalSize != m_file.GetSize());
+
+    m_layout.minUpdateIntervalInMicroseconds = header.minUpdateIntervalInMicroseconds;
+    m_layout.boundingBox = header.boundingBox;
+    m_layout.lampCount = static_cast<size_t>(header.lampCount);
+    m_layout.lampPositions = reinterpret_cast<const LampArrayPosition*>(data + offsets.lampPositions);
+    m_layout.planePositions = reinterpret_cast<const KDTree::Point*>(data + offsets.planePositions);
+    m_layout.lampBoxes = reinterpret_cast<const BoundingBox*>(data + offsets.lampBoxes);
+}
+
+// Reads the IDs back out of a name made by GetFileName, returns false for any other name.
+static bool ParseFileName(const std::filesystem::path& path, uint16_t& vendorId, uint16_t& productId)
+{
+    const std::wstring stem = path.stem().wstring();
+    if ((path.extension() != c_layoutFileExtension) || (stem.size() != 9) || (stem[4] != L'-'))
+    {
+        return false;
+    }
+
+    uint32_t ids[2]{};
+    for (size_t i = 0; i < 2; i++)
+    {
+        for (const wchar_t digit : stem.substr(i * 5, 4))
+        {
+            if (!iswxdigit(digit))
+            {
+                return false;
+            }
+            ids[i] = ids[i] * 16 + ((digit <= L'9') ? (digit - L'0') : ((digit | 0x20) - L'a' + 10));
+        }
+    }
+
+    vendorId = static_cast<uint16_t>(ids[0]);
+    productId = static_cast<uint16_t>(ids[1]);
+    return true;
+}
+
+LampLayoutDirectory::LampLayoutDirectory(const std::filesystem::path& directory)
+{
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, error))
+    {
+        Entry layout{};
+        if (!entry.is_regular_file(error) || !ParseFileName(entry.path(), layout.vendorId, layout.productId))
+        {
+            continue;
+        }
+
+        // One bad file only loses its own model
+        try
+        {
+            layout.file = std::make_unique<LampLayoutFile>(entry.path());
+            m_layouts.push_back(std::move(layout));
+        }
+        CATCH_LOG();
+    }
+}
+
+std::wstring LampLayoutDirectory::GetFileName(uint16_t vendorId, uint16_t productId)
+{
+    wchar_t name[16];
+    swprintf(name, std::size(name), L"%04X-%04X%ls", vendorId, productId, c_layoutFileExtension);
+    return name;
+}
+
+bool LampLayoutDirectory::HasLampCount(uint32_t lampCount) const
+{
+    return std::any_of(m_layouts.begin(), m_layouts.end(),
+        [&](const Entry& layout) { return layout.file->GetLayout().lampCount == lampCount; });
+}
+
+const PrecomputedLampLayout* LampLayoutDirectory::Find(uint16_t vendorId, uint16_t productId, uint32_t lampCount) const
+{
+    for (const Entry& layout : m_layouts)
+    {
+        if ((layout.vendorId == vendorId) &&
+            (layout.productId == productId) &&
+            (layout.file->GetLayout().lampCount == lampCount))
+        {
+            return &layout.file->GetLayout();
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "LampArrayBitmapHelper.h"
+#include "MappedFile.h"
+
+// Layout file written by LampLayoutCompiler. Everything is stored exactly as PrecomputedLampLayout
+// points at it, little endian, so loading is mapping the file and checking its size:
+//
+//   LampLayoutFileHeader
+//   LampArrayPosition[lampCount]  Lamp positions in meters
+//   KDTree::Point[lampCount]      Lamp positions on the bitmap plane in millimeters
+//   BoundingBox[lampCount]        Lamp boxes on the bitmap plane
+struct LampLayoutFileHeader
+{
+    static const uint32_t c_magic = 0x464C414C; // "LALF" read as a little endian uint32
+    static const uint32_t c_version = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t lampCount;
+    uint64_t minUpdateIntervalInMicroseconds;
+    LampArrayPosition boundingBox;
+    uint32_t reserved;
+};
+
+// Offsets of the arrays following the header, and the size of the whole file.
+struct LampLayoutFileOffsets
+{
+    uint64_t lampPositions;
+    uint64_t planePositions;
+    uint64_t lampBoxes;
+    uint64_t totalSize;
+};
+
+inline LampLayoutFileOffsets GetLampLayoutFileOffsets(uint64_t lampCount) noexcept
+{
+    LampLayoutFileOffsets offsets{};
+    offsets.lampPositions = sizeof(LampLayoutFileHeader);
+    offsets.planePositions = offsets.lampPositions + lampCount * sizeof(LampArrayPosition);
+    offsets.lampBoxes = offsets.planePositions + lampCount * sizeof(KDTree::Point);
+    offsets.totalSize = offsets.lampBoxes + lampCount * sizeof(BoundingBox);
+    return offsets;
+}
+
+// A layout file mapped read-only, to hand to LampArrayBitmapHelper::InitializeFromPrecomputedLayout.
+struct LampLayoutFile
+{
+public:
+    // Throws if path can't be mapped or isn't a layout file of a known version.
+    explicit LampLayoutFile(const std::filesystem::path& path);
+
+    // Points into the mapping, valid for as long as this object.
+    const PrecomputedLampLayout& GetLayout() const { return m_layout; }
+
+private:
+    MappedFile m_file;
+    PrecomputedLampLayout m_layout{};
+};
+
+// The compiled layout files of LampArray models in one directory, mapped once and shared by every
+// helper (see LampArrayBitmapHelper::Initialize). A model's file is named after its hardware vendor
+// and product IDs, see GetFileName. Immutable once constructed, so safe to use from any thread.
+struct LampLayoutDirectory
+{
+public:
+    // Maps every layout file in directory. Files that aren't valid layout files are logged and
+    // skipped, and a directory that doesn't exist has no layouts.
+    explicit LampLayoutDirectory(const std::filesystem::path& directory);
+
+    LampLayoutDirectory(const LampLayoutDirectory&) = delete;
+    LampLayoutDirectory& operator=(const LampLayoutDirectory&) = delete;
+
+    // The name the layout file of a model goes by, e.g. 045E-0A1B.lalf.
+    static std::wstring GetFileName(uint16_t vendorId, uint16_t productId);
+
+    // Whether any layout in the directory has lampCount Lamps.
+    bool HasLampCount(uint32_t lampCount) const;
+
+    // The layout of this model, or nullptr if there is none. A device reporting a different number
+    // of Lamps than its model's file (e.g. another revision) gets nullptr too.
+    const PrecomputedLampLayout* Find(uint16_t vendorId, uint16_t productId, uint32_t lampCount) const;
+
+private:
+    struct Entry
+    {
+        uint16_t vendorId;
+        uint16_t productId;
+        std::unique_ptr<LampLayoutFile> file;
+    };
+
+    std::vector<Entry> m_layouts;
+};
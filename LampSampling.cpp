@@ -0,0 +1,261 @@
+#include "pch.h"
+#include "LampSampling.h"
+#include "PerformanceMetrics.h"
+
+// Below this many Lamps, handing the work to other threads costs more than it saves.
+const size_t c_minLampsForParallelSampling = 2048;
+
+// 256 boxes (2KB compacted) and 256 colors (1KB, about 16 cache lines) per task.
+const size_t c_lampsPerSamplingShard = 256;
+
+// Interleaves the bits of x and y (x in the even bits), so that points close to each other
+// in 2D mostly end up close to each other along the code too.
+static uint32_t MortonCode(uint16_t x, uint16_t y) noexcept
+{
+    auto spreadBits = [](uint32_t value)
+    {
+        value = (value | (value << 8)) & 0x00FF00FF;
+        value = (value | (value << 4)) & 0x0F0F0F0F;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
+    };
+
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+// Maps the span [begin, end] in millimeters, relative to an encompassing box of the given extent,
+// onto a non-empty span of pixels [pixelBegin, pixelEnd) within [0, pixelCount).
+static void MapSpanToPixels(
+    int32_t begin,
+    int32_t end,
+    int32_t extent,
+    uint32_t pixelCount,
+    uint32_t& pixelBegin,
+    uint32_t& pixelEnd) noexcept
+{
+    if (extent <= 0)
+    {
+        // Every Lamp sits on the same line, so they all cover the whole span
+        pixelBegin = 0;
+        pixelEnd = pixelCount;
+        return;
+    }
+
+    pixelBegin = static_cast<uint32_t>((static_cast<int64_t>(begin) * pixelCount) / extent);
+    pixelEnd = static_cast<uint32_t>((static_cast<int64_t>(end) * pixelCount) / extent);
+
+    pixelBegin = std::min(pixelBegin, pixelCount - 1);
+    pixelEnd = std::min(std::max(pixelEnd, pixelBegin + 1), pixelCount);
+}
+
+// Samples the boxes [begin, end) of layout into colors.
+static void SampleLamps(
+    const BitmapView& regionView,
+    const LampBoxLayout& layout,
+    const ColorTransform* pixelTransform,
+    const ColorTransform* lampTransform,
+    size_t begin,
+    size_t end,
+    LampArrayColor* colors) noexcept
+{
+    // 8-bit RGBA/BGRA with nothing to do per pixel can be summed straight out of the frame.
+    const bool canSumDirectly = (pixelTransform == nullptr) &&
+        ((regionView.Format == BitmapFormat::BGRA8) || (regionView.Format == BitmapFormat::RGBA8));
+
+    // Offsets of each channel within a pixel
+    const bool isBgra = (regionView.Format == BitmapFormat::BGRA8);
+    const size_t redOffset = isBgra ? 2 : 0;
+    const size_t blueOffset = isBgra ? 0 : 2;
+
+    // Small enough to stay in L1 between being decoded and summed
+    constexpr uint32_t c_conversionChunkSize = 64;
+    LampArrayColor converted[c_conversionChunkSize];
+
+    // Boxes are decoded a chunk at a time, right before they are used
+    constexpr size_t c_boxChunkSize = CompactBoundingBoxes::c_boxesPerBlock;
+    BoundingBox boxes[c_boxChunkSize];
+
+    const BoundingBox& encompassingBox = layout.EncompassingBox;
+    const int32_t encompassingBoxWidth = encompassingBox.Right - encompassingBox.Left;
+    const int32_t encompassingBoxHeight = encompassingBox.Bottom - encompassingBox.Top;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        if ((i - begin) % c_boxChunkSize == 0)
+        {
+            const size_t chunkSize = std::min(c_boxChunkSize, end - i);
+            if (layout.BoxIndices != nullptr)
+            {
+                layout.Boxes->Gather(layout.BoxIndices + i, chunkSize, boxes);
+            }
+            else
+            {
+                layout.Boxes->Decode(i, chunkSize, boxes);
+            }
+        }
+        const BoundingBox& box = boxes[(i - begin) % c_boxChunkSize];
+        LampArrayColor& color = colors[(layout.BoxIndices != nullptr) ? layout.BoxIndices[i] : i];
+
+        uint32_t left, right, top, bottom;
+        MapSpanToPixels(box.Left - encompassingBox.Left, box.Right - encompassingBox.Left, encompassingBoxWidth, regionView.Width, left, right);
+        MapSpanToPixels(box.Top - encompassingBox.Top, box.Bottom - encompassingBox.Top, encompassingBoxHeight, regionView.Height, top, bottom);
+
+        uint32_t sums[4]{};
+        for (uint32_t y = top; y < bottom; y++)
+        {
+            if (canSumDirectly)
+            {
+                const uint8_t* pixel = regionView.Data + static_cast<size_t>(y) * regionView.StrideInBytes + static_cast<size_t>(left) * 4;
+                for (uint32_t x = left; x < right; x++)
+                {
+                    sums[0] += pixel[0];
+                    sums[1] += pixel[1];
+                    sums[2] += pixel[2];
+                    sums[3] += pixel[3];
+                    pixel += 4;
+                }
+            }
+            else
+            {
+                // Decode and correct a chunk of the row, then sum it while it is still hot
+                for (uint32_t x = left; x < right; x += c_conversionChunkSize)
+                {
+                    const uint32_t count = std::min(c_conversionChunkSize, right - x);
+                    PixelConversion::ConvertPixels(regionView, x, y, count, pixelTransform, converted);
+
+                    for (uint32_t j = 0; j < count; j++)
+                    {
+                        sums[0] += converted[j].r;
+                        sums[1] += converted[j].g;
+                        sums[2] += converted[j].b;
+                        sums[3] += converted[j].a;
+                    }
+                }
+            }
+        }
+
+        const uint32_t pixelCount = (right - left) * (bottom - top);
+        if (canSumDirectly)
+        {
+            color = LampArrayColor{
+                static_cast<uint8_t>(sums[redOffset] / pixelCount),
+                static_cast<uint8_t>(sums[1] / pixelCount),
+                static_cast<uint8_t>(sums[blueOffset] / pixelCount),
+                static_cast<uint8_t>(sums[3] / pixelCount) };
+        }
+        else
+        {
+            color = LampArrayColor{
+                static_cast<uint8_t>(sums[0] / pixelCount),
+                static_cast<uint8_t>(sums[1] / pixelCount),
+                static_cast<uint8_t>(sums[2] / pixelCount),
+                static_cast<uint8_t>(sums[3] / pixelCount) };
+        }
+
+        if (layout.BoxIndices != nullptr && lampTransform != nullptr)
+        {
+            PixelConversion::ApplyColorTransform(*lampTransform, &color, 1);
+        }
+    }
+
+    if (layout.BoxIndices == nullptr && lampTransform != nullptr)
+    {
+        PixelConversion::ApplyColorTransform(*lampTransform, colors + begin, end - begin);
+    }
+}
+
+void LampSampling::SampleBitmap(
+    const BitmapView& bitmap,
+    const BitmapRegion& region,
+    const LampBoxLayout& layout,
+    const ColorTransform* pixelTransform,
+    const ColorTransform* lampTransform,
+    std::vector<LampArrayColor>& colors,
+    WorkStealingThreadPool* threadPool)
+{
+    THROW_HR_IF(E_INVALIDARG, bitmap.Data == nullptr);
+    THROW_HR_IF(E_INVALIDARG, (bitmap.Format == BitmapFormat::NV12) && (bitmap.ChromaData == nullptr));
+    THROW_HR_IF(E_INVALIDARG, !IsRegionInsideBitmap(bitmap, region));
+    THROW_HR_IF(E_INVALIDARG, !IsRegionAlignedForFormat(bitmap.Format, region));
+
+    METRICS_TIME_SCOPE(Sampling);
+
+    const size_t lampCount = (layout.BoxIndices != nullptr) ? layout.BoxCount : layout.Boxes->GetCount();
+    colors.resize(layout.Boxes->GetCount());
+    METRICS_ADD(LampsSampled, lampCount);
+
+    if (region.Width == 0 || region.Height == 0)
+    {
+        for (size_t i = 0; i < lampCount; i++)
+        {
+            colors[(layout.BoxIndices != nullptr) ? layout.BoxIndices[i] : i] = LampArrayColor{};
+        }
+        return;
+    }
+
+    // Only the region is ever addressed, the rest of the frame is never touched.
+    const BitmapView regionView = CropBitmapView(bitmap, region);
+
+    if ((threadPool == nullptr) || (threadPool->GetThreadCount() == 1) || (lampCount < c_minLampsForParallelSampling))
+    {
+        SampleLamps(regionView, layout, pixelTransform, lampTransform, 0, lampCount, colors.data());
+        return;
+    }
+
+    // Every shard writes its own contiguous slice of colors. The vector's storage isn't cache line
+    // aligned, so two shards can share the line where their slices meet, one line out of the 16 a
+    // shard writes (with BoxIndices, wherever their Lamps interleave). Each Lamp is computed the
+    // same way on any thread, so results don't depend on the thread count.
+    const size_t shardCount = (lampCount + c_lampsPerSamplingShard - 1) / c_lampsPerSamplingShard;
+    LampArrayColor* const colorsData = colors.data();
+
+    threadPool->ParallelFor(shardCount, [&](size_t shard)
+        {
+            const size_t begin = shard * c_lampsPerSamplingShard;
+            const size_t end = std::min(begin + c_lampsPerSamplingShard, lampCount);
+            SampleLamps(regionView, layout, pixelTransform, lampTransform, begin, end, colorsData);
+        });
+}
+
+std::vector<uint32_t> LampSampling::GetSpatialOrder(
+    const std::vector<BoundingBox>& boxes,
+    int32_t width,
+    int32_t height)
+{
+    const size_t boxCount = boxes.size();
+
+    // Morton codes take 16 bits per axis, shift larger layouts down until they fit
+    uint32_t shift = 0;
+    while ((std::max(width, height) >> shift) > 0xFFFF)
+    {
+        shift++;
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> codes(boxCount);
+    for (size_t i = 0; i < boxCount; i++)
+    {
+        const BoundingBox& box = boxes[i];
+        const int32_t centerX = box.Left + (box.Right - box.Left) / 2;
+        const int32_t centerY = box.Top + (box.Bottom - box.Top) / 2;
+
+        codes[i] = {
+            MortonCode(static_cast<uint16_t>(std::max(centerX, 0) >> shift), static_cast<uint16_t>(std::max(centerY, 0) >> shift)),
+            static_cast<uint32_t>(i) };
+    }
+
+    // Stable so boxes sharing a code keep their original order
+    std::stable_sort(codes.begin(), codes.end(),
+        [](const std::pair<uint32_t, uint32_t>& lhs, const std::pair<uint32_t, uint32_t>& rhs)
+        {
+            return lhs.first < rhs.first;
+        });
+
+    std::vector<uint32_t> order(boxCount);
+    for (size_t i = 0; i < boxCount; i++)
+    {
+        order[i] = codes[i].second;
+    }
+
+    return order;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "BitmapView.h"
+#include "PixelConversion.h"
+#include "CompactBoundingBoxes.h"
+#include "WorkStealingThreadPool.h"
+
+// Lamp boxes laid out over a bitmap: EncompassingBox gets stretched over the bitmap,
+// and each box samples the pixels that end up under it.
+struct LampBoxLayout
+{
+    const CompactBoundingBoxes* Boxes;
+
+    // When not null, only the boxes at BoxIndices[0..BoxCount) are sampled, ascending indices
+    // work best. Otherwise every box is.
+    const uint32_t* BoxIndices;
+    size_t BoxCount;
+
+    BoundingBox EncompassingBox;
+};
+
+namespace LampSampling
+{
+    // Averages the pixels of region under every box of layout into colors[i], where i is the
+    // index of the box in layout.Boxes. colors is sized to layout.Boxes, and with BoxIndices
+    // only the colors of those boxes are written. pixelTransform (if not null) is applied to
+    // every pixel as it is decoded, lampTransform (if not null) to every averaged color.
+    // Only the pixels under a box are ever read.
+    // Large layouts are split into shards sampled in parallel on threadPool, when given.
+    void SampleBitmap(
+        const BitmapView& bitmap,
+        const BitmapRegion& region,
+        const LampBoxLayout& layout,
+        _In_opt_ const ColorTransform* pixelTransform,
+        _In_opt_ const ColorTransform* lampTransform,
+        std::vector<LampArrayColor>& colors,
+        _In_opt_ WorkStealingThreadPool* threadPool);
+
+    // Returns the order in which to store boxes so that consecutive boxes are close to each other:
+    // order[i] is the index in boxes of the i-th box along a Morton curve of their centers.
+    // Boxes are expected to be relative to an encompassing box of width x height.
+    std::vector<uint32_t> GetSpatialOrder(
+        const std::vector<BoundingBox>& boxes,
+        int32_t width,
+        int32_t height);
+}
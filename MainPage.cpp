@@ -1,10 +1,18 @@
 ﻿#include "pch.h"
 #include "MainPage.h"
 #include "MainPage.g.cpp"
+#include "KDTreeTuner.h"
+#include "TraceRecorder.h"
 
 using namespace winrt;
 using namespace Windows::UI::Xaml;
 
+// How often the animation thread checks whether the next frame is due.
+const DWORD c_animationPollIntervalInMilliseconds = 5;
+
+// How long the destructor waits for status callbacks already running to return.
+const uint64_t c_lampArrayCallbackUnregisterTimeoutInMicroseconds = 5'000'000;
+
 namespace winrt::LampArrayGDKBitmap::implementation
 {
     MainPage::MainPage()
@@ -12,16 +20,86 @@ namespace winrt::LampArrayGDKBitmap::implementation
         // Xaml objects should not call InitializeComponent during construction.
         // See https://github.com/microsoft/cppwinrt/tree/master/nuget#initializecomponent
 
+        m_initializationCleanupGroup = CreateThreadpoolCleanupGroup();
+        THROW_LAST_ERROR_IF_NULL(m_initializationCleanupGroup);
+
+        InitializeThreadpoolEnvironment(&m_initializationEnvironment);
+        SetThreadpoolCallbackCleanupGroup(
+            &m_initializationEnvironment,
+            m_initializationCleanupGroup,
+            CancelLampArrayInitializationCallback);
+
+        m_framePipeline = std::make_unique<FramePipeline>();
+
+        const std::filesystem::path localFolder(Windows::Storage::ApplicationData::Current().LocalFolder().Path().c_str());
+        m_lampLayouts = std::make_unique<const LampLayoutDirectory>(localFolder / L"LampLayouts");
+
+        const std::filesystem::path searchProfilePath = localFolder / L"KDTreeSearchProfile.bin";
+        const std::filesystem::path animationPath = localFolder / L"Animation.laan";
+
         THROW_IF_FAILED(RegisterLampArrayStatusCallback(
             OnLampArrayStatusChanged,
             LampArrayEnumerationKind::Async,
             this,
             &m_lampArrayCallbackToken));
+
+        // Started last, so the destructor (which joins them) runs whenever they were started. LampArrays
+        // connecting before the profile is ready are searched with the default KDTree::SearchConfig.
+        // Every config breaks ties between equally near Lamps the same way, so a profile only changes
+        // how fast the boxes are found, never which boxes (KDTreeTuner::CheckSearchConfigs checks
+        // this in debug builds).
+        m_searchTuningThread = std::thread([searchProfilePath]()
+        {
+            try
+            {
+                KDTreeTuner::LoadOrTuneProfile(searchProfilePath);
+            }
+            CATCH_LOG();
+        });
+
+        if (std::filesystem::exists(animationPath))
+        {
+            m_animationThread = std::thread([this, animationPath]()
+            {
+                try
+                {
+                    PlayAnimation(animationPath);
+                }
+                CATCH_LOG();
+            });
+        }
     }
 
     MainPage::~MainPage()
     {
-        UnregisterLampArrayCallback(m_lampArrayCallbackToken, 0);
+        UnregisterLampArrayCallback(m_lampArrayCallbackToken, c_lampArrayCallbackUnregisterTimeoutInMicroseconds);
+
+        // Should a status callback outlast the wait, it finds m_isTearingDown set once it gets the
+        // lock, and leaves the pipeline and the cleanup group alone
+        {
+            auto lock = m_lampArraysLock.lock_exclusive();
+            m_isTearingDown = true;
+        }
+
+        // Stop publishing before the pipeline goes away
+        m_stopAnimation.SetEvent();
+        if (m_animationThread.joinable())
+        {
+            m_animationThread.join();
+        }
+        m_framePipeline.reset();
+
+        // No more status changes can come in, so stop any initialization still in flight
+        for (const auto& lampArrayContext : *std::atomic_load(&m_lampArrays))
+        {
+            lampArrayContext->Cancel();
+        }
+
+        CloseThreadpoolCleanupGroupMembers(m_initializationCleanupGroup, TRUE, nullptr);
+        CloseThreadpoolCleanupGroup(m_initializationCleanupGroup);
+        DestroyThreadpoolEnvironment(&m_initializationEnvironment);
+
+        m_searchTuningThread.join();
     }
 
     int32_t MainPage::MyProperty()
@@ -36,7 +114,47 @@ namespace winrt::LampArrayGDKBitmap::implementation
 
     void MainPage::ClickHandler(IInspectable const&, RoutedEventArgs const&)
     {
-        myButton().Content(box_value(L"Clicked"));
+        // Toggles recording a session trace, to be replayed with LampArrayTools
+        if (std::atomic_load(&m_sessionRecording))
+        {
+            StopSessionRecording();
+            myButton().Content(box_value(L"Record session"));
+        }
+        else
+        {
+            std::filesystem::path sessionTracePath(Windows::Storage::ApplicationData::Current().LocalFolder().Path().c_str());
+            sessionTracePath /= L"Session.lasr";
+
+            StartSessionRecording(sessionTracePath);
+            myButton().Content(box_value(L"Stop recording"));
+        }
+    }
+
+    void MainPage::StartSessionRecording(const std::filesystem::path& path)
+    {
+        auto sessionRecording = std::make_shared<SessionTraceWriter>(path);
+
+        // LampArrays already connected start the recording. Taking the lock keeps status changes
+        // from slipping in between these records and the writer being published. A helper that
+        // becomes Ready meanwhile may be recorded by InitializeLampArrayCallback too, the writer
+        // only keeps the first record.
+        auto lock = m_lampArraysLock.lock_exclusive();
+        for (const auto& lampArrayContext : *std::atomic_load(&m_lampArrays))
+        {
+            if (lampArrayContext->GetState() == LampArrayBitmapHelperState::Ready)
+            {
+                sessionRecording->WriteDeviceConnected(
+                    reinterpret_cast<uintptr_t>(lampArrayContext->GetLampArray()),
+                    lampArrayContext->GetDescription());
+            }
+        }
+
+        std::atomic_store(&m_sessionRecording, std::move(sessionRecording));
+    }
+
+    void MainPage::StopSessionRecording()
+    {
+        std::atomic_store(&m_sessionRecording, std::shared_ptr<SessionTraceWriter>());
     }
 
     void MainPage::OnLampArrayStatusChanged(
@@ -45,6 +163,8 @@ namespace winrt::LampArrayGDKBitmap::implementation
         LampArrayStatus previousStatus,
         _In_ ILampArray* lampArray)
     {
+        TRACE_SCOPE("OnLampArrayStatusChanged");
+
         auto mainPage = reinterpret_cast<MainPage*>(context);
         
         bool wasConnected = (previousStatus & LampArrayStatus::Connected) == LampArrayStatus::Connected;
@@ -52,48 +172,201 @@ namespace winrt::LampArrayGDKBitmap::implementation
 
         if (wasConnected != isConnected)
         {
-            auto lock = mainPage->m_lampArraysLock.lock_exclusive();
-            auto& lampArrays = mainPage->m_lampArrays;
+            auto isSameLampArray = [&](const std::shared_ptr<LampArrayBitmapHelper>& ptr)
+            {
+                return lampArray == ptr->GetLampArray();
+            };
 
-            if (isConnected)
+            // Traced separately, so time spent waiting on other status changes shows on the timeline
+            auto lockLampArrays = [&]()
             {
-                auto iter = std::find_if(lampArrays.begin(), lampArrays.end(),
-                    [&](const std::unique_ptr<LampArrayBitmapHelper>& ptr)
-                    {
-                        return lampArray == ptr->GetLampArray();
-                    });
+                TRACE_SCOPE("Wait for m_lampArraysLock");
+                return mainPage->m_lampArraysLock.lock_exclusive();
+            };
 
-                if (iter == lampArrays.end())
+            if (isConnected)
+            {
+                auto lock = lockLampArrays();
+                if (mainPage->m_isTearingDown)
                 {
-                    auto bitmapHelper = std::make_unique<LampArrayBitmapHelper>(lampArray);
-                    bitmapHelper->Initialize();
+                    return;
+                }
 
-                    lampArrays.push_back(std::move(bitmapHelper));
+                const auto lampArrays = std::atomic_load(&mainPage->m_lampArrays);
 
-                    auto redColor = LampArrayColor{ 0xFF, 0, 0, 0xFF };
-                    lampArray->SetColor(redColor);
+                if (std::any_of(lampArrays->begin(), lampArrays->end(), isSameLampArray))
+                {
+                    return;
                 }
+
+                // The helper is published as Pending right away, the frame path shows a solid color
+                // on it until InitializeLampArrayCallback has made it Ready.
+                auto bitmapHelper = std::make_shared<LampArrayBitmapHelper>(lampArray);
+
+                auto redColor = LampArrayColor{ 0xFF, 0, 0, 0xFF };
+                lampArray->SetColor(redColor);
+
+                auto initializationContext = std::make_unique<LampArrayInitialization>(LampArrayInitialization{ mainPage, bitmapHelper });
+                THROW_IF_WIN32_BOOL_FALSE(TrySubmitThreadpoolCallback(
+                    InitializeLampArrayCallback,
+                    initializationContext.get(),
+                    &mainPage->m_initializationEnvironment));
+
+                // Now owned by the callback, or by the cleanup group if it gets cancelled
+                initializationContext.release();
+
+                auto newLampArrays = std::make_shared<LampArraySnapshot>(*lampArrays);
+                newLampArrays->push_back(std::move(bitmapHelper));
+
+                mainPage->PublishLampArrays(std::move(newLampArrays));
             }
             else
             {
-                lampArrays.erase(
-                    std::remove_if(lampArrays.begin(), lampArrays.end(), 
-                        [&](const std::unique_ptr<LampArrayBitmapHelper>& ptr)
-                        {
-                            return lampArray == ptr->GetLampArray();
-                        }),
-                    lampArrays.end());
+                auto lock = lockLampArrays();
+                if (mainPage->m_isTearingDown)
+                {
+                    return;
+                }
+
+                const auto lampArrays = std::atomic_load(&mainPage->m_lampArrays);
+
+                // If it is still initializing, stop wasting a worker on it
+                for (const auto& lampArrayContext : *lampArrays)
+                {
+                    if (isSameLampArray(lampArrayContext))
+                    {
+                        lampArrayContext->Cancel();
+                    }
+                }
+
+                auto newLampArrays = std::make_shared<LampArraySnapshot>(*lampArrays);
+                newLampArrays->erase(
+                    std::remove_if(newLampArrays->begin(), newLampArrays->end(), isSameLampArray),
+                    newLampArrays->end());
+
+                // A frame still holding the old snapshot keeps its helpers alive until it is done
+                mainPage->PublishLampArrays(std::move(newLampArrays));
+
+                if (auto sessionRecording = std::atomic_load(&mainPage->m_sessionRecording))
+                {
+                    try
+                    {
+                        sessionRecording->WriteDeviceDisconnected(reinterpret_cast<uintptr_t>(lampArray));
+                    }
+                    CATCH_LOG();
+                }
             }
         }
     }
 
-    void MainPage::DisplayBitmapOnLampArrays()
+    void MainPage::PublishLampArrays(std::shared_ptr<const LampArraySnapshot> lampArrays)
     {
-        auto lock = m_lampArraysLock.lock_exclusive();
+        std::atomic_store(&m_lampArrays, lampArrays);
+        m_framePipeline->SetLampArrays(std::move(lampArrays));
+    }
+
+    void CALLBACK MainPage::InitializeLampArrayCallback(
+        _Inout_ PTP_CALLBACK_INSTANCE,
+        _In_ void* context)
+    {
+        std::unique_ptr<LampArrayInitialization> initialization(static_cast<LampArrayInitialization*>(context));
+        const auto& bitmapHelper = initialization->bitmapHelper;
+
+        // The helper records the failure in its state, there is nobody else to report it to
+        try
+        {
+            bitmapHelper->Initialize(initialization->mainPage->m_lampLayouts.get());
+        }
+        CATCH_LOG();
 
-        for (const auto& lampArrayContext : m_lampArrays)
+        if (bitmapHelper->GetState() != LampArrayBitmapHelperState::Ready)
         {
-            auto lampArray = lampArrayContext->GetLampArray();
+            return;
         }
+
+        // Recorded once Ready, a replay gets its layout from the record. Under the lock, so it can't
+        // land after the LampArray was recorded disconnecting, and only if it hasn't disconnected.
+        MainPage* mainPage = initialization->mainPage;
+        auto lock = mainPage->m_lampArraysLock.lock_exclusive();
+
+        auto sessionRecording = std::atomic_load(&mainPage->m_sessionRecording);
+        const auto lampArrays = std::atomic_load(&mainPage->m_lampArrays);
+        if (sessionRecording && (std::find(lampArrays->begin(), lampArrays->end(), bitmapHelper) != lampArrays->end()))
+        {
+            try
+            {
+                sessionRecording->WriteDeviceConnected(
+                    reinterpret_cast<uintptr_t>(bitmapHelper->GetLampArray()),
+                    bitmapHelper->GetDescription());
+            }
+            CATCH_LOG();
+        }
+    }
+
+    void CALLBACK MainPage::CancelLampArrayInitializationCallback(
+        _In_ void* objectContext,
+        _In_opt_ void*)
+    {
+        // Initialization never started, just release the helper
+        delete static_cast<LampArrayInitialization*>(objectContext);
+    }
+
+    void MainPage::DisplayBitmapOnLampArrays(const BitmapView& bitmap, std::shared_ptr<const void> owner)
+    {
+        if (auto sessionRecording = std::atomic_load(&m_sessionRecording))
+        {
+            try
+            {
+                sessionRecording->WriteFrame(bitmap);
+            }
+            CATCH_LOG();
+        }
+
+        // Each helper only reads the rows and columns under its Lamps, straight from the caller's frame
+        m_framePipeline->PublishSharedFrame(bitmap, std::move(owner));
+    }
+
+    void MainPage::DisplayAnimationOnLampArrays(BitmapAnimationSource& animation, std::chrono::microseconds time)
+    {
+        const uint32_t frameIndex = animation.GetFrameIndex(time);
+
+        // Recorded from the frame being published, an encoded frame is only decoded once
+        BitmapAnimationSource::FrameObserver recordFrame;
+        if (auto sessionRecording = std::atomic_load(&m_sessionRecording))
+        {
+            recordFrame = [sessionRecording](const BitmapView& bitmap)
+            {
+                try
+                {
+                    sessionRecording->WriteFrame(bitmap);
+                }
+                CATCH_LOG();
+            };
+        }
+
+        // Frames are sampled straight from the file's mapping
+        animation.PublishFrame(frameIndex, *m_framePipeline, false, recordFrame);
+    }
+
+    void MainPage::PlayAnimation(const std::filesystem::path& path)
+    {
+        BitmapAnimationSource animation(path);
+        const std::chrono::microseconds duration = animation.GetDuration();
+        const auto startTime = std::chrono::steady_clock::now();
+
+        // Only publishes when the frame showing changes, the LampArrays keep showing the last one
+        uint32_t shownFrameIndex = animation.GetFrameCount();
+        do
+        {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+            const std::chrono::microseconds time = (duration.count() > 0) ? elapsed % duration : std::chrono::microseconds(0);
+
+            const uint32_t frameIndex = animation.GetFrameIndex(time);
+            if (frameIndex != shownFrameIndex)
+            {
+                DisplayAnimationOnLampArrays(animation, time);
+                shownFrameIndex = frameIndex;
+            }
+        } while (!m_stopAnimation.wait(c_animationPollIntervalInMilliseconds));
     }
 }
@@ -2,6 +2,10 @@
 
 #include "MainPage.g.h"
 #include "LampArrayBitmapHelper.h"
+#include "FramePipeline.h"
+#include "SessionTrace.h"
+#include "BitmapAnimation.h"
+#include "LampLayoutFile.h"
 
 namespace winrt::LampArrayGDKBitmap::implementation
 {
@@ -15,8 +19,29 @@ namespace winrt::LampArrayGDKBitmap::implementation
 
         void ClickHandler(Windows::Foundation::IInspectable const& sender, Windows::UI::Xaml::RoutedEventArgs const& args);
 
+        // Records the LampArrays and frames from now on into a session trace at path, replacing any
+        // recording already running, so SessionReplay can play it back later.
+        void StartSessionRecording(const std::filesystem::path& path);
+        void StopSessionRecording();
+
     private:
-        void DisplayBitmapOnLampArrays();
+        struct LampArrayInitialization
+        {
+            MainPage* mainPage;
+            std::shared_ptr<LampArrayBitmapHelper> bitmapHelper;
+        };
+
+        // bitmap is sampled in place, without a copy: owner has to keep it alive and unchanged until
+        // the pipeline lets go of it, e.g. by owning the buffer the next frame isn't rendered into.
+        void DisplayBitmapOnLampArrays(const BitmapView& bitmap, std::shared_ptr<const void> owner);
+        void DisplayAnimationOnLampArrays(BitmapAnimationSource& animation, std::chrono::microseconds time);
+
+        // Loops the animation at path on the LampArrays until m_stopAnimation is set. Runs on
+        // m_animationThread, the only thread publishing frames.
+        void PlayAnimation(const std::filesystem::path& path);
+
+        // Makes lampArrays the current list, for the frame pipeline too. Called with m_lampArraysLock held.
+        void PublishLampArrays(std::shared_ptr<const LampArraySnapshot> lampArrays);
 
         static void OnLampArrayStatusChanged(
             _In_opt_ void* context,
@@ -24,8 +49,49 @@ namespace winrt::LampArrayGDKBitmap::implementation
             LampArrayStatus previousStatus,
             _In_ ILampArray* lampArray);
 
+        static void CALLBACK InitializeLampArrayCallback(
+            _Inout_ PTP_CALLBACK_INSTANCE instance,
+            _In_ void* context);
+
+        static void CALLBACK CancelLampArrayInitializationCallback(
+            _In_ void* objectContext,
+            _In_opt_ void* cleanupContext);
+
+        // Immutable list of the connected LampArrays, published RCU style: the frame path grabs the
+        // current snapshot without taking any lock, while status changes build a modified copy and
+        // swap it in. Only ever read and written through std::atomic_load/std::atomic_store.
+        std::shared_ptr<const LampArraySnapshot> m_lampArrays = std::make_shared<const LampArraySnapshot>();
+
+        // Serializes the writers of m_lampArrays, readers never take it.
         wil::srwlock m_lampArraysLock;
-        _Guarded_by_(m_lampArraysLock) std::vector<std::unique_ptr<LampArrayBitmapHelper>> m_lampArrays;
+
+        // Set by the destructor before the frame pipeline and the cleanup group go away. Guarded by
+        // m_lampArraysLock, status changes do nothing once it is set.
+        bool m_isTearingDown = false;
+
+        // Helpers initialize on the thread pool so that many LampArrays connecting at once (e.g. at boot)
+        // initialize in parallel, off the status callback. The cleanup group lets the destructor cancel
+        // the initializations that haven't started and wait for the running ones.
+        TP_CALLBACK_ENVIRON m_initializationEnvironment{};
+        PTP_CLEANUP_GROUP m_initializationCleanupGroup{};
+
+        // Layouts compiled with LampArrayTools for models too large to set up on every connect, in
+        // the LampLayouts folder of the app's local folder. Loaded before any LampArray connects.
+        std::unique_ptr<const LampLayoutDirectory> m_lampLayouts;
+
+        // Samples published frames and sends them to every LampArray at its own update rate.
+        std::unique_ptr<FramePipeline> m_framePipeline;
+
+        // Null unless recording. Only ever read and written through std::atomic_load/std::atomic_store,
+        // a callback still writing to the old writer keeps it alive until it is done.
+        std::shared_ptr<SessionTraceWriter> m_sessionRecording;
+
+        // Loads the KDTreeTuner profile at startup, or tunes and saves one on a new machine.
+        std::thread m_searchTuningThread;
+
+        // Plays Animation.laan from the app's local folder, when there is one.
+        wil::unique_event m_stopAnimation{ wil::EventOptions::ManualReset };
+        std::thread m_animationThread;
 
         LampArrayCallbackToken m_lampArrayCallbackToken{};
     };
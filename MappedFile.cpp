@@ -0,0 +1,82 @@
+#include "pch.h"
+#include "MappedFile.h"
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+    CREATEFILE2_EXTENDED_PARAMETERS parameters{ sizeof(parameters) };
+    parameters.dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+
+    m_file.reset(CreateFile2(path.c_str(), GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, &parameters));
+    THROW_LAST_ERROR_IF(!m_file);
+
+    LARGE_INTEGER size{};
+    THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(m_file.get(), &size));
+    m_size = static_cast<uint64_t>(size.QuadPart);
+
+    Map(PAGE_READONLY, FILE_MAP_READ);
+}
+
+MappedFile::MappedFile(const std::filesystem::path& path, uint64_t size) :
+    m_size(size)
+{
+    CREATEFILE2_EXTENDED_PARAMETERS parameters{ sizeof(parameters) };
+    parameters.dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+
+    m_file.reset(CreateFile2(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, CREATE_ALWAYS, &parameters));
+    THROW_LAST_ERROR_IF(!m_file);
+
+    // Mapping a new file grows it to size, filled with zeros
+    Map(PAGE_READWRITE, FILE_MAP_READ | FILE_MAP_WRITE);
+}
+
+void MappedFile::Map(DWORD protection, DWORD access)
+{
+    // Empty files can't be mapped, and there is nothing to map anyway
+    if (m_size == 0)
+    {
+        return;
+    }
+
+    // Views are only limited by the address space
+    THROW_HR_IF(E_OUTOFMEMORY, m_size > std::numeric_limits<size_t>::max());
+
+    m_mapping.reset(CreateFileMappingFromApp(m_file.get(), nullptr, protection, m_size, nullptr));
+    THROW_LAST_ERROR_IF_NULL(m_mapping.get());
+
+    m_view.reset(static_cast<uint8_t*>(MapViewOfFileFromApp(m_mapping.get(), access, 0, static_cast<size_t>(m_size))));
+    THROW_LAST_ERROR_IF_NULL(m_view.get());
+}
+
+bool MappedFile::ClampRange(uint64_t offset, uint64_t& size) const noexcept
+{
+    if (offset >= m_size)
+    {
+        return false;
+    }
+
+    size = std::min(size, m_size - offset);
+    return size != 0;
+}
+
+void MappedFile::Prefetch(uint64_t offset, uint64_t size) const noexcept
+{
+    if (!ClampRange(offset, size))
+    {
+        return;
+    }
+
+    WIN32_MEMORY_RANGE_ENTRY range{ const_cast<uint8_t*>(m_view.get()) + offset, static_cast<size_t>(size) };
+    (void)PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+void MappedFile::Evict(uint64_t offset, uint64_t size) const noexcept
+{
+    if (!ClampRange(offset, size))
+    {
+        return;
+    }
+
+    // Unlocking pages that aren't locked removes them from the working set (and fails with
+    // ERROR_NOT_LOCKED), the documented way to trim part of a view
+    (void)VirtualUnlock(const_cast<uint8_t*>(m_view.get()) + offset, static_cast<size_t>(size));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// A whole file mapped into memory, for data that is used in place rather than read and parsed.
+// Pages are only read from disk when touched and can be dropped again under memory pressure,
+// so mapping a file much larger than RAM is fine as long as it is walked through in order.
+struct MappedFile
+{
+public:
+    // Maps an existing file read-only. Throws if it can't be opened or mapped.
+    explicit MappedFile(const std::filesystem::path& path);
+
+    // Creates or overwrites the file at path with size bytes (zeroed) and maps it read-write.
+    MappedFile(const std::filesystem::path& path, uint64_t size);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // nullptr for an empty file.
+    const uint8_t* GetData() const { return m_view.get(); }
+    uint8_t* GetWritableData() { return m_view.get(); }
+    uint64_t GetSize() const { return m_size; }
+
+    // Hints for files played through in order, failures are ignored. Prefetch reads the pages
+    // of [offset, offset + size) from disk in one go before they are touched, Evict drops them
+    // from the working set once they won't be touched again soon. Evicted pages stay valid and
+    // are read back in (usually from the standby list) if they are.
+    void Prefetch(uint64_t offset, uint64_t size) const noexcept;
+    void Evict(uint64_t offset, uint64_t size) const noexcept;
+
+private:
+    void Map(DWORD protection, DWORD access);
+
+    // Clamps [offset, offset + size) to the file, returns false if nothing is left.
+    bool ClampRange(uint64_t offset, uint64_t& size) const noexcept;
+
+    wil::unique_hfile m_file;
+    wil::unique_handle m_mapping;
+    wil::unique_mapview_ptr<uint8_t> m_view;
+    uint64_t m_size{};
+};
@@ -0,0 +1,232 @@
+#include "pch.h"
+#include "PerformanceMetrics.h"
+
+const size_t c_stageCount = static_cast<size_t>(PerformanceStage::Count);
+const size_t c_counterCount = static_cast<size_t>(PerformanceCounter::Count);
+
+// Same order as the enums, used as the JSON keys
+static const char* const c_stageNames[c_stageCount] = {
+    "Initialize",
+    "KDTreeBuild",
+    "NearestNeighborPass",
+    "ExpansionPass",
+    "Sampling",
+    "Submission",
+};
+
+static const char* const c_counterNames[c_counterCount] = {
+    "KDTreeQueries",
+    "KDTreeNodesVisited",
+    "KDTreeLeavesScanned",
+    "KDTreePointsScanned",
+    "LampsSampled",
+    "LampsSubmitted",
+};
+
+#if defined(LAMPARRAY_ENABLE_METRICS)
+
+// One per thread, on its own cache lines. Only the owning thread writes, so a relaxed load and
+// store (plain moves) is enough; snapshots may read a value that is a moment old.
+struct alignas(64) ThreadMetrics
+{
+    std::atomic<uint64_t> counters[c_counterCount];
+    std::atomic<uint64_t> totalNanoseconds[c_stageCount];
+    std::atomic<uint64_t> buckets[c_stageCount][PerformanceMetrics::c_histogramBucketCount];
+};
+
+struct MetricsRegistry
+{
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+    std::vector<ThreadMetrics*> freeThreads; // Blocks of threads that exited, reused by new threads
+};
+
+// Never destroyed, threads may still be counting while the process shuts down. The blocks of
+// threads that exited are kept, so their counts stay in the totals, and handed to new threads,
+// which keep adding to them. There are never more blocks than threads alive at the same time.
+static MetricsRegistry& GetRegistry()
+{
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return *registry;
+}
+
+// Hands the thread's block back to the registry when the thread exits.
+struct ThreadMetricsLease
+{
+public:
+    ~ThreadMetricsLease()
+    {
+        if (metrics != nullptr)
+        {
+            MetricsRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.lock);
+            try
+            {
+                registry.freeThreads.push_back(metrics);
+            }
+            catch (...)
+            {
+                // Out of memory, the block is just never reused
+            }
+            metrics = nullptr;
+        }
+    }
+
+    ThreadMetrics* metrics;
+};
+
+static ThreadMetrics* GetThreadMetrics() noexcept
+{
+    thread_local ThreadMetricsLease lease{};
+
+    if (lease.metrics == nullptr)
+    {
+        try
+        {
+            MetricsRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.lock);
+
+            // The lock orders the previous owner's last counts before the new owner's first ones
+            if (!registry.freeThreads.empty())
+            {
+                lease.metrics = registry.freeThreads.back();
+                registry.freeThreads.pop_back();
+            }
+            else
+            {
+                registry.threads.push_back(std::make_unique<ThreadMetrics>());
+                lease.metrics = registry.threads.back().get();
+            }
+        }
+        catch (...)
+        {
+            // Out of memory, this thread just isn't counted
+        }
+    }
+
+    return lease.metrics;
+}
+
+static void Increment(std::atomic<uint64_t>& value, uint64_t amount) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void PerformanceMetrics::Add(PerformanceCounter counter, uint64_t value) noexcept
+{
+    if (ThreadMetrics* metrics = GetThreadMetrics())
+    {
+        Increment(metrics->counters[static_cast<size_t>(counter)], value);
+    }
+}
+
+void PerformanceMetrics::Record(PerformanceStage stage, std::chrono::steady_clock::duration duration) noexcept
+{
+    ThreadMetrics* metrics = GetThreadMetrics();
+    if (metrics == nullptr)
+    {
+        return;
+    }
+
+    const uint64_t nanoseconds = static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0));
+    const uint64_t microseconds = nanoseconds / 1000;
+
+    uint32_t bucket = 0;
+    while ((bucket + 1 < c_histogramBucketCount) && ((microseconds >> bucket) != 0))
+    {
+        bucket++;
+    }
+
+    Increment(metrics->totalNanoseconds[static_cast<size_t>(stage)], nanoseconds);
+    Increment(metrics->buckets[static_cast<size_t>(stage)][bucket], 1);
+}
+
+PerformanceMetrics::Snapshot PerformanceMetrics::GetSnapshot()
+{
+    Snapshot snapshot{};
+
+    MetricsRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+
+    for (const auto& metrics : registry.threads)
+    {
+        for (size_t i = 0; i < c_counterCount; i++)
+        {
+            snapshot.counters[i] += metrics->counters[i].load(std::memory_order_relaxed);
+        }
+
+        for (size_t i = 0; i < c_stageCount; i++)
+        {
+            StageSnapshot& stage = snapshot.stages[i];
+            stage.totalMicroseconds += metrics->totalNanoseconds[i].load(std::memory_order_relaxed) / 1000;
+
+            for (uint32_t bucket = 0; bucket < c_histogramBucketCount; bucket++)
+            {
+                const uint64_t count = metrics->buckets[i][bucket].load(std::memory_order_relaxed);
+                stage.buckets[bucket] += count;
+                stage.count += count;
+            }
+        }
+    }
+
+    return snapshot;
+}
+
+#else
+
+void PerformanceMetrics::Add(PerformanceCounter, uint64_t) noexcept
+{
+}
+
+void PerformanceMetrics::Record(PerformanceStage, std::chrono::steady_clock::duration) noexcept
+{
+}
+
+PerformanceMetrics::Snapshot PerformanceMetrics::GetSnapshot()
+{
+    return Snapshot{};
+}
+
+#endif
+
+std::string PerformanceMetrics::ToJson(const Snapshot& snapshot)
+{
+    std::string json = IsEnabled() ? "{\"enabled\":true,\"counters\":{" : "{\"enabled\":false,\"counters\":{";
+
+    for (size_t i = 0; i < c_counterCount; i++)
+    {
+        json += (i == 0) ? "\"" : ",\"";
+        json += c_counterNames[i];
+        json += "\":";
+        json += std::to_string(snapshot.counters[i]);
+    }
+
+    json += "},\"stages\":{";
+
+    for (size_t i = 0; i < c_stageCount; i++)
+    {
+        const StageSnapshot& stage = snapshot.stages[i];
+
+        json += (i == 0) ? "\"" : ",\"";
+        json += c_stageNames[i];
+        json += "\":{\"count\":";
+        json += std::to_string(stage.count);
+        json += ",\"totalMicroseconds\":";
+        json += std::to_string(stage.totalMicroseconds);
+        json += ",\"buckets\":[";
+
+        for (uint32_t bucket = 0; bucket < c_histogramBucketCount; bucket++)
+        {
+            if (bucket != 0)
+            {
+                json += ",";
+            }
+            json += std::to_string(stage.buckets[bucket]);
+        }
+
+        json += "]}";
+    }
+
+    json += "}}";
+    return json;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+// Counters and latency histograms for the hot paths. Define LAMPARRAY_ENABLE_METRICS (e.g. in the
+// project's preprocessor definitions) to build them in; without it the METRICS_* macros expand to
+// nothing and GetSnapshot returns zeros.
+//
+// Every thread counts into its own block, with plain loads and stores instead of locked
+// instructions, and snapshots add the blocks up. Timing a stage costs two clock reads.
+
+enum class PerformanceStage : uint32_t
+{
+    Initialize, // LampArrayBitmapHelper::Initialize, including querying every Lamp
+    KDTreeBuild,
+    NearestNeighborPass, // First pass of GenerateAllBoundingBoxes
+    ExpansionPass, // Second pass of GenerateAllBoundingBoxes
+    Sampling, // One LampSampling::SampleBitmap call
+    Submission, // One LampColorSubmitter::Submit call, including the device write
+    Count,
+};
+
+enum class PerformanceCounter : uint32_t
+{
+    KDTreeQueries,
+    KDTreeNodesVisited, // Medians compared against during queries
+    KDTreeLeavesScanned, // Small ranges searched linearly
+    KDTreePointsScanned, // Points compared within those ranges
+    LampsSampled,
+    LampsSubmitted, // Lamps actually sent to a device, after skipping unchanged ones
+    Count,
+};
+
+namespace PerformanceMetrics
+{
+    // Bucket 0 counts durations under 1us, bucket i those in [2^(i-1), 2^i) us, and the last
+    // bucket everything longer (from about 0.26s).
+    constexpr uint32_t c_histogramBucketCount = 20;
+
+    struct StageSnapshot
+    {
+        uint64_t count;
+        uint64_t totalMicroseconds;
+        uint64_t buckets[c_histogramBucketCount];
+    };
+
+    struct Snapshot
+    {
+        uint64_t counters[static_cast<size_t>(PerformanceCounter::Count)];
+        StageSnapshot stages[static_cast<size_t>(PerformanceStage::Count)];
+    };
+
+    constexpr bool IsEnabled() noexcept
+    {
+#if defined(LAMPARRAY_ENABLE_METRICS)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Totals since the process started, over every thread. Diff two snapshots for an interval.
+    Snapshot GetSnapshot();
+
+    // e.g. {"enabled":true,"counters":{"KDTreeQueries":12,...},"stages":{"Sampling":{"count":3,
+    // "totalMicroseconds":150,"buckets":[0,0,...]},...}}
+    std::string ToJson(const Snapshot& snapshot);
+
+    // Hot path, use the macros below rather than calling these directly.
+    void Add(PerformanceCounter counter, uint64_t value) noexcept;
+    void Record(PerformanceStage stage, std::chrono::steady_clock::duration duration) noexcept;
+
+    struct ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(PerformanceStage stage) noexcept : m_stage(stage), m_start(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer() { Record(m_stage, std::chrono::steady_clock::now() - m_start); }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        PerformanceStage m_stage;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    // Times consecutive stages of one function without adding a scope around each of them.
+    struct LapTimer
+    {
+    public:
+        LapTimer() noexcept : m_start(std::chrono::steady_clock::now()) {}
+
+        // Records the time since the previous lap (or construction) as stage.
+        void Lap(PerformanceStage stage) noexcept
+        {
+            const auto now = std::chrono::steady_clock::now();
+            Record(stage, now - m_start);
+            m_start = now;
+        }
+
+    private:
+        std::chrono::steady_clock::time_point m_start;
+    };
+}
+
+#if defined(LAMPARRAY_ENABLE_METRICS)
+// Times the rest of the enclosing scope as the given PerformanceStage.
+#define METRICS_TIME_SCOPE(stage) PerformanceMetrics::ScopedTimer metricsTimer_##stage(PerformanceStage::stage)
+#define METRICS_START_LAPS(timer) PerformanceMetrics::LapTimer timer
+#define METRICS_LAP(timer, stage) timer.Lap(PerformanceStage::stage)
+#define METRICS_ADD(counter, value) PerformanceMetrics::Add(PerformanceCounter::counter, (value))
+// For locals that only exist to feed METRICS_ADD, e.g. counts kept in a loop and added once.
+#define METRICS_ONLY(statement) statement
+#else
+#define METRICS_TIME_SCOPE(stage)
+#define METRICS_START_LAPS(timer)
+#define METRICS_LAP(timer, stage)
+#define METRICS_ADD(counter, value)
+#define METRICS_ONLY(statement)
+#endif
@@ -0,0 +1,395 @@
+#include "pch.h"
+#include "PixelConversion.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#define PIXELCONVERSION_X86
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define PIXELCONVERSION_NEON
+#endif
+
+using DecodeFunction = void (*)(const uint8_t* source, uint32_t count, LampArrayColor* destination);
+
+static uint8_t UnitFloatToByte(float value) noexcept
+{
+    // Written so that NaN ends up as 0
+    const float clamped = (value > 0.0f) ? ((value < 1.0f) ? value : 1.0f) : 0.0f;
+    return static_cast<uint8_t>(clamped * 255.0f + 0.5f);
+}
+
+static float HalfToFloat(uint16_t half) noexcept
+{
+    const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0x1F)
+    {
+        // Infinity or NaN
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if (exponent != 0)
+    {
+        bits = sign | ((exponent + (127 - 15)) << 23) | (mantissa << 13);
+    }
+    else if (mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // Subnormal, renormalize it
+        exponent = 127 - 15 + 1;
+        while ((mantissa & 0x400) == 0)
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+static uint8_t ClampToByte(int32_t value) noexcept
+{
+    return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+}
+
+static void DecodeBgra8Scalar(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        destination[i] = LampArrayColor{ source[2], source[1], source[0], source[3] };
+        source += 4;
+    }
+}
+
+static void DecodeRgb565Scalar(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t pixel;
+        memcpy(&pixel, source + i * 2, sizeof(pixel));
+
+        // Replicate the high bits into the low bits so 0x1F maps to 0xFF
+        const uint32_t r = pixel >> 11;
+        const uint32_t g = (pixel >> 5) & 0x3F;
+        const uint32_t b = pixel & 0x1F;
+        destination[i] = LampArrayColor{
+            static_cast<uint8_t>((r << 3) | (r >> 2)),
+            static_cast<uint8_t>((g << 2) | (g >> 4)),
+            static_cast<uint8_t>((b << 3) | (b >> 2)),
+            0xFF };
+    }
+}
+
+static void DecodeRgba16fScalar(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t pixel[4];
+        memcpy(pixel, source + i * 8, sizeof(pixel));
+
+        destination[i] = LampArrayColor{
+            UnitFloatToByte(HalfToFloat(pixel[0])),
+            UnitFloatToByte(HalfToFloat(pixel[1])),
+            UnitFloatToByte(HalfToFloat(pixel[2])),
+            UnitFloatToByte(HalfToFloat(pixel[3])) };
+    }
+}
+
+#if defined(PIXELCONVERSION_X86)
+
+static void DecodeBgra8Sse2(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    const __m128i alphaGreenMask = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+    const __m128i redBlueMask = _mm_set1_epi32(0x00FF00FF);
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 4));
+
+        // Swap the 16-bit halves of each pixel's red/blue bytes
+        __m128i redBlue = _mm_and_si128(pixels, redBlueMask);
+        redBlue = _mm_shufflehi_epi16(_mm_shufflelo_epi16(redBlue, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+
+        const __m128i result = _mm_or_si128(_mm_and_si128(pixels, alphaGreenMask), redBlue);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), result);
+    }
+
+    DecodeBgra8Scalar(source + i * 4, count - i, destination + i);
+}
+
+static void DecodeBgra8Avx2(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i * 4));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), _mm256_shuffle_epi8(pixels, shuffle));
+    }
+
+    DecodeBgra8Sse2(source + i * 4, count - i, destination + i);
+}
+
+static void DecodeRgb565Sse2(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    const __m128i greenMask = _mm_set1_epi16(0x3F);
+    const __m128i blueMask = _mm_set1_epi16(0x1F);
+    const __m128i opaqueAlpha = _mm_set1_epi16(static_cast<short>(0xFF00));
+
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+
+        __m128i r = _mm_srli_epi16(pixels, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(pixels, 5), greenMask);
+        __m128i b = _mm_and_si128(pixels, blueMask);
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+        // Interleave the 16-bit (r, g) and (b, a) pairs into 4 byte pixels
+        const __m128i redGreen = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        const __m128i blueAlpha = _mm_or_si128(b, opaqueAlpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_unpacklo_epi16(redGreen, blueAlpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 4), _mm_unpackhi_epi16(redGreen, blueAlpha));
+    }
+
+    DecodeRgb565Scalar(source + i * 2, count - i, destination + i);
+}
+
+static __m128i HalfPixelToInt32(const uint8_t* source) noexcept
+{
+    const __m128 scale = _mm_set1_ps(255.0f);
+
+    // max/min return their second operand for NaN, so NaN ends up as 0
+    __m128 value = _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source)));
+    value = _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvtps_epi32(_mm_mul_ps(value, scale));
+}
+
+static void DecodeRgba16fF16c(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint8_t* pixel = source + i * 8;
+        const __m128i first = _mm_packs_epi32(HalfPixelToInt32(pixel), HalfPixelToInt32(pixel + 8));
+        const __m128i second = _mm_packs_epi32(HalfPixelToInt32(pixel + 16), HalfPixelToInt32(pixel + 24));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(first, second));
+    }
+
+    DecodeRgba16fScalar(source + i * 8, count - i, destination + i);
+}
+
+#elif defined(PIXELCONVERSION_NEON)
+
+static void DecodeBgra8Neon(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16x4_t pixels = vld4q_u8(source + i * 4);
+        const uint8x16_t blue = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = blue;
+        vst4q_u8(reinterpret_cast<uint8_t*>(destination + i), pixels);
+    }
+
+    DecodeBgra8Scalar(source + i * 4, count - i, destination + i);
+}
+
+static void DecodeRgb565Neon(const uint8_t* source, uint32_t count, LampArrayColor* destination) noexcept
+{
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const uint16x8_t pixels = vld1q_u16(reinterpret_cast<const uint16_t*>(source + i * 2));
+
+        const uint16x8_t r = vshrq_n_u16(pixels, 11);
+        const uint16x8_t g = vandq_u16(vshrq_n_u16(pixels, 5), vdupq_n_u16(0x3F));
+        const uint16x8_t b = vandq_u16(pixels, vdupq_n_u16(0x1F));
+
+        uint8x8x4_t result;
+        result.val[0] = vmovn_u16(vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2)));
+        result.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4)));
+        result.val[2] = vmovn_u16(vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2)));
+        result.val[3] = vdup_n_u8(0xFF);
+        vst4_u8(reinterpret_cast<uint8_t*>(destination + i), result);
+    }
+
+    DecodeRgb565Scalar(source + i * 2, count - i, destination + i);
+}
+
+#endif
+
+struct DecodeFunctions
+{
+    DecodeFunction bgra8;
+    DecodeFunction rgb565;
+    DecodeFunction rgba16f;
+};
+
+#if defined(PIXELCONVERSION_X86)
+static bool IsAvxStateEnabledByOs(const int (&cpuInfo)[4]) noexcept
+{
+    // OSXSAVE must be set before XGETBV can be used, then check that XMM and YMM state are saved
+    const bool osxsave = (cpuInfo[2] & (1 << 27)) != 0;
+    return osxsave && ((_xgetbv(0) & 0x6) == 0x6);
+}
+#endif
+
+static DecodeFunctions SelectDecodeFunctions() noexcept
+{
+    DecodeFunctions functions{ DecodeBgra8Scalar, DecodeRgb565Scalar, DecodeRgba16fScalar };
+
+#if defined(PIXELCONVERSION_X86)
+    // SSE2 is part of the x64 baseline and required by Windows on x86
+    functions.bgra8 = DecodeBgra8Sse2;
+    functions.rgb565 = DecodeRgb565Sse2;
+
+    int cpuInfo[4]{};
+    __cpuid(cpuInfo, 0);
+    const int maxLeaf = cpuInfo[0];
+
+    __cpuid(cpuInfo, 1);
+    const bool avxEnabled = IsAvxStateEnabledByOs(cpuInfo);
+    const bool f16c = (cpuInfo[2] & (1 << 29)) != 0;
+
+    if (avxEnabled && f16c)
+    {
+        functions.rgba16f = DecodeRgba16fF16c;
+    }
+
+    if (avxEnabled && maxLeaf >= 7)
+    {
+        __cpuidex(cpuInfo, 7, 0);
+        if ((cpuInfo[1] & (1 << 5)) != 0)
+        {
+            functions.bgra8 = DecodeBgra8Avx2;
+        }
+    }
+#elif defined(PIXELCONVERSION_NEON)
+    functions.bgra8 = DecodeBgra8Neon;
+    functions.rgb565 = DecodeRgb565Neon;
+#endif
+
+    return functions;
+}
+
+static const DecodeFunctions& GetDecodeFunctions() noexcept
+{
+    static const DecodeFunctions functions = SelectDecodeFunctions();
+    return functions;
+}
+
+// BT.709 limited range, coefficients in 8.8 fixed point
+static void DecodeNv12(
+    const BitmapView& bitmap,
+    uint32_t x,
+    uint32_t y,
+    uint32_t count,
+    LampArrayColor* destination) noexcept
+{
+    const uint8_t* luma = bitmap.Data + static_cast<size_t>(y) * bitmap.StrideInBytes;
+    const uint8_t* chroma = bitmap.ChromaData + static_cast<size_t>(y / 2) * bitmap.ChromaStrideInBytes;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t column = x + i;
+        const int32_t c = 298 * (static_cast<int32_t>(luma[column]) - 16) + 128;
+        const int32_t u = static_cast<int32_t>(chroma[column & ~1u]) - 128;
+        const int32_t v = static_cast<int32_t>(chroma[column | 1u]) - 128;
+
+        destination[i] = LampArrayColor{
+            ClampToByte((c + 459 * v) >> 8),
+            ClampToByte((c - 55 * u - 136 * v) >> 8),
+            ClampToByte((c + 541 * u) >> 8),
+            0xFF };
+    }
+}
+
+void PixelConversion::BuildColorTransform(
+    float gamma,
+    float brightness,
+    const float(&whiteBalance)[3],
+    ColorTransform& transform) noexcept
+{
+    uint8_t* const channels[3] = { transform.Red, transform.Green, transform.Blue };
+
+    for (size_t i = 0; i < 256; i++)
+    {
+        const float corrected = brightness * std::pow(static_cast<float>(i) / 255.0f, gamma);
+        for (size_t channel = 0; channel < 3; channel++)
+        {
+            channels[channel][i] = UnitFloatToByte(corrected * whiteBalance[channel]);
+        }
+    }
+}
+
+void PixelConversion::ApplyColorTransform(
+    const ColorTransform& transform,
+    LampArrayColor* colors,
+    size_t count) noexcept
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        colors[i].r = transform.Red[colors[i].r];
+        colors[i].g = transform.Green[colors[i].g];
+        colors[i].b = transform.Blue[colors[i].b];
+    }
+}
+
+void PixelConversion::ConvertPixels(
+    const BitmapView& bitmap,
+    uint32_t x,
+    uint32_t y,
+    uint32_t count,
+    const ColorTransform* transform,
+    LampArrayColor* destination) noexcept
+{
+    const DecodeFunctions& functions = GetDecodeFunctions();
+    const uint8_t* source = bitmap.Data +
+        static_cast<size_t>(y) * bitmap.StrideInBytes +
+        static_cast<size_t>(x) * GetBytesPerPixel(bitmap.Format);
+
+    switch (bitmap.Format)
+    {
+    case BitmapFormat::BGRA8:
+        functions.bgra8(source, count, destination);
+        break;
+    case BitmapFormat::RGBA8:
+        // Already laid out like LampArrayColor
+        memcpy(destination, source, static_cast<size_t>(count) * sizeof(LampArrayColor));
+        break;
+    case BitmapFormat::RGB565:
+        functions.rgb565(source, count, destination);
+        break;
+    case BitmapFormat::RGBA16F:
+        functions.rgba16f(source, count, destination);
+        break;
+    case BitmapFormat::NV12:
+        DecodeNv12(bitmap, x, y, count, destination);
+        break;
+    }
+
+    // The decoded pixels are still in L1, so this doesn't cost another trip through memory
+    if (transform != nullptr)
+    {
+        ApplyColorTransform(*transform, destination, count);
+    }
+}
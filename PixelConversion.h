@@ -0,0 +1,45 @@
+#pragma once
+
+#include "BitmapView.h"
+
+// Folds gamma, brightness and white balance into a single lookup per channel,
+// so correcting a color costs three table reads no matter how many adjustments are made.
+struct ColorTransform
+{
+    uint8_t Red[256];
+    uint8_t Green[256];
+    uint8_t Blue[256];
+};
+
+// Where a LampArrayBitmapHelper applies its ColorTransform.
+enum class ColorTransformStage : uint32_t
+{
+    None,
+    BeforeSampling, // On every pixel while it is decoded, matches what a display would show
+    AfterSampling, // On every Lamp once sampled, much cheaper as there are far fewer Lamps than pixels
+};
+
+namespace PixelConversion
+{
+    // Builds the lookups for output = brightness * whiteBalance * input ^ gamma, with all values in [0, 1].
+    void BuildColorTransform(
+        float gamma,
+        float brightness,
+        const float(&whiteBalance)[3],
+        ColorTransform& transform) noexcept;
+
+    void ApplyColorTransform(
+        const ColorTransform& transform,
+        _Inout_updates_(count) LampArrayColor* colors,
+        size_t count) noexcept;
+
+    // Decodes count pixels of row y, starting at column x, into 8-bit RGBA and runs them through
+    // transform (if not null) in the same pass. Uses the widest SIMD instructions the CPU supports.
+    void ConvertPixels(
+        const BitmapView& bitmap,
+        uint32_t x,
+        uint32_t y,
+        uint32_t count,
+        _In_opt_ const ColorTransform* transform,
+        _Out_writes_(count) LampArrayColor* destination) noexcept;
+}
@@ -0,0 +1,269 @@
+#include "pch.h"
+#include "ProceduralEffects.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define PROCEDURALEFFECTS_SSE2
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#define PROCEDURALEFFECTS_NEON
+#endif
+
+// 4 floats, one per Lamp, with just the operations the effects need.
+#if defined(PROCEDURALEFFECTS_SSE2)
+using Float4 = __m128;
+
+static Float4 Load(const float* values) noexcept { return _mm_loadu_ps(values); }
+static void Store(float* values, Float4 value) noexcept { _mm_storeu_ps(values, value); }
+static Float4 Set(float value) noexcept { return _mm_set1_ps(value); }
+static Float4 Add(Float4 a, Float4 b) noexcept { return _mm_add_ps(a, b); }
+static Float4 Subtract(Float4 a, Float4 b) noexcept { return _mm_sub_ps(a, b); }
+static Float4 Multiply(Float4 a, Float4 b) noexcept { return _mm_mul_ps(a, b); }
+static Float4 Min(Float4 a, Float4 b) noexcept { return _mm_min_ps(a, b); }
+static Float4 Max(Float4 a, Float4 b) noexcept { return _mm_max_ps(a, b); }
+static Float4 SquareRoot(Float4 a) noexcept { return _mm_sqrt_ps(a); }
+static Float4 Abs(Float4 a) noexcept { return _mm_and_ps(a, _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF))); }
+
+static Float4 Floor(Float4 a) noexcept
+{
+    // Truncation rounds negative values up, take one off where it did
+    const Float4 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a), _mm_set1_ps(1.0f)));
+}
+#elif defined(PROCEDURALEFFECTS_NEON)
+using Float4 = float32x4_t;
+
+static Float4 Load(const float* values) noexcept { return vld1q_f32(values); }
+static void Store(float* values, Float4 value) noexcept { vst1q_f32(values, value); }
+static Float4 Set(float value) noexcept { return vdupq_n_f32(value); }
+static Float4 Add(Float4 a, Float4 b) noexcept { return vaddq_f32(a, b); }
+static Float4 Subtract(Float4 a, Float4 b) noexcept { return vsubq_f32(a, b); }
+static Float4 Multiply(Float4 a, Float4 b) noexcept { return vmulq_f32(a, b); }
+static Float4 Min(Float4 a, Float4 b) noexcept { return vminq_f32(a, b); }
+static Float4 Max(Float4 a, Float4 b) noexcept { return vmaxq_f32(a, b); }
+static Float4 SquareRoot(Float4 a) noexcept { return vsqrtq_f32(a); }
+static Float4 Abs(Float4 a) noexcept { return vabsq_f32(a); }
+static Float4 Floor(Float4 a) noexcept { return vrndmq_f32(a); }
+#else
+struct Float4
+{
+    float values[4];
+};
+
+template <typename Operation>
+static Float4 Apply(Float4 a, Float4 b, Operation operation) noexcept
+{
+    Float4 result;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        result.values[i] = operation(a.values[i], b.values[i]);
+    }
+    return result;
+}
+
+static Float4 Load(const float* values) noexcept { Float4 result; memcpy(result.values, values, sizeof(result.values)); return result; }
+static void Store(float* values, Float4 value) noexcept { memcpy(values, value.values, sizeof(value.values)); }
+static Float4 Set(float value) noexcept { return Float4{ { value, value, value, value } }; }
+static Float4 Add(Float4 a, Float4 b) noexcept { return Apply(a, b, [](float x, float y) { return x + y; }); }
+static Float4 Subtract(Float4 a, Float4 b) noexcept { return Apply(a, b, [](float x, float y) { return x - y; }); }
+static Float4 Multiply(Float4 a, Float4 b) noexcept { return Apply(a, b, [](float x, float y) { return x * y; }); }
+static Float4 Min(Float4 a, Float4 b) noexcept { return Apply(a, b, [](float x, float y) { return std::min(x, y); }); }
+static Float4 Max(Float4 a, Float4 b) noexcept { return Apply(a, b, [](float x, float y) { return std::max(x, y); }); }
+static Float4 SquareRoot(Float4 a) noexcept { return Apply(a, a, [](float x, float) { return std::sqrt(x); }); }
+static Float4 Abs(Float4 a) noexcept { return Apply(a, a, [](float x, float) { return std::fabs(x); }); }
+static Float4 Floor(Float4 a) noexcept { return Apply(a, a, [](float x, float) { return std::floor(x); }); }
+#endif
+
+// 0 at whole phases, 1 half way in between, following (1 - cos(2 pi phase)) / 2 to within
+// about 1% without needing a vector cosine.
+static Float4 RaisedCosine(Float4 phase) noexcept
+{
+    const Float4 one = Set(1.0f);
+    const Float4 fraction = Subtract(phase, Floor(phase));
+    const Float4 triangle = Subtract(one, Abs(Subtract(Add(fraction, fraction), one)));
+
+    // Smoothstep of the triangle wave
+    return Multiply(Multiply(triangle, triangle), Subtract(Set(3.0f), Add(triangle, triangle)));
+}
+
+void ProceduralEffectEvaluator::SetLayout(const LampBoxLayout& layout)
+{
+    m_lampCount = (layout.BoxIndices != nullptr) ? layout.BoxCount : layout.Boxes->GetCount();
+    m_boxCount = layout.Boxes->GetCount();
+    m_boxIndices.assign(layout.BoxIndices, (layout.BoxIndices != nullptr) ? layout.BoxIndices + layout.BoxCount : nullptr);
+
+    const size_t paddedCount = (m_lampCount + 3) & ~static_cast<size_t>(3);
+    m_centerX.resize(paddedCount);
+    m_centerY.resize(paddedCount);
+    m_halfWidth.resize(paddedCount);
+    m_halfHeight.resize(paddedCount);
+    m_mix.resize(paddedCount);
+    m_sampleMix.resize(paddedCount);
+
+    const BoundingBox& encompassingBox = layout.EncompassingBox;
+    const int32_t longerSide = std::max(
+        encompassingBox.Right - encompassingBox.Left,
+        encompassingBox.Bottom - encompassingBox.Top);
+    const float scale = (longerSide > 0) ? 1.0f / static_cast<float>(longerSide) : 1.0f;
+
+    BoundingBox boxes[CompactBoundingBoxes::c_boxesPerBlock];
+    for (size_t begin = 0; begin < m_lampCount; begin += CompactBoundingBoxes::c_boxesPerBlock)
+    {
+        const size_t chunkSize = std::min<size_t>(CompactBoundingBoxes::c_boxesPerBlock, m_lampCount - begin);
+        if (layout.BoxIndices != nullptr)
+        {
+            layout.Boxes->Gather(layout.BoxIndices + begin, chunkSize, boxes);
+        }
+        else
+        {
+            layout.Boxes->Decode(begin, chunkSize, boxes);
+        }
+
+        for (size_t i = 0; i < chunkSize; i++)
+        {
+            const BoundingBox& box = boxes[i];
+            m_centerX[begin + i] = (0.5f * static_cast<float>(box.Left + box.Right) - static_cast<float>(encompassingBox.Left)) * scale;
+            m_centerY[begin + i] = (0.5f * static_cast<float>(box.Top + box.Bottom) - static_cast<float>(encompassingBox.Top)) * scale;
+            m_halfWidth[begin + i] = 0.5f * static_cast<float>(box.Right - box.Left) * scale;
+            m_halfHeight[begin + i] = 0.5f * static_cast<float>(box.Bottom - box.Top) * scale;
+        }
+    }
+
+    // The padding evaluates like the last Lamp and is never copied out
+    for (size_t i = m_lampCount; i < paddedCount; i++)
+    {
+        m_centerX[i] = m_centerX[m_lampCount - 1];
+        m_centerY[i] = m_centerY[m_lampCount - 1];
+        m_halfWidth[i] = m_halfWidth[m_lampCount - 1];
+        m_halfHeight[i] = m_halfHeight[m_lampCount - 1];
+    }
+}
+
+void ProceduralEffectEvaluator::EvaluateMix(
+    const ProceduralEffect& effect,
+    float timeInSeconds,
+    float offsetX,
+    float offsetY,
+    float* mix) const noexcept
+{
+    // Everything that doesn't depend on the Lamp is worked out once, up front
+    const float inverseWavelength = (effect.Wavelength > 0.0f) ? 1.0f / effect.Wavelength : 0.0f;
+    const float inverseWidth = (effect.Width > 0.0f) ? 1.0f / effect.Width : 0.0f;
+    const float phaseShift = effect.Speed * timeInSeconds;
+
+    // The pulse grows until it has passed the farthest Lamp
+    float pulseRadius = 0.0f;
+    if (effect.Kind == ProceduralEffectKind::RadialPulse)
+    {
+        float maxDistanceSquared = 0.0f;
+        for (size_t i = 0; i < m_lampCount; i++)
+        {
+            const float dx = m_centerX[i] - effect.CenterX;
+            const float dy = m_centerY[i] - effect.CenterY;
+            maxDistanceSquared = std::max(maxDistanceSquared, dx * dx + dy * dy);
+        }
+        pulseRadius = (phaseShift - std::floor(phaseShift)) * (std::sqrt(maxDistanceSquared) + effect.Width);
+    }
+
+    const Float4 zero = Set(0.0f);
+    const Float4 one = Set(1.0f);
+    const Float4 centerX = Set(effect.CenterX);
+    const Float4 centerY = Set(effect.CenterY);
+    const Float4 directionX = Set(effect.DirectionX * inverseWavelength);
+    const Float4 directionY = Set(effect.DirectionY * inverseWavelength);
+    const Float4 offsetXFactor = Set(offsetX);
+    const Float4 offsetYFactor = Set(offsetY);
+
+    for (size_t i = 0; i < m_mix.size(); i += 4)
+    {
+        const Float4 x = Subtract(Add(Load(&m_centerX[i]), Multiply(Load(&m_halfWidth[i]), offsetXFactor)), centerX);
+        const Float4 y = Subtract(Add(Load(&m_centerY[i]), Multiply(Load(&m_halfHeight[i]), offsetYFactor)), centerY);
+
+        Float4 value;
+        switch (effect.Kind)
+        {
+        case ProceduralEffectKind::LinearGradient:
+            // Distance along Direction, in wavelengths
+            value = Min(Max(Add(Multiply(x, directionX), Multiply(y, directionY)), zero), one);
+            break;
+        case ProceduralEffectKind::Wave:
+            value = RaisedCosine(Subtract(Add(Multiply(x, directionX), Multiply(y, directionY)), Set(phaseShift)));
+            break;
+        case ProceduralEffectKind::Ripple:
+        {
+            const Float4 distance = SquareRoot(Add(Multiply(x, x), Multiply(y, y)));
+            value = RaisedCosine(Subtract(Multiply(distance, Set(inverseWavelength)), Set(phaseShift)));
+            break;
+        }
+        case ProceduralEffectKind::RadialPulse:
+        default:
+        {
+            const Float4 distance = SquareRoot(Add(Multiply(x, x), Multiply(y, y)));
+            const Float4 distanceToRing = Abs(Subtract(distance, Set(pulseRadius)));
+            value = Max(Subtract(one, Multiply(distanceToRing, Set(inverseWidth))), zero);
+            break;
+        }
+        }
+
+        Store(&mix[i], value);
+    }
+}
+
+void ProceduralEffectEvaluator::Evaluate(
+    const ProceduralEffect& effect,
+    float timeInSeconds,
+    std::vector<LampArrayColor>& colors)
+{
+    colors.resize(m_boxCount);
+    if (m_lampCount == 0)
+    {
+        return;
+    }
+
+    if (m_sampling == ProceduralEffectSampling::Center)
+    {
+        EvaluateMix(effect, timeInSeconds, 0.0f, 0.0f, m_mix.data());
+    }
+    else
+    {
+        // 2x2 evaluations at the centers of the box's quadrants
+        const float offsets[4][2] = { { -0.5f, -0.5f }, { 0.5f, -0.5f }, { -0.5f, 0.5f }, { 0.5f, 0.5f } };
+
+        EvaluateMix(effect, timeInSeconds, offsets[0][0], offsets[0][1], m_mix.data());
+        for (uint32_t sample = 1; sample < 4; sample++)
+        {
+            EvaluateMix(effect, timeInSeconds, offsets[sample][0], offsets[sample][1], m_sampleMix.data());
+            for (size_t i = 0; i < m_mix.size(); i++)
+            {
+                m_mix[i] += m_sampleMix[i];
+            }
+        }
+
+        for (size_t i = 0; i < m_mix.size(); i++)
+        {
+            m_mix[i] *= 0.25f;
+        }
+    }
+
+    const float first[4] = {
+        static_cast<float>(effect.FirstColor.r),
+        static_cast<float>(effect.FirstColor.g),
+        static_cast<float>(effect.FirstColor.b),
+        static_cast<float>(effect.FirstColor.a) };
+    const float difference[4] = {
+        static_cast<float>(effect.SecondColor.r) - first[0],
+        static_cast<float>(effect.SecondColor.g) - first[1],
+        static_cast<float>(effect.SecondColor.b) - first[2],
+        static_cast<float>(effect.SecondColor.a) - first[3] };
+
+    const bool isZone = !m_boxIndices.empty();
+    for (size_t i = 0; i < m_lampCount; i++)
+    {
+        const float mix = m_mix[i];
+        colors[isZone ? m_boxIndices[i] : i] = LampArrayColor{
+            static_cast<uint8_t>(first[0] + difference[0] * mix + 0.5f),
+            static_cast<uint8_t>(first[1] + difference[1] * mix + 0.5f),
+            static_cast<uint8_t>(first[2] + difference[2] * mix + 0.5f),
+            static_cast<uint8_t>(first[3] + difference[3] * mix + 0.5f) };
+    }
+}
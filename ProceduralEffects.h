@@ -0,0 +1,79 @@
+#pragma once
+
+#include "LampSampling.h"
+
+enum class ProceduralEffectKind : uint32_t
+{
+    LinearGradient, // From FirstColor at Center to SecondColor one Wavelength further along Direction
+    Wave, // Bands moving along Direction
+    Ripple, // Rings moving outwards from Center
+    RadialPulse, // A single ring growing from Center, restarting every 1 / Speed seconds
+};
+
+// Lengths are in units where the longer side of the layout's encompassing box is 1, so that the
+// same effect looks the same on any LampArray and circles stay round.
+struct ProceduralEffect
+{
+    ProceduralEffectKind Kind;
+
+    // Every Lamp gets a mix of the two colors
+    LampArrayColor FirstColor;
+    LampArrayColor SecondColor;
+
+    float CenterX;
+    float CenterY;
+    float DirectionX; // Should be normalized
+    float DirectionY;
+
+    float Wavelength; // Distance between two bands/rings, or length of the gradient
+    float Speed; // Wavelengths per second for Wave and Ripple, pulses per second for RadialPulse
+    float Width; // Thickness of the RadialPulse ring
+};
+
+enum class ProceduralEffectSampling : uint32_t
+{
+    Center, // One evaluation at the center of each Lamp's box
+    Box, // Average of 2x2 evaluations spread over each Lamp's box, smoother for large Lamps
+};
+
+// Evaluates analytic effects straight at the Lamps instead of rendering a bitmap and sampling it
+// back, so a frame costs a few operations per Lamp instead of a pass over every pixel.
+// Lamp positions are kept as structure of arrays and evaluated 4 Lamps at a time with SIMD.
+struct ProceduralEffectEvaluator
+{
+public:
+    // Takes the Lamp positions from layout, e.g. LampArrayBitmapHelper::GetSelectedLampLayout()
+    // or a zone. The colors of Evaluate are then ordered like the boxes of the layout, and for a
+    // zone (BoxIndices set) laid out like those of SampleZoneBitmap.
+    void SetLayout(const LampBoxLayout& layout);
+
+    void SetSampling(ProceduralEffectSampling sampling) { m_sampling = sampling; }
+
+    // Fills colors (sized to the layout) with effect at timeInSeconds. For a LampArrayBitmapHelper
+    // layout the colors can go straight to ApplyColorTransform and SubmitColors. For a zone, colors
+    // is sized to every box of the layout and only the zone's boxes are written, at their box
+    // index, so several zones (or an effect and SampleZoneBitmap) can fill the same colors.
+    void Evaluate(const ProceduralEffect& effect, float timeInSeconds, std::vector<LampArrayColor>& colors);
+
+private:
+    // Mix between FirstColor (0) and SecondColor (1) of every Lamp, at offset (offsetX, offsetY)
+    // times the half size of its box.
+    void EvaluateMix(const ProceduralEffect& effect, float timeInSeconds, float offsetX, float offsetY, float* mix) const noexcept;
+
+    ProceduralEffectSampling m_sampling = ProceduralEffectSampling::Center;
+
+    // Where Evaluate writes the colors of a zone, empty for a whole layout
+    std::vector<uint32_t> m_boxIndices;
+    size_t m_boxCount{};
+
+    // Per Lamp, padded with copies of the last Lamp to a multiple of 4
+    size_t m_lampCount{};
+    std::vector<float> m_centerX;
+    std::vector<float> m_centerY;
+    std::vector<float> m_halfWidth;
+    std::vector<float> m_halfHeight;
+
+    // Scratch buffers, kept around so Evaluate doesn't allocate
+    std::vector<float> m_mix;
+    std::vector<float> m_sampleMix;
+};
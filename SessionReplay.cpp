@@ -0,0 +1,137 @@
+#include "pch.h"
+#include "SessionReplay.h"
+#include "FramePipeline.h"
+
+// How long to wait for the last frame to reach every LampArray before giving up on it.
+const std::chrono::seconds c_drainTimeout(5);
+
+static std::chrono::microseconds GetPercentile(std::vector<std::chrono::steady_clock::duration>& latencies, double percentile)
+{
+    if (latencies.empty())
+    {
+        return std::chrono::microseconds(0);
+    }
+
+    // Nearest rank
+    const size_t rank = static_cast<size_t>(std::ceil(percentile * latencies.size()));
+    const auto nth = latencies.begin() + (std::max<size_t>(rank, 1) - 1);
+    std::nth_element(latencies.begin(), nth, latencies.end());
+    return std::chrono::duration_cast<std::chrono::microseconds>(*nth);
+}
+
+static bool IsDrained(const FramePipelineStatistics& statistics)
+{
+    return (statistics.frameQueueDepth == 0) &&
+        (statistics.framesSampled + statistics.framesDropped == statistics.framesPublished) &&
+        std::all_of(statistics.devices.begin(), statistics.devices.end(),
+            [](const FramePipelineDeviceStatistics& device) { return device.queueDepth == 0; });
+}
+
+SessionReplayResults SessionReplay::Replay(const std::filesystem::path& path, bool realTime, AllocationCounter allocationCounter)
+{
+    SessionTraceReader reader(path);
+
+    std::mutex latenciesLock;
+    std::vector<std::chrono::steady_clock::duration> latencies;
+    uint64_t submissions = 0;
+    std::chrono::steady_clock::time_point lastSubmissionTime;
+
+    std::vector<std::pair<uint64_t, std::shared_ptr<LampArrayBitmapHelper>>> helpers;
+
+    SessionReplayResults results{};
+    const uint64_t startAllocationCount = (allocationCounter != nullptr) ? allocationCounter() : 0;
+
+    {
+        FramePipeline pipeline;
+        pipeline.SetSubmissionObserver(
+            [&](const LampArrayBitmapHelper&, bool isNewFrame, std::chrono::steady_clock::duration latency, size_t)
+            {
+                std::lock_guard<std::mutex> lock(latenciesLock);
+                if (isNewFrame)
+                {
+                    latencies.push_back(latency);
+                }
+                submissions++;
+                lastSubmissionTime = std::chrono::steady_clock::now();
+            });
+
+        auto publishLampArrays = [&]()
+        {
+            auto newLampArrays = std::make_shared<LampArraySnapshot>();
+            for (const auto& helper : helpers)
+            {
+                newLampArrays->push_back(helper.second);
+            }
+            pipeline.SetLampArrays(std::move(newLampArrays));
+        };
+
+        const auto startTime = std::chrono::steady_clock::now();
+        lastSubmissionTime = startTime;
+
+        SessionRecord record{};
+        while (reader.ReadNext(record))
+        {
+            if (realTime)
+            {
+                std::this_thread::sleep_until(startTime + std::chrono::microseconds(record.timeInMicroseconds));
+            }
+
+            switch (record.kind)
+            {
+            case SessionRecordKind::DeviceConnected:
+            {
+                auto helper = std::make_shared<LampArrayBitmapHelper>(nullptr);
+                helper->InitializeFromDescription(record.description);
+                helpers.emplace_back(record.deviceId, std::move(helper));
+                publishLampArrays();
+                break;
+            }
+
+            case SessionRecordKind::DeviceDisconnected:
+                helpers.erase(
+                    std::remove_if(helpers.begin(), helpers.end(),
+                        [&](const auto& helper) { return helper.first == record.deviceId; }),
+                    helpers.end());
+                publishLampArrays();
+                break;
+
+            case SessionRecordKind::Frame:
+                pipeline.PublishFrame(record.frame);
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        // Let the last frame make it to every LampArray, sends happen at the recorded update rates
+        const auto drainDeadline = std::chrono::steady_clock::now() + c_drainTimeout;
+        FramePipelineStatistics statistics = pipeline.GetStatistics();
+        while (!IsDrained(statistics) && (std::chrono::steady_clock::now() < drainDeadline))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            statistics = pipeline.GetStatistics();
+        }
+
+        // Before the pipeline and the helpers are torn down
+        results.allocationsCounted = (allocationCounter != nullptr);
+        results.allocationCount = (allocationCounter != nullptr) ? allocationCounter() - startAllocationCount : 0;
+
+        results.framesPublished = statistics.framesPublished;
+        results.framesSampled = statistics.framesSampled;
+        results.framesDropped = statistics.framesDropped;
+
+        std::lock_guard<std::mutex> lock(latenciesLock);
+        results.duration = std::chrono::duration_cast<std::chrono::microseconds>(lastSubmissionTime - startTime);
+    }
+
+    // The pipeline is gone, nothing touches latencies anymore
+    results.submissions = submissions;
+    results.framesPerSecond = (results.duration.count() > 0) ?
+        results.framesPublished * 1000000.0 / results.duration.count() :
+        0.0;
+    results.latencyP50 = GetPercentile(latencies, 0.5);
+    results.latencyP99 = GetPercentile(latencies, 0.99);
+
+    return results;
+}
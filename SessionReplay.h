@@ -0,0 +1,37 @@
+#pragma once
+
+#include "SessionTrace.h"
+
+struct SessionReplayResults
+{
+    uint64_t framesPublished;
+    uint64_t framesSampled;
+    uint64_t framesDropped; // Replaced by a newer frame before being sampled
+    uint64_t submissions; // Colors sent to a LampArray
+    std::chrono::microseconds duration; // From the first record to the last submission
+    double framesPerSecond; // Published frames over duration
+
+    // From a frame being published to the first colors sampled from it being sent
+    std::chrono::microseconds latencyP50;
+    std::chrono::microseconds latencyP99;
+
+    // Heap allocations made by any thread during the replay. Only counted when Replay is given an
+    // AllocationCounter, allocationsCounted is false otherwise.
+    bool allocationsCounted;
+    uint64_t allocationCount;
+};
+
+// Plays a session recorded by SessionTraceWriter back through the frame path, so a production
+// stutter can be turned into a repeatable benchmark. Every recorded LampArray is replaced by a
+// stand-in LampArrayBitmapHelper initialized from its recorded description, so the helpers, the
+// sampling and the scheduling all run for real, only the device writes are skipped.
+namespace SessionReplay
+{
+    // Returns how many heap allocations the process has made so far, e.g. from a replaced global
+    // operator new. Must be safe to call from any thread.
+    using AllocationCounter = uint64_t(*)();
+
+    // realTime waits out the recorded time between records, otherwise they are replayed as fast
+    // as possible. Throws if the trace can't be read.
+    SessionReplayResults Replay(const std::filesystem::path& path, bool realTime, AllocationCounter allocationCounter = nullptr);
+}
@@ -0,0 +1,265 @@
+#include "pch.h"
+#include "SessionTrace.h"
+
+// "LASR" read as a little endian uint32
+const uint32_t c_sessionTraceMagic = 0x5253414C;
+const uint32_t c_sessionTraceVersion = 1;
+
+struct SessionTraceHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct SessionRecordHeader
+{
+    SessionRecordKind kind;
+    uint32_t payloadSize;
+    uint64_t timeInMicroseconds;
+};
+
+struct SessionDeviceHeader
+{
+    uint64_t deviceId;
+    uint64_t minUpdateIntervalInMicroseconds;
+    LampArrayPosition boundingBox;
+    uint32_t lampCount;
+};
+
+struct SessionFrameHeader
+{
+    uint32_t width;
+    uint32_t height;
+    BitmapFormat format;
+};
+
+static BitmapView GetPackedView(const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height, BitmapFormat format) noexcept
+{
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(width, height, format, rowSize, chromaOffset, totalSize);
+
+    return BitmapView{
+        pixels.data(),
+        width,
+        height,
+        static_cast<uint32_t>(rowSize),
+        format,
+        (format == BitmapFormat::NV12) ? pixels.data() + chromaOffset : nullptr,
+        (format == BitmapFormat::NV12) ? ((width + 1) & ~1u) : 0 };
+}
+
+SessionTraceWriter::SessionTraceWriter(const std::filesystem::path& path) :
+    m_file(path, std::ios::binary | std::ios::trunc),
+    m_startTime(std::chrono::steady_clock::now())
+{
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_OPEN_FAILED), !m_file.is_open());
+
+    const SessionTraceHeader header{ c_sessionTraceMagic, c_sessionTraceVersion };
+    Write(&header, sizeof(header));
+}
+
+void SessionTraceWriter::Write(const void* data, size_t size)
+{
+    m_file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT), !m_file);
+}
+
+void SessionTraceWriter::WriteRecordHeader(SessionRecordKind kind, size_t payloadSize)
+{
+    THROW_HR_IF(E_INVALIDARG, payloadSize > std::numeric_limits<uint32_t>::max());
+
+    const SessionRecordHeader header{
+        kind,
+        static_cast<uint32_t>(payloadSize),
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_startTime).count()) };
+    Write(&header, sizeof(header));
+}
+
+void SessionTraceWriter::WriteDeviceConnected(uint64_t deviceId, const LampArrayDescription& description)
+{
+    const SessionDeviceHeader device{
+        deviceId,
+        description.minUpdateIntervalInMicroseconds,
+        description.boundingBox,
+        static_cast<uint32_t>(description.lampPositions.size()) };
+    const size_t positionsSize = description.lampPositions.size() * sizeof(LampArrayPosition);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (std::find(m_connectedDeviceIds.begin(), m_connectedDeviceIds.end(), deviceId) != m_connectedDeviceIds.end())
+    {
+        return;
+    }
+
+    // Reserved first, so the id can't fail to be remembered once its record is written
+    m_connectedDeviceIds.reserve(m_connectedDeviceIds.size() + 1);
+    WriteRecordHeader(SessionRecordKind::DeviceConnected, sizeof(device) + positionsSize);
+    Write(&device, sizeof(device));
+    Write(description.lampPositions.data(), positionsSize);
+    m_connectedDeviceIds.push_back(deviceId);
+}
+
+void SessionTraceWriter::WriteDeviceDisconnected(uint64_t deviceId)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto connectedDeviceId = std::find(m_connectedDeviceIds.begin(), m_connectedDeviceIds.end(), deviceId);
+    if (connectedDeviceId == m_connectedDeviceIds.end())
+    {
+        return;
+    }
+
+    m_connectedDeviceIds.erase(connectedDeviceId);
+    WriteRecordHeader(SessionRecordKind::DeviceDisconnected, sizeof(deviceId));
+    Write(&deviceId, sizeof(deviceId));
+}
+
+void SessionTraceWriter::WriteFrame(const BitmapView& bitmap)
+{
+    THROW_HR_IF(E_INVALIDARG, bitmap.Data == nullptr);
+    THROW_HR_IF(E_INVALIDARG, (bitmap.Format == BitmapFormat::NV12) && (bitmap.ChromaData == nullptr));
+
+    size_t rowSize, chromaOffset, totalSize;
+    GetPackedBitmapLayout(bitmap.Width, bitmap.Height, bitmap.Format, rowSize, chromaOffset, totalSize);
+    const size_t chromaRowSize = (static_cast<size_t>(bitmap.Width) + 1) & ~static_cast<size_t>(1);
+    const uint32_t chromaRowCount = (bitmap.Format == BitmapFormat::NV12) ? (bitmap.Height + 1) / 2 : 0;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    bool isRepeated = m_hasPreviousFrame &&
+        (m_previousWidth == bitmap.Width) &&
+        (m_previousHeight == bitmap.Height) &&
+        (m_previousFormat == bitmap.Format);
+
+    // Compare against, and update, the packed copy a row at a time
+    m_previousFrame.resize(totalSize);
+    for (uint32_t y = 0; y < bitmap.Height; y++)
+    {
+        const uint8_t* row = bitmap.Data + static_cast<size_t>(y) * bitmap.StrideInBytes;
+        uint8_t* previousRow = m_previousFrame.data() + y * rowSize;
+        if (!isRepeated || (memcmp(previousRow, row, rowSize) != 0))
+        {
+            isRepeated = false;
+            memcpy(previousRow, row, rowSize);
+        }
+    }
+    for (uint32_t y = 0; y < chromaRowCount; y++)
+    {
+        const uint8_t* row = bitmap.ChromaData + static_cast<size_t>(y) * bitmap.ChromaStrideInBytes;
+        uint8_t* previousRow = m_previousFrame.data() + chromaOffset + y * chromaRowSize;
+        if (!isRepeated || (memcmp(previousRow, row, chromaRowSize) != 0))
+        {
+            isRepeated = false;
+            memcpy(previousRow, row, chromaRowSize);
+        }
+    }
+
+    m_previousWidth = bitmap.Width;
+    m_previousHeight = bitmap.Height;
+    m_previousFormat = bitmap.Format;
+    m_hasPreviousFrame = true;
+
+    if (isRepeated)
+    {
+        WriteRecordHeader(SessionRecordKind::RepeatedFrame, 0);
+        return;
+    }
+
+    const SessionFrameHeader frame{ bitmap.Width, bitmap.Height, bitmap.Format };
+    WriteRecordHeader(SessionRecordKind::Frame, sizeof(frame) + totalSize);
+    Write(&frame, sizeof(frame));
+    Write(m_previousFrame.data(), totalSize);
+}
+
+SessionTraceReader::SessionTraceReader(const std::filesystem::path& path) :
+    m_file(path, std::ios::binary)
+{
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_OPEN_FAILED), !m_file.is_open());
+
+    SessionTraceHeader header{};
+    Read(&header, sizeof(header));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.magic != c_sessionTraceMagic);
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), header.version != c_sessionTraceVersion);
+}
+
+void SessionTraceReader::Read(void* data, size_t size)
+{
+    m_file.read(static_cast<char*>(data), static_cast<std::streamsize>(size));
+    THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), static_cast<size_t>(m_file.gcount()) != size);
+}
+
+bool SessionTraceReader::ReadNext(SessionRecord& record)
+{
+    for (;;)
+    {
+        // A clean end is only ever right before a record header
+        if (m_file.peek() == std::char_traits<char>::eof())
+        {
+            return false;
+        }
+
+        SessionRecordHeader header{};
+        Read(&header, sizeof(header));
+
+        record.kind = header.kind;
+        record.timeInMicroseconds = header.timeInMicroseconds;
+
+        switch (header.kind)
+        {
+        case SessionRecordKind::DeviceConnected:
+        {
+            SessionDeviceHeader device{};
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.payloadSize < sizeof(device));
+            Read(&device, sizeof(device));
+
+            const size_t positionsSize = static_cast<size_t>(device.lampCount) * sizeof(LampArrayPosition);
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.payloadSize != sizeof(device) + positionsSize);
+
+            record.deviceId = device.deviceId;
+            record.description.minUpdateIntervalInMicroseconds = device.minUpdateIntervalInMicroseconds;
+            record.description.boundingBox = device.boundingBox;
+            record.description.lampPositions.resize(device.lampCount);
+            Read(record.description.lampPositions.data(), positionsSize);
+            return true;
+        }
+
+        case SessionRecordKind::DeviceDisconnected:
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.payloadSize != sizeof(record.deviceId));
+            Read(&record.deviceId, sizeof(record.deviceId));
+            return true;
+
+        case SessionRecordKind::Frame:
+        {
+            SessionFrameHeader frame{};
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.payloadSize < sizeof(frame));
+            Read(&frame, sizeof(frame));
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), frame.format > BitmapFormat::NV12);
+
+            size_t rowSize, chromaOffset, totalSize;
+            GetPackedBitmapLayout(frame.width, frame.height, frame.format, rowSize, chromaOffset, totalSize);
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), header.payloadSize != sizeof(frame) + totalSize);
+
+            m_frame.resize(totalSize);
+            Read(m_frame.data(), totalSize);
+            m_frameWidth = frame.width;
+            m_frameHeight = frame.height;
+            m_frameFormat = frame.format;
+            m_hasFrame = true;
+
+            record.frame = GetPackedView(m_frame, m_frameWidth, m_frameHeight, m_frameFormat);
+            return true;
+        }
+
+        case SessionRecordKind::RepeatedFrame:
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), !m_hasFrame || (header.payloadSize != 0));
+
+            record.kind = SessionRecordKind::Frame;
+            record.frame = GetPackedView(m_frame, m_frameWidth, m_frameHeight, m_frameFormat);
+            return true;
+
+        default:
+            // Written by a newer version, skip it
+            m_file.seekg(header.payloadSize, std::ios::cur);
+            THROW_HR_IF(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), !m_file);
+            break;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "LampArrayBitmapHelper.h"
+
+enum class SessionRecordKind : uint32_t
+{
+    DeviceConnected = 1,
+    DeviceDisconnected = 2,
+    Frame = 3,
+    RepeatedFrame = 4, // Same pixels as the previous frame, only written to the file
+};
+
+struct SessionRecord
+{
+    SessionRecordKind kind; // Never RepeatedFrame, the reader turns those back into Frame
+    uint64_t timeInMicroseconds; // Since the recording started
+
+    // DeviceConnected and DeviceDisconnected
+    uint64_t deviceId;
+    LampArrayDescription description; // DeviceConnected only
+
+    // Frame, tightly packed. Owned by the reader and valid until the next ReadNext.
+    BitmapView frame;
+};
+
+// Records a session (LampArrays connecting and disconnecting with their layouts, and every frame
+// with its timing) into a compact binary file that SessionReplay can play back without the devices.
+//
+// The file is a header (magic, version) followed by records of {kind, payload size, time} and the
+// payload, all little endian. Frames are stored tightly packed, and a frame with the same pixels as
+// the previous one is stored as a RepeatedFrame without any.
+struct SessionTraceWriter
+{
+public:
+    // Creates or overwrites the file at path, throws if it can't.
+    explicit SessionTraceWriter(const std::filesystem::path& path);
+
+    SessionTraceWriter(const SessionTraceWriter&) = delete;
+    SessionTraceWriter& operator=(const SessionTraceWriter&) = delete;
+
+    // Safe to call from any thread, records are timed and written in the order of the calls.
+    // deviceId can be anything that tells the LampArrays of the session apart. A device already
+    // connected isn't recorded again, and one that isn't connected isn't recorded disconnecting.
+    void WriteDeviceConnected(uint64_t deviceId, const LampArrayDescription& description);
+    void WriteDeviceDisconnected(uint64_t deviceId);
+    void WriteFrame(const BitmapView& bitmap);
+
+private:
+    void WriteRecordHeader(SessionRecordKind kind, size_t payloadSize);
+    void Write(const void* data, size_t size);
+
+    std::mutex m_lock;
+    std::ofstream m_file;
+    std::chrono::steady_clock::time_point m_startTime;
+
+    // Recorded as connected and not yet as disconnected
+    std::vector<uint64_t> m_connectedDeviceIds;
+
+    // Packed copy of the last frame written, to spot repeated ones
+    std::vector<uint8_t> m_previousFrame;
+    uint32_t m_previousWidth{};
+    uint32_t m_previousHeight{};
+    BitmapFormat m_previousFormat{};
+    bool m_hasPreviousFrame{};
+};
+
+struct SessionTraceReader
+{
+public:
+    // Throws if path can't be opened or isn't a session trace of a known version.
+    explicit SessionTraceReader(const std::filesystem::path& path);
+
+    // Returns false at the end of the trace, throws if it is truncated or corrupt.
+    bool ReadNext(SessionRecord& record);
+
+private:
+    void Read(void* data, size_t size);
+
+    std::ifstream m_file;
+
+    std::vector<uint8_t> m_frame;
+    uint32_t m_frameWidth{};
+    uint32_t m_frameHeight{};
+    BitmapFormat m_frameFormat{};
+    bool m_hasFrame{};
+};
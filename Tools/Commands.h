@@ -0,0 +1,19 @@
+#pragma once
+
+// Commands of LampArrayTools. Each gets the command line from its own name on, and returns the
+// process exit code.
+
+//   replay <session trace> [/realTime]
+// Plays a trace recorded by the app back through SessionReplay and prints its results.
+int RunReplayCommand(int argumentCount, _In_reads_(argumentCount) wchar_t** arguments);
+
+//   compile-layout <input> <output> [/csv] [/interval <microseconds>] [/box <x> <y> <z>] [/lampsPerTile <count>]
+//   [/halo <millimeters>] [/header <header path> <model> <vendor ID> <product ID>]
+// Compiles a layout with LampLayoutCompiler. For the app to use it, copy the output into the
+// LampLayouts folder of its local folder, named by LampLayoutDirectory::GetFileName. /header also
+// writes the layout out as a header for KnownLampLayouts.
+// Returns 0 on success, 1 on failure, and 2 if there were approximate Lamps.
+int RunCompileLayoutCommand(int argumentCount, _In_reads_(argumentCount) wchar_t** arguments);
+
+// Heap allocations made through operator new since the process started.
+uint64_t GetAllocationCount();
@@ -0,0 +1,93 @@
+#include "pch.h"
+#include "Commands.h"
+#include "LampLayoutCompiler.h"
+
+#include <cstdio>
+
+int RunCompileLayoutCommand(int argumentCount, wchar_t** arguments)
+{
+    try
+    {
+        LampLayoutCompilerOptions options;
+        std::vector<std::filesystem::path> paths;
+
+        std::filesystem::path headerPath;
+        std::wstring model;
+        uint16_t vendorId = 0;
+        uint16_t productId = 0;
+
+        for (int i = 1; i < argumentCount; i++)
+        {
+            const std::wstring argument = arguments[i];
+            auto nextValue = [&]()
+            {
+                THROW_HR_IF(E_INVALIDARG, i + 1 >= argumentCount);
+                return arguments[++i];
+            };
+
+            if (argument == L"/csv")
+            {
+                options.inputFormat = LampLayoutInputFormat::Csv;
+            }
+            else if (argument == L"/interval")
+            {
+                options.minUpdateIntervalInMicroseconds = std::wcstoull(nextValue(), nullptr, 10);
+            }
+            else if (argument == L"/box")
+            {
+                options.boundingBox.xInMeters = std::wcstof(nextValue(), nullptr);
+                options.boundingBox.yInMeters = std::wcstof(nextValue(), nullptr);
+                options.boundingBox.zInMeters = std::wcstof(nextValue(), nullptr);
+            }
+            else if (argument == L"/lampsPerTile")
+            {
+                options.lampsPerTile = static_cast<uint32_t>(std::wcstoul(nextValue(), nullptr, 10));
+            }
+            else if (argument == L"/halo")
+            {
+                options.haloInMillimeters = static_cast<int32_t>(std::wcstol(nextValue(), nullptr, 10));
+            }
+            else if (argument == L"/header")
+            {
+                headerPath = nextValue();
+                model = nextValue();
+                vendorId = static_cast<uint16_t>(std::wcstoul(nextValue(), nullptr, 0));
+                productId = static_cast<uint16_t>(std::wcstoul(nextValue(), nullptr, 0));
+            }
+            else
+            {
+                paths.emplace_back(argument);
+            }
+        }
+
+        if (paths.size() != 2)
+        {
+            fwprintf(stderr, L"Usage: compile-layout <input> <output> [/csv] [/interval <microseconds>] [/box <x> <y> <z>] [/lampsPerTile <count>] [/halo <millimeters>] "
+                L"[/header <header path> <model> <vendor ID> <product ID>]\n");
+            return 1;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        const LampLayoutCompilerResults results = LampLayoutCompiler::Compile(paths[0], paths[1], options);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+        wprintf(L"%llu Lamps in %u tiles, %llu approximate, %lld ms\n",
+            static_cast<unsigned long long>(results.lampCount),
+            results.tileCount,
+            static_cast<unsigned long long>(results.approximateLampCount),
+            static_cast<long long>(elapsed.count()));
+
+        if (!headerPath.empty())
+        {
+            const LampLayoutFile layoutFile(paths[1]);
+            LampLayoutCompiler::WriteKnownLayoutHeader(layoutFile.GetLayout(), headerPath, model, vendorId, productId);
+        }
+
+        return (results.approximateLampCount == 0) ? 0 : 2;
+    }
+    catch (...)
+    {
+        fwprintf(stderr, L"Failed with 0x%08X\n", static_cast<uint32_t>(wil::ResultFromCaughtException()));
+        return 1;
+    }
+}
@@ -0,0 +1,54 @@
+#include "pch.h"
+#include "Commands.h"
+#include "SessionReplay.h"
+
+#include <cstdio>
+
+int RunReplayCommand(int argumentCount, wchar_t** arguments)
+{
+    try
+    {
+        std::vector<std::filesystem::path> paths;
+        bool realTime = false;
+
+        for (int i = 1; i < argumentCount; i++)
+        {
+            const std::wstring argument = arguments[i];
+            if (argument == L"/realTime")
+            {
+                realTime = true;
+            }
+            else
+            {
+                paths.emplace_back(argument);
+            }
+        }
+
+        if (paths.size() != 1)
+        {
+            fwprintf(stderr, L"Usage: replay <session trace> [/realTime]\n");
+            return 1;
+        }
+
+        const SessionReplayResults results = SessionReplay::Replay(paths[0], realTime, GetAllocationCount);
+
+        wprintf(L"Frames: %llu published, %llu sampled, %llu dropped, %.1f per second\n",
+            static_cast<unsigned long long>(results.framesPublished),
+            static_cast<unsigned long long>(results.framesSampled),
+            static_cast<unsigned long long>(results.framesDropped),
+            results.framesPerSecond);
+        wprintf(L"Submissions: %llu in %lld us\n",
+            static_cast<unsigned long long>(results.submissions),
+            static_cast<long long>(results.duration.count()));
+        wprintf(L"Latency: p50 %lld us, p99 %lld us\n",
+            static_cast<long long>(results.latencyP50.count()),
+            static_cast<long long>(results.latencyP99.count()));
+        wprintf(L"Allocations: %llu\n", static_cast<unsigned long long>(results.allocationCount));
+        return 0;
+    }
+    catch (...)
+    {
+        fwprintf(stderr, L"Failed with 0x%08X\n", static_cast<uint32_t>(wil::ResultFromCaughtException()));
+        return 1;
+    }
+}
@@ -0,0 +1,61 @@
+#include "pch.h"
+#include "Commands.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+// Every allocation of the process goes through these, so SessionReplay can count them in any build.
+static std::atomic<uint64_t> s_allocationCount;
+
+void* operator new(size_t size)
+{
+    s_allocationCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* memory = malloc((size != 0) ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    s_allocationCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* memory = _aligned_malloc((size != 0) ? size : 1, static_cast<size_t>(alignment)))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+    _aligned_free(memory);
+}
+
+uint64_t GetAllocationCount()
+{
+    return s_allocationCount.load(std::memory_order_relaxed);
+}
+
+int wmain(int argumentCount, wchar_t** arguments)
+{
+    if ((argumentCount >= 2) && (wcscmp(arguments[1], L"replay") == 0))
+    {
+        return RunReplayCommand(argumentCount - 1, arguments + 1);
+    }
+
+    if ((argumentCount >= 2) && (wcscmp(arguments[1], L"compile-layout") == 0))
+    {
+        return RunCompileLayoutCommand(argumentCount - 1, arguments + 1);
+    }
+
+    fwprintf(stderr, L"Usage: LampArrayTools replay|compile-layout ...\n");
+    return 1;
+}
@@ -0,0 +1,358 @@
+#include "pch.h"
+#include "TraceRecorder.h"
+
+#if defined(LAMPARRAY_ENABLE_TRACING)
+
+// Spikes right after one another are usually the same stall, one trace of it is enough.
+const std::chrono::seconds c_spikeCooldown(5);
+
+// Instant events are stored with this duration.
+const int64_t c_instantDuration = -1;
+
+// Fields are atomics only so that exporting while a thread records is well defined,
+// relaxed loads and stores compile to plain moves.
+struct TraceEvent
+{
+    std::atomic<const char*> name;
+    std::atomic<int64_t> startNanoseconds;
+    std::atomic<int64_t> durationNanoseconds;
+};
+
+struct alignas(64) ThreadTrace
+{
+    uint32_t threadId;
+
+    // The writer claims an event before overwriting its slot and publishes it once written, so
+    // an exporter can tell which of the events it copied may have been overwritten meanwhile.
+    std::atomic<uint64_t> claimedCount;
+    std::atomic<uint64_t> writtenCount;
+
+    TraceEvent events[TraceRecorder::c_eventsPerThread];
+};
+
+struct TraceRegistry
+{
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadTrace>> threads;
+    std::vector<ThreadTrace*> freeThreads; // Buffers of threads that exited, reused by new threads
+
+    std::atomic<int64_t> spikeThresholdNanoseconds;
+    std::mutex spikeLock;
+    std::condition_variable spikeRaised;
+    bool spikePending;
+    bool spikeThreadStarted;
+    std::function<void(const std::string&)> spikeHandler;
+    std::chrono::steady_clock::time_point lastSpikeTime;
+};
+
+// Never destroyed, threads may still be recording while the process shuts down. The buffers of
+// threads that exited are kept until another thread needs one, so their last events still show
+// up, and there are never more buffers than threads that were alive at the same time.
+static TraceRegistry& GetRegistry()
+{
+    static TraceRegistry* registry = new TraceRegistry();
+    return *registry;
+}
+
+// Hands the thread's buffer back to the registry when the thread exits.
+struct ThreadTraceLease
+{
+public:
+    ~ThreadTraceLease()
+    {
+        if (trace != nullptr)
+        {
+            TraceRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.lock);
+            try
+            {
+                registry.freeThreads.push_back(trace);
+            }
+            catch (...)
+            {
+                // Out of memory, the buffer is just never reused
+            }
+            trace = nullptr;
+        }
+    }
+
+    ThreadTrace* trace;
+};
+
+static ThreadTrace* GetThreadTrace() noexcept
+{
+    thread_local ThreadTraceLease lease{};
+
+    if (lease.trace == nullptr)
+    {
+        try
+        {
+            TraceRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.lock);
+
+            ThreadTrace* trace;
+            if (!registry.freeThreads.empty())
+            {
+                // The exporter holds the lock too, so it never sees the previous thread's
+                // events under this thread's ID
+                trace = registry.freeThreads.back();
+                registry.freeThreads.pop_back();
+                trace->claimedCount.store(0, std::memory_order_relaxed);
+                trace->writtenCount.store(0, std::memory_order_relaxed);
+            }
+            else
+            {
+                registry.threads.push_back(std::make_unique<ThreadTrace>());
+                trace = registry.threads.back().get();
+            }
+
+            trace->threadId = GetCurrentThreadId();
+            lease.trace = trace;
+        }
+        catch (...)
+        {
+            // Out of memory, this thread just isn't traced
+        }
+    }
+
+    return lease.trace;
+}
+
+static int64_t ToNanoseconds(std::chrono::steady_clock::time_point time) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+static void Record(const char* name, int64_t startNanoseconds, int64_t durationNanoseconds) noexcept
+{
+    ThreadTrace* trace = GetThreadTrace();
+    if (trace == nullptr)
+    {
+        return;
+    }
+
+    const uint64_t index = trace->writtenCount.load(std::memory_order_relaxed);
+    trace->claimedCount.store(index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    TraceEvent& event = trace->events[index % TraceRecorder::c_eventsPerThread];
+    event.name.store(name, std::memory_order_relaxed);
+    event.startNanoseconds.store(startNanoseconds, std::memory_order_relaxed);
+    event.durationNanoseconds.store(durationNanoseconds, std::memory_order_relaxed);
+
+    trace->writtenCount.store(index + 1, std::memory_order_release);
+}
+
+void TraceRecorder::RecordComplete(
+    const char* name,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end) noexcept
+{
+    Record(name, ToNanoseconds(start), ToNanoseconds(end) - ToNanoseconds(start));
+}
+
+void TraceRecorder::RecordInstant(const char* name) noexcept
+{
+    Record(name, ToNanoseconds(std::chrono::steady_clock::now()), c_instantDuration);
+}
+
+// Exports the trace and calls the handler for every spike ReportFrameTime raises, so the thread
+// that saw the spike doesn't pay for it. Runs for as long as the process, like the registry.
+static void SpikeThread()
+{
+    TraceRegistry& registry = GetRegistry();
+
+    for (;;)
+    {
+        std::function<void(const std::string&)> handler;
+        {
+            std::unique_lock<std::mutex> lock(registry.spikeLock);
+            registry.spikeRaised.wait(lock, [&]() { return registry.spikePending; });
+            registry.spikePending = false;
+            handler = registry.spikeHandler;
+        }
+
+        if (handler)
+        {
+            try
+            {
+                handler(TraceRecorder::ExportJson());
+            }
+            CATCH_LOG();
+        }
+    }
+}
+
+void TraceRecorder::SetSpikeHandler(std::chrono::microseconds threshold, std::function<void(const std::string&)> handler)
+{
+    TraceRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.spikeLock);
+
+    if (handler && !registry.spikeThreadStarted)
+    {
+        std::thread(SpikeThread).detach();
+        registry.spikeThreadStarted = true;
+    }
+
+    registry.spikeHandler = std::move(handler);
+    registry.spikeThresholdNanoseconds.store(
+        registry.spikeHandler ? std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count() : 0,
+        std::memory_order_relaxed);
+}
+
+void TraceRecorder::ReportFrameTime(std::chrono::steady_clock::duration frameTime) noexcept
+{
+    TraceRegistry& registry = GetRegistry();
+
+    const int64_t threshold = registry.spikeThresholdNanoseconds.load(std::memory_order_relaxed);
+    if ((threshold == 0) || (std::chrono::duration_cast<std::chrono::nanoseconds>(frameTime).count() <= threshold))
+    {
+        return;
+    }
+
+    // Another thread is already raising a spike
+    std::unique_lock<std::mutex> lock(registry.spikeLock, std::try_to_lock);
+    if (!lock.owns_lock() || !registry.spikeHandler)
+    {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if ((registry.lastSpikeTime != std::chrono::steady_clock::time_point{}) && (now - registry.lastSpikeTime < c_spikeCooldown))
+    {
+        return;
+    }
+    registry.lastSpikeTime = now;
+
+    RecordInstant("Frame time spike");
+
+    // Exporting locks every buffer and builds a large string, SpikeThread does it
+    registry.spikePending = true;
+    lock.unlock();
+    registry.spikeRaised.notify_one();
+}
+
+// Chrome expects microseconds, fractions keep the nanosecond precision.
+static void AppendMicroseconds(std::string& json, int64_t nanoseconds)
+{
+    json += std::to_string(nanoseconds / 1000);
+    json += '.';
+
+    const std::string fraction = std::to_string(nanoseconds % 1000);
+    json.append(3 - fraction.size(), '0');
+    json += fraction;
+}
+
+std::string TraceRecorder::ExportJson()
+{
+    struct CopiedEvent
+    {
+        const char* name;
+        int64_t startNanoseconds;
+        int64_t durationNanoseconds;
+        uint32_t threadId;
+    };
+
+    std::vector<CopiedEvent> events;
+    {
+        TraceRegistry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+
+        for (const auto& trace : registry.threads)
+        {
+            const uint64_t writtenCount = trace->writtenCount.load(std::memory_order_acquire);
+            const uint64_t firstIndex = (writtenCount > c_eventsPerThread) ? writtenCount - c_eventsPerThread : 0;
+            const size_t firstCopied = events.size();
+
+            for (uint64_t i = firstIndex; i < writtenCount; i++)
+            {
+                const TraceEvent& event = trace->events[i % c_eventsPerThread];
+                events.push_back(CopiedEvent{
+                    event.name.load(std::memory_order_relaxed),
+                    event.startNanoseconds.load(std::memory_order_relaxed),
+                    event.durationNanoseconds.load(std::memory_order_relaxed),
+                    trace->threadId });
+            }
+
+            // Drop the oldest events if the thread wrapped around onto them while they were copied
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t claimedCount = trace->claimedCount.load(std::memory_order_relaxed);
+            const uint64_t firstValidIndex = (claimedCount > c_eventsPerThread) ? claimedCount - c_eventsPerThread : 0;
+            if (firstValidIndex > firstIndex)
+            {
+                const size_t overwrittenCount = static_cast<size_t>(std::min(firstValidIndex, writtenCount) - firstIndex);
+                events.erase(events.begin() + firstCopied, events.begin() + firstCopied + overwrittenCount);
+            }
+        }
+    }
+
+    // Timestamps start at the oldest event, which keeps them short
+    int64_t origin = 0;
+    if (!events.empty())
+    {
+        origin = std::min_element(events.begin(), events.end(),
+            [](const CopiedEvent& lhs, const CopiedEvent& rhs)
+            {
+                return lhs.startNanoseconds < rhs.startNanoseconds;
+            })->startNanoseconds;
+    }
+
+    const std::string processId = std::to_string(GetCurrentProcessId());
+
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    json.reserve(json.size() + events.size() * 96);
+
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const CopiedEvent& event = events[i];
+
+        json += (i == 0) ? "{\"name\":\"" : ",{\"name\":\"";
+        json += event.name;
+        json += "\",\"ts\":";
+        AppendMicroseconds(json, event.startNanoseconds - origin);
+
+        if (event.durationNanoseconds == c_instantDuration)
+        {
+            json += ",\"ph\":\"i\",\"s\":\"t\"";
+        }
+        else
+        {
+            json += ",\"ph\":\"X\",\"dur\":";
+            AppendMicroseconds(json, event.durationNanoseconds);
+        }
+
+        json += ",\"pid\":";
+        json += processId;
+        json += ",\"tid\":";
+        json += std::to_string(event.threadId);
+        json += "}";
+    }
+
+    json += "]}";
+    return json;
+}
+
+#else
+
+std::string TraceRecorder::ExportJson()
+{
+    return "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[]}";
+}
+
+void TraceRecorder::SetSpikeHandler(std::chrono::microseconds, std::function<void(const std::string&)>)
+{
+}
+
+void TraceRecorder::RecordComplete(const char*, std::chrono::steady_clock::time_point, std::chrono::steady_clock::time_point) noexcept
+{
+}
+
+void TraceRecorder::RecordInstant(const char*) noexcept
+{
+}
+
+void TraceRecorder::ReportFrameTime(std::chrono::steady_clock::duration) noexcept
+{
+}
+
+#endif
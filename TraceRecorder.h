@@ -0,0 +1,94 @@
+#pragma once
+
+// Timeline tracing, exported in the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+// Define LAMPARRAY_ENABLE_TRACING to build it in; without it the TRACE_* macros expand to nothing
+// and ExportJson returns an empty trace.
+//
+// Every thread records into its own fixed ring buffer, taken on its first event, so recording
+// never locks or allocates. Only the latest c_eventsPerThread events of each thread are kept.
+// A thread's buffer goes back to the recorder when it exits, and is reused by the next new thread.
+// Event names are stored as pointers and must be string literals.
+
+namespace TraceRecorder
+{
+    constexpr size_t c_eventsPerThread = 4096;
+
+    // The events of every thread currently in the ring buffers, as {"traceEvents":[...]}.
+    std::string ExportJson();
+
+    // handler gets ExportJson() whenever a frame scope lasts longer than threshold, at most once
+    // every few seconds. It runs on a thread of the recorder's own, the thread that saw the spike
+    // only wakes it up. A zero threshold turns it off.
+    void SetSpikeHandler(std::chrono::microseconds threshold, std::function<void(const std::string&)> handler);
+
+    // Hot path, use the macros below rather than calling these directly.
+    void RecordComplete(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) noexcept;
+    void RecordInstant(const char* name) noexcept;
+    void ReportFrameTime(std::chrono::steady_clock::duration frameTime) noexcept;
+
+    struct ScopedEvent
+    {
+    public:
+        explicit ScopedEvent(const char* name, bool isFrame = false) noexcept :
+            m_name(name),
+            m_isFrame(isFrame),
+            m_start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~ScopedEvent()
+        {
+            const auto end = std::chrono::steady_clock::now();
+            RecordComplete(m_name, m_start, end);
+            if (m_isFrame)
+            {
+                ReportFrameTime(end - m_start);
+            }
+        }
+
+        ScopedEvent(const ScopedEvent&) = delete;
+        ScopedEvent& operator=(const ScopedEvent&) = delete;
+
+    private:
+        const char* m_name;
+        bool m_isFrame;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    // Records consecutive stages of one function without adding a scope around each of them.
+    struct LapEvents
+    {
+    public:
+        LapEvents() noexcept : m_start(std::chrono::steady_clock::now()) {}
+
+        // Records the time since the previous lap (or construction) as an event called name.
+        void Lap(const char* name) noexcept
+        {
+            const auto now = std::chrono::steady_clock::now();
+            RecordComplete(name, m_start, now);
+            m_start = now;
+        }
+
+    private:
+        std::chrono::steady_clock::time_point m_start;
+    };
+}
+
+#define TRACE_CONCATENATE_INNER(a, b) a##b
+#define TRACE_CONCATENATE(a, b) TRACE_CONCATENATE_INNER(a, b)
+
+#if defined(LAMPARRAY_ENABLE_TRACING)
+// Records the rest of the enclosing scope as an event.
+#define TRACE_SCOPE(name) TraceRecorder::ScopedEvent TRACE_CONCATENATE(traceEvent, __LINE__)(name)
+// Same, and checks its duration against the spike threshold.
+#define TRACE_FRAME_SCOPE(name) TraceRecorder::ScopedEvent TRACE_CONCATENATE(traceEvent, __LINE__)(name, true)
+#define TRACE_INSTANT(name) TraceRecorder::RecordInstant(name)
+#define TRACE_START_LAPS(laps) TraceRecorder::LapEvents laps
+#define TRACE_LAP(laps, name) laps.Lap(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_FRAME_SCOPE(name)
+#define TRACE_INSTANT(name)
+#define TRACE_START_LAPS(laps)
+#define TRACE_LAP(laps, name)
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+// Lock-free handoff of the latest value from one producer thread to one consumer thread.
+// The producer fills the back buffer and publishes it, the consumer acquires whatever was
+// published last. Neither side ever waits on the other, and a value that is overwritten
+// before being acquired is dropped, so the consumer always works on the newest one.
+// A value can be published as urgent. Dropping it passes its urgency on to the value that
+// replaced it, so the consumer never misses that something urgent happened.
+template <typename T>
+struct TripleBuffer
+{
+public:
+    // Producer side
+    T& GetBackBuffer() { return m_buffers[m_backIndex]; }
+
+    void Publish(bool isUrgent = false) noexcept
+    {
+        uint32_t previous = m_middle.load(std::memory_order_relaxed);
+        uint32_t next;
+        do
+        {
+            const bool dropsUrgent = ((previous & c_freshFlag) != 0) && ((previous & c_urgentFlag) != 0);
+            next = m_backIndex | c_freshFlag | ((isUrgent || dropsUrgent) ? c_urgentFlag : 0);
+        } while (!m_middle.compare_exchange_weak(previous, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+        m_backIndex = previous & c_indexMask;
+
+        m_publishedCount.fetch_add(1, std::memory_order_relaxed);
+        if ((previous & c_freshFlag) != 0)
+        {
+            m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Consumer side, returns false when nothing new was published since the last call.
+    bool Acquire() noexcept
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & c_freshFlag) == 0)
+        {
+            return false;
+        }
+
+        const uint32_t previous = m_middle.exchange(m_frontIndex, std::memory_order_acq_rel);
+        m_frontIndex = previous & c_indexMask;
+        m_isFrontUrgent = (previous & c_urgentFlag) != 0;
+
+        m_acquiredCount.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    const T& GetFrontBuffer() const { return m_buffers[m_frontIndex]; }
+
+    // Whether the acquired value, or any value dropped in its favor, was published as urgent.
+    bool IsFrontBufferUrgent() const noexcept { return m_isFrontUrgent; }
+
+    // Safe from any thread, only meant for statistics.
+    uint32_t GetQueueDepth() const noexcept { return (m_middle.load(std::memory_order_relaxed) & c_freshFlag) != 0 ? 1 : 0; }
+    uint64_t GetPublishedCount() const noexcept { return m_publishedCount.load(std::memory_order_relaxed); }
+    uint64_t GetAcquiredCount() const noexcept { return m_acquiredCount.load(std::memory_order_relaxed); }
+    uint64_t GetDroppedCount() const noexcept { return m_droppedCount.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t c_indexMask = 0x3;
+    static constexpr uint32_t c_freshFlag = 0x4;
+    static constexpr uint32_t c_urgentFlag = 0x8;
+
+    T m_buffers[3];
+
+    // Each side owns one index, the third one sits in the middle waiting to be swapped.
+    // Kept on separate cache lines so the two threads don't invalidate each other.
+    alignas(64) uint32_t m_backIndex = 0;
+    alignas(64) std::atomic<uint32_t> m_middle{ 1 };
+    alignas(64) uint32_t m_frontIndex = 2;
+    bool m_isFrontUrgent = false;
+
+    std::atomic<uint64_t> m_publishedCount{};
+    std::atomic<uint64_t> m_acquiredCount{};
+    std::atomic<uint64_t> m_droppedCount{};
+};
@@ -0,0 +1,199 @@
+#include "pch.h"
+#include "WorkStealingThreadPool.h"
+
+WorkStealingThreadPool::WorkStealingThreadPool(uint32_t threadCount)
+{
+    threadCount = std::max(threadCount, 1u);
+
+    m_queues.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        m_queues.push_back(std::make_unique<TaskRange>());
+    }
+
+    m_threads.reserve(threadCount - 1);
+    for (uint32_t i = 1; i < threadCount; i++)
+    {
+        m_threads.emplace_back([this, i]() { WorkerThread(i); });
+    }
+}
+
+WorkStealingThreadPool::~WorkStealingThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_jobLock);
+        m_stopRequested = true;
+    }
+    m_jobStarted.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+uint32_t WorkStealingThreadPool::GetPhysicalCoreCount()
+{
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> processors(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (processors.empty() || !GetLogicalProcessorInformation(processors.data(), &length))
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    uint32_t coreCount = 0;
+    for (const auto& processor : processors)
+    {
+        if (processor.Relationship == RelationProcessorCore)
+        {
+            coreCount++;
+        }
+    }
+
+    return std::max(coreCount, 1u);
+}
+
+void WorkStealingThreadPool::ParallelFor(size_t taskCount, const std::function<void(size_t)>& task)
+{
+    if (taskCount == 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> parallelForLock(m_parallelForLock);
+
+    // Deal out equal contiguous ranges, stealing evens out the rest
+    const size_t threadCount = m_queues.size();
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_queues[i]->lock);
+        m_queues[i]->begin = (taskCount * i) / threadCount;
+        m_queues[i]->end = (taskCount * (i + 1)) / threadCount;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_jobLock);
+        m_task = &task;
+        m_busyWorkerCount = static_cast<uint32_t>(m_threads.size());
+        m_jobGeneration++;
+    }
+    m_jobStarted.notify_all();
+
+    RunTasks(0);
+
+    // Workers only report in once nothing is left to steal, so all tasks completed after this
+    std::unique_lock<std::mutex> lock(m_jobLock);
+    m_jobCompleted.wait(lock, [&]() { return m_busyWorkerCount == 0; });
+    m_task = nullptr;
+}
+
+void WorkStealingThreadPool::WorkerThread(uint32_t index)
+{
+    uint64_t lastJobGeneration = 0;
+
+    std::unique_lock<std::mutex> lock(m_jobLock);
+    for (;;)
+    {
+        m_jobStarted.wait(lock, [&]() { return m_stopRequested || (m_jobGeneration != lastJobGeneration); });
+        if (m_stopRequested)
+        {
+            break;
+        }
+
+        lastJobGeneration = m_jobGeneration;
+        lock.unlock();
+
+        RunTasks(index);
+
+        lock.lock();
+        if (--m_busyWorkerCount == 0)
+        {
+            m_jobCompleted.notify_one();
+        }
+    }
+}
+
+void WorkStealingThreadPool::RunTasks(uint32_t index)
+{
+    const std::function<void(size_t)>& task = *m_task;
+
+    size_t taskIndex;
+    for (;;)
+    {
+        while (TryTakeTask(index, taskIndex))
+        {
+            task(taskIndex);
+        }
+
+        if (!TryStealTasks(index))
+        {
+            break;
+        }
+    }
+}
+
+bool WorkStealingThreadPool::TryTakeTask(uint32_t index, size_t& task)
+{
+    TaskRange& range = *m_queues[index];
+    std::lock_guard<std::mutex> lock(range.lock);
+
+    if (range.begin == range.end)
+    {
+        return false;
+    }
+
+    task = range.begin++;
+    return true;
+}
+
+bool WorkStealingThreadPool::TryStealTasks(uint32_t index)
+{
+    // Go after the thread with the most work left
+    size_t victim = index;
+    size_t victimTaskCount = 0;
+    for (size_t i = 0; i < m_queues.size(); i++)
+    {
+        if (i == index)
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_queues[i]->lock);
+        const size_t taskCount = m_queues[i]->end - m_queues[i]->begin;
+        if (taskCount > victimTaskCount)
+        {
+            victim = i;
+            victimTaskCount = taskCount;
+        }
+    }
+
+    if (victimTaskCount == 0)
+    {
+        return false;
+    }
+
+    size_t stolenBegin, stolenEnd;
+    {
+        TaskRange& range = *m_queues[victim];
+        std::lock_guard<std::mutex> lock(range.lock);
+
+        if (range.begin == range.end)
+        {
+            // Someone got there first, look again
+            return true;
+        }
+
+        // Take the back half, the victim keeps working from the front
+        stolenEnd = range.end;
+        stolenBegin = range.begin + (range.end - range.begin) / 2;
+        range.end = stolenBegin;
+    }
+
+    TaskRange& ownRange = *m_queues[index];
+    std::lock_guard<std::mutex> lock(ownRange.lock);
+    ownRange.begin = stolenBegin;
+    ownRange.end = stolenEnd;
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Fixed set of threads for data-parallel loops. Tasks are dealt out to the threads as contiguous
+// ranges; a thread that runs out steals the back half of the largest range it can find, so uneven
+// tasks still keep every thread busy without any central queue.
+struct WorkStealingThreadPool
+{
+public:
+    // threadCount includes the thread calling ParallelFor, which always helps out.
+    explicit WorkStealingThreadPool(uint32_t threadCount);
+    ~WorkStealingThreadPool();
+
+    WorkStealingThreadPool(const WorkStealingThreadPool&) = delete;
+    WorkStealingThreadPool& operator=(const WorkStealingThreadPool&) = delete;
+
+    uint32_t GetThreadCount() const { return static_cast<uint32_t>(m_queues.size()); }
+
+    // Runs task(0) ... task(taskCount - 1) across all threads and returns once they all completed.
+    // task must not throw. Calls from different threads are serialized.
+    void ParallelFor(size_t taskCount, const std::function<void(size_t)>& task);
+
+    // One thread per physical core, hyperthreads share the same caches and execution units.
+    static uint32_t GetPhysicalCoreCount();
+
+private:
+    // Tasks [begin, end) left for one thread
+    struct alignas(64) TaskRange
+    {
+        std::mutex lock;
+        size_t begin;
+        size_t end;
+    };
+
+    void WorkerThread(uint32_t index);
+    void RunTasks(uint32_t index);
+    bool TryTakeTask(uint32_t index, size_t& task);
+    bool TryStealTasks(uint32_t index);
+
+    // m_queues[0] belongs to the thread calling ParallelFor
+    std::vector<std::unique_ptr<TaskRange>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_parallelForLock;
+
+    std::mutex m_jobLock;
+    std::condition_variable m_jobStarted;
+    std::condition_variable m_jobCompleted;
+    const std::function<void(size_t)>* m_task{};
+    uint64_t m_jobGeneration{};
+    uint32_t m_busyWorkerCount{};
+    bool m_stopRequested{};
+};